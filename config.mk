@@ -1,3 +1,5 @@
 PREFIX = /usr/local
 .DEFAULT_GOAL = debug
 WITH_LAME = yes
+WITH_URING = no
+WITH_ZSTD = no
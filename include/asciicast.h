@@ -0,0 +1,50 @@
+#ifndef ASCIICAST_H
+#define ASCIICAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "evwriter.h"
+
+enum {
+	/* Spaces reserved after the opening brace of the header for the
+	 * duration, which is only known at the end.
+	 */
+	ASCIICAST_HEADER_PAD = 32,
+};
+
+/* Header fields. cmd and title are already JSON-escaped; env is a
+ * serialized JSON object.
+ */
+struct cast_header {
+	int cols;
+	int rows;
+	const char *cmd;
+	const char *title;
+	const char *env;
+};
+
+/* Writes asciicast v1 or v2 events to an evwriter. Output bytes are escaped
+ * with escape_flags; a UTF-8 sequence split across events is carried over to
+ * the next one.
+ */
+struct asciicast {
+	struct evwriter *out;
+	int version;
+	int escape_flags;
+
+	uint64_t last_at;
+	uint64_t events;
+	unsigned char carry[8];
+	size_t ncarry;
+};
+
+void asciicast_init(struct asciicast *ac, struct evwriter *out, int version,
+    int escape_flags);
+void asciicast_header(struct asciicast *ac, const struct cast_header *h);
+void asciicast_event(struct asciicast *ac, uint64_t at,
+    const unsigned char *buf, size_t len);
+void asciicast_end(struct asciicast *ac);
+void asciicast_duration(struct asciicast *ac, uint64_t duration);
+
+#endif /* ASCIICAST_H */
@@ -0,0 +1,30 @@
+#ifndef AUDIO_PCM_H
+#define AUDIO_PCM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <soundio/soundio.h>
+
+/* Captured audio is converted once, as it comes in, to what everything after
+ * capture works with: interleaved stereo in native-endian signed 16-bit
+ * samples. A kernel converts n samples of one input format that lie next to
+ * each other; with upmix, each becomes both channels of a frame.
+ */
+typedef void (*pcm_kernel)(int16_t *dst, const char *src, size_t n,
+    int upmix);
+
+/* Bytes in each frame after conversion */
+#define PCM_FRAME_BYTES	(2 * sizeof(int16_t))
+
+/* The kernel for fmt, or NULL if fmt isn't one castty records. */
+pcm_kernel pcm_kernel_for(enum SoundIoFormat fmt);
+
+/* Convert nframes frames from the channel areas left and right (the same
+ * area for mono) of samples bytes_per_sample long.
+ */
+void pcm_convert(pcm_kernel k, int bytes_per_sample, int16_t *dst,
+    const struct SoundIoChannelArea *left,
+    const struct SoundIoChannelArea *right, int nframes);
+
+#endif /* AUDIO_PCM_H */
@@ -4,9 +4,19 @@
 #include "writer.h"
 
 #ifdef WITH_LAME
-struct audio_writer *audio_writer_lame(FILE *outfile, int sample_rate, int nchannels,
-    int buf_time_s, int mono);
-#define LAME_OPT "m"
+/* With adapt, quality is lowered while the encoder can't keep up and raised
+ * again once it can. backlog says how full the ring is, in percent; added
+ * is told, from the encoder thread, of nframes of audio the encoder added
+ * that weren't captured.
+ */
+struct lame_adapt {
+	int (*backlog)(void);
+	void (*added)(int nframes);
+};
+
+struct audio_writer *audio_writer_lame(FILE *outfile, int sample_rate,
+    int mono, const struct lame_adapt *adapt);
+#define LAME_OPT "Mm"
 #else
 #define audio_writer_lame(...) (NULL)
 #define LAME_OPT ""
@@ -1,21 +1,31 @@
 #ifndef AUDIO_WRITER_H
 #define AUDIO_WRITER_H
 
+#include <stdint.h>
 #include <stdio.h>
-#include <soundio/soundio.h>
 
+/* Writers get interleaved 16-bit stereo frames; see audio/pcm.h */
 struct audio_writer {
 	void *context;
-	void (*write)(struct audio_writer *writer, enum SoundIoFormat fmt,
-		      char *data, int size, int bytes_per_frame);
+	void (*write)(struct audio_writer *writer, int16_t *frames,
+		      int nframes);
+	/* Get what was written into the file's buffer, if it isn't yet */
+	void (*flush)(struct audio_writer *writer);
 	void (*destroy)(struct audio_writer *writer);
 };
 
 static inline void
-audio_writer_write(struct audio_writer *writer, enum SoundIoFormat fmt,
-		   char *data, int size, int bytes_per_frame)
+audio_writer_write(struct audio_writer *writer, int16_t *frames, int nframes)
 {
-	writer->write(writer, fmt, data, size, bytes_per_frame);
+	writer->write(writer, frames, nframes);
+}
+
+static inline void
+audio_writer_flush(struct audio_writer *writer)
+{
+	if (writer->flush != NULL) {
+		writer->flush(writer);
+	}
 }
 
 static inline void
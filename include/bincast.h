@@ -0,0 +1,80 @@
+#ifndef BINCAST_H
+#define BINCAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "asciicast.h"
+#include "bytebuf.h"
+#include "evwriter.h"
+
+/* Compact binary cast format. Integers are unsigned LEB128 varints and
+ * strings are a varint length followed by that many bytes.
+ *
+ * header:  "CASTTYB" BINCAST_VERSION
+ *          cols rows command title env
+ * block:   'B' nevents tslen lenlen datalen
+ *          timestamps[tslen] lengths[lenlen] data[datalen]
+ * trailer: 'E' duration
+ *
+ * command, title and env are stored as they appear in the JSON header
+ * (escaped strings, and a JSON object for env). Timestamps are microseconds
+ * since the start of the recording, stored as zigzag-encoded deltas of
+ * deltas; both start from zero in each block, so blocks decode on their own.
+ * Lengths are the size of each event's slice of data, which is the raw pty
+ * output. A recording that was cut short has no trailer.
+ */
+
+#define BINCAST_MAGIC "CASTTYB"
+
+enum {
+	BINCAST_VERSION = 1,
+
+	/* A block is written once it reaches either of these */
+	BINCAST_BLOCK_EVENTS = 4096,
+	BINCAST_BLOCK_BYTES = 64 * 1024,
+};
+
+struct bincast {
+	struct evwriter *out;
+
+	/* Block being built */
+	size_t nevents;
+	uint64_t first_at;
+	uint64_t prev_at;
+	int64_t prev_delta;
+	struct bytebuf ts;
+	struct bytebuf lens;
+	struct bytebuf data;
+};
+
+struct bincast_reader {
+	const unsigned char *p;
+	const unsigned char *end;
+
+	struct cast_header header;
+	int has_duration;
+	uint64_t duration;
+
+	/* Block being read */
+	size_t left;
+	uint64_t at;
+	int64_t delta;
+	const unsigned char *ts, *tsend;
+	const unsigned char *lens, *lensend;
+	const unsigned char *data, *dataend;
+};
+
+void bincast_init(struct bincast *bc, struct evwriter *out);
+void bincast_header(struct bincast *bc, const struct cast_header *h);
+void bincast_event(struct bincast *bc, uint64_t at, const unsigned char *buf,
+    size_t len);
+void bincast_flush(struct bincast *bc);
+void bincast_end(struct bincast *bc, uint64_t duration);
+
+int bincast_open(struct bincast_reader *r, const void *buf, size_t len);
+int bincast_next(struct bincast_reader *r, uint64_t *at,
+    const unsigned char **data, size_t *len);
+void bincast_close(struct bincast_reader *r);
+
+#endif /* BINCAST_H */
@@ -0,0 +1,19 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <stddef.h>
+
+/* Live view of a recording over HTTP. A viewer that asks for a WebSocket
+ * gets a text frame with the screen size as JSON ({"width": .., "height":
+ * ..}), then binary frames of terminal output; anything else gets a plain
+ * response streaming the output, for viewing with e.g. curl -N in a
+ * terminal. Either way, the output starts with a repaint of the current
+ * screen.
+ */
+
+int broadcast_listen(const char *spec);
+void broadcast_start(int fd, int rows, int cols);
+void broadcast_output(const void *buf, size_t len);
+void broadcast_stop(void);
+
+#endif /* BROADCAST_H */
@@ -0,0 +1,31 @@
+#ifndef BYTEBUF_H
+#define BYTEBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Growable byte buffer for building output in memory. */
+struct bytebuf {
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+};
+
+void bytebuf_grow(struct bytebuf *b, size_t len);
+void bytebuf_put(struct bytebuf *b, const void *data, size_t len);
+void bytebuf_printf(struct bytebuf *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void bytebuf_free(struct bytebuf *b);
+
+static inline void
+bytebuf_putc(struct bytebuf *b, unsigned char c)
+{
+
+	if (b->len == b->size) {
+		bytebuf_grow(b, 1);
+	}
+
+	b->buf[b->len++] = c;
+}
+
+#endif /* BYTEBUF_H */
@@ -6,19 +6,27 @@
 #include <signal.h>
 #include <termios.h>
 
+void altstack(void);
+void resize_pty(void);
 void setup_sighandlers(void);
 
 void xclose(int);
 int xdup2(int, int);
 void xfclose(FILE *);
+void xfdatasync(int);
 FILE *xfopen(const char *, const char *);
 void xsigaction(int signum, const struct sigaction *act, struct sigaction *oldact);
 void xtcgetattr(int, struct termios *);
 void xtcsetattr(int, int, const struct termios *);
 size_t xwrite(int, void *, size_t);
+void xwrite_all(int, const void *, size_t);
 
 #ifndef MIN
-#define MIN(a, b) ((a < b) ? a : b)
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
 #endif
 
 #endif
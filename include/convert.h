@@ -0,0 +1,6 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+int convert_main(int, char **);
+
+#endif /* CONVERT_H */
@@ -0,0 +1,14 @@
+#ifndef EVWRITER_ZSTD_H
+#define EVWRITER_ZSTD_H
+
+#include "evwriter.h"
+
+#ifdef WITH_ZSTD
+struct evsink *evsink_zstd(int fd, const char *dictpath);
+#define ZSTD_OPT "zZ:"
+#else
+#define evsink_zstd(...) (NULL)
+#define ZSTD_OPT ""
+#endif
+
+#endif /* EVWRITER_ZSTD_H */
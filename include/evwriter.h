@@ -0,0 +1,118 @@
+#ifndef EVWRITER_H
+#define EVWRITER_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	EVWRITER_BUFSIZE = 64 * 1024,
+	EVWRITER_FLUSH_MS = 1000,
+
+	/* With syncing on, sync once this much is waiting for it */
+	EVWRITER_SYNC_BYTES = 4 * 1024 * 1024,
+};
+
+/* Where buffered data goes when it is written out. Without one, it is
+ * written to the file as-is. A sink may transform it (e.g. compress it) and
+ * is told where each record ends, along with its time in microseconds.
+ */
+struct evsink {
+	void *context;
+	void (*write)(struct evsink *sink, const void *data, size_t len);
+	void (*flush)(struct evsink *sink);
+	void (*mark)(struct evsink *sink, uint64_t at);
+	void (*destroy)(struct evsink *sink);
+};
+
+/* Buffered writer for recorded events. Data is accumulated in an owned
+ * buffer and written out when the buffer fills, when the oldest unflushed
+ * byte is older than flush_ms, or when explicitly flushed (pause, exit).
+ * flush_ms therefore bounds how much of a recording a crash can lose.
+ *
+ * That covers the recorder dying, not the machine. With a sync interval,
+ * data written out is also synced to disk with fdatasync(2), batched like
+ * a database's group commit: once sync_ms after the first write since the
+ * last sync, or once EVWRITER_SYNC_BYTES are waiting, whichever is first.
+ */
+struct evwriter {
+	int fd;
+	int timerfd;
+	int armed;
+	int flush_ms;
+	uint64_t deadline;
+
+	/* Writing to a pipe, FIFO or socket: nothing can be overwritten
+	 * later, so what is only known at the end goes at the end
+	 */
+	int stream;
+	struct evsink *sink;
+
+	/* Bytes handed to the file or sink so far, and as of the last sync */
+	uint64_t written;
+	uint64_t synced;
+
+	int sync_ms;
+	int sync_armed;
+	uint64_t sync_deadline;
+
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+};
+
+struct evwriter *evwriter_open(const char *path, size_t size, int flush_ms);
+void evwriter_close(struct evwriter *w);
+void evwriter_drain(struct evwriter *w);
+void evwriter_flush(struct evwriter *w);
+void evwriter_mark(struct evwriter *w, uint64_t at);
+unsigned char *evwriter_reserve(struct evwriter *w, size_t len);
+void evwriter_printf(struct evwriter *w, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void evwriter_pwrite(struct evwriter *w, off_t off, const void *data, size_t len);
+void evwriter_set_sink(struct evwriter *w, struct evsink *sink);
+void evwriter_set_sync(struct evwriter *w, int sync_ms);
+void evwriter_sync(struct evwriter *w);
+void evwriter_timer(struct evwriter *w);
+int evwriter_timeout(struct evwriter *w);
+void evwriter_write(struct evwriter *w, const void *data, size_t len);
+
+void evwriter_arm(struct evwriter *w);
+
+/* Account for len bytes written into space obtained from evwriter_reserve */
+static inline void
+evwriter_commit(struct evwriter *w, size_t len)
+{
+
+	if (w->len == 0 && len > 0) {
+		evwriter_arm(w);
+	}
+
+	w->len += len;
+}
+
+/* Offset in the (uncompressed) output of the next byte written */
+static inline uint64_t
+evwriter_offset(const struct evwriter *w)
+{
+
+	return w->written + w->len;
+}
+
+static inline void
+evwriter_putc(struct evwriter *w, unsigned char c)
+{
+
+	if (w->len == w->size) {
+		evwriter_drain(w);
+	}
+
+	if (w->len == 0) {
+		evwriter_arm(w);
+	}
+
+	w->buf[w->len++] = c;
+}
+
+#endif /* EVWRITER_H */
@@ -0,0 +1,87 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Log-linear histograms in the style of HdrHistogram. Values are bucketed
+ * by power of two, and each power of two is split into HIST_SUB linear
+ * steps, so a recorded value is known to within 1/HIST_SUB of itself from
+ * zero up to UINT64_MAX in a fixed 8K table. Recording is a few shifts and
+ * adds, cheap enough to leave on in the relay and audio paths.
+ *
+ * Each histogram has a single writer. The counters are atomic only so that
+ * another thread can read them while it runs; a summary taken that way may
+ * be a sample or two behind.
+ */
+
+enum {
+	HIST_SUB_BITS = 4,
+	HIST_SUB = 1 << HIST_SUB_BITS,
+	HIST_BUCKETS = (64 - HIST_SUB_BITS + 1) * HIST_SUB,
+};
+
+struct hist {
+	const char *name;
+	const char *unit;
+	/* Recorded values per unit */
+	uint64_t scale;
+
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t max;
+	_Atomic uint64_t buckets[HIST_BUCKETS];
+};
+
+#define HIST_INIT(name, unit, scale)	{ (name), (unit), (scale), 0, 0, 0, { 0 } }
+
+/* The recorder's histograms */
+extern struct hist hist_relay;		/* pty read to terminal write, ns; one
+					 * per read, or per backlog written */
+extern struct hist hist_read;		/* bytes per pty read */
+extern struct hist hist_serialize;	/* writing out one event, ns */
+extern struct hist hist_audio;		/* one audio capture callback, ns */
+extern struct hist hist_encode;		/* encoding a block of mp3, ns */
+
+void hist_print(struct hist *, FILE *);
+void hist_dump(FILE *, const char *);
+
+static inline uint64_t
+hist_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Single writer: a plain load and store, no locked read-modify-write */
+static inline void
+hist_add(_Atomic uint64_t *p, uint64_t v)
+{
+
+	atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) +
+	    v, memory_order_relaxed);
+}
+
+static inline void
+hist_record(struct hist *h, uint64_t v)
+{
+	unsigned shift = 0;
+
+	if (v >= 2 * HIST_SUB) {
+		shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	}
+
+	hist_add(&h->buckets[shift * HIST_SUB + (v >> shift)], 1);
+	hist_add(&h->count, 1);
+	hist_add(&h->sum, v);
+	if (v > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+		atomic_store_explicit(&h->max, v, memory_order_relaxed);
+	}
+}
+
+#endif /* HIST_H */
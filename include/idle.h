@@ -0,0 +1,39 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Caps idle time in an existing recording. Event times are fed through
+ * idle_map in order, and gaps between events longer than max come out as
+ * max.
+ *
+ * With paired audio, idle means no terminal events and silence in the
+ * audio. The audio is copied through in short blocks, and silence that
+ * runs past max since the last event is dropped from the audio and the
+ * cast alike. Narration over a quiet terminal is kept, and the two stay
+ * in sync.
+ */
+struct idle {
+	uint64_t max;		/* us; 0 doesn't cap */
+	uint64_t in_at;
+	uint64_t out_at;
+
+	/* Paired raw audio: interleaved 16-bit little-endian stereo */
+	FILE *ain;
+	FILE *aout;
+	int rate;
+	unsigned char *block;
+	size_t blockframes;
+	uint64_t in_frames;
+	uint64_t out_frames;
+	uint64_t quiet;
+	uint64_t keep;
+};
+
+void idle_init(struct idle *idle, uint64_t max);
+void idle_audio(struct idle *idle, FILE *in, FILE *out, int rate);
+uint64_t idle_map(struct idle *idle, uint64_t at);
+uint64_t idle_end(struct idle *idle, uint64_t duration);
+
+#endif /* IDLE_H */
@@ -0,0 +1,19 @@
+#ifndef JSONESC_H
+#define JSONESC_H
+
+#include <stddef.h>
+
+enum {
+	/* Pass valid multibyte UTF-8 through instead of \u-escaping it */
+	JSON_ESCAPE_UTF8 = 0x01,
+	/* Input ends here; don't hold back a truncated UTF-8 sequence */
+	JSON_ESCAPE_FINAL = 0x02,
+};
+
+/* Largest possible expansion of a single input byte */
+#define JSON_ESCAPE_MAX(n) ((n) * 6)
+
+size_t json_escape(char *dst, const unsigned char *src, size_t len, int flags,
+    size_t *consumed);
+
+#endif /* JSONESC_H */
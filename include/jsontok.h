@@ -0,0 +1,66 @@
+#ifndef JSONTOK_H
+#define JSONTOK_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bytebuf.h"
+
+/* Streaming JSON tokenizer. Input is read through a fixed buffer and
+ * strings are handed out in pieces, so memory use doesn't depend on the
+ * size of the document or of any value in it. Commas and colons are taken
+ * as separators and not checked, which is enough for reading casts.
+ */
+
+enum {
+	JSONTOK_BUFSIZE = 64 * 1024,
+};
+
+enum json_token {
+	JSON_ERROR = -1,
+	JSON_EOF,
+	JSON_OBJECT,
+	JSON_OBJECT_END,
+	JSON_ARRAY,
+	JSON_ARRAY_END,
+	JSON_STRING,		/* Contents follow from jsontok_string */
+	JSON_NUMBER,		/* Value in number */
+	JSON_TRUE,
+	JSON_FALSE,
+	JSON_NULL,
+};
+
+struct jsontok {
+	int fd;
+	off_t offset;		/* Of buf[0] in the file */
+	size_t pos;
+	size_t len;
+	int instring;
+	double number;
+
+	/* If set, input is copied here as it is consumed */
+	struct bytebuf *raw;
+
+	unsigned char buf[JSONTOK_BUFSIZE];
+};
+
+/* Room jsontok_string needs at the least */
+#define JSONTOK_STRING_MIN	8
+
+void jsontok_init(struct jsontok *t, int fd);
+enum json_token jsontok_next(struct jsontok *t);
+ssize_t jsontok_string(struct jsontok *t, unsigned char *dst, size_t size);
+int jsontok_skip(struct jsontok *t, enum json_token tok);
+void jsontok_seek(struct jsontok *t, off_t offset);
+
+/* Offset in the file of the next byte to be consumed */
+static inline off_t
+jsontok_offset(const struct jsontok *t)
+{
+
+	return t->offset + t->pos;
+}
+
+#endif /* JSONTOK_H */
@@ -0,0 +1,48 @@
+#ifndef KEYFRAME_H
+#define KEYFRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bytebuf.h"
+#include "vt.h"
+
+/* Screen-state keyframes for seeking. The recorder feeds every event it
+ * writes into a screen model and, at most every interval, writes the
+ * model's state to a sidecar index as one JSON object per line:
+ *
+ *   {"time": 12.3456, "event": 120, "offset": 34567, "cursor": [0, 23],
+ *    "alt": 0, "repaint": "\u001b[0m..."}
+ *
+ * time is the time of the last event the state includes, event the number
+ * of events before it (the index of the next one), and offset where that
+ * next event starts in the (uncompressed) cast. repaint is what to write to
+ * a reset terminal of the recorded size to reproduce the screen: cells,
+ * attributes, cursor, scroll region, charsets and modes. A player seeks by
+ * writing the repaint of the last keyframe at or before the target and
+ * replaying events from there.
+ */
+struct keyframes {
+	int fd;
+	uint64_t interval;
+	uint64_t last_kf;
+	uint64_t last_at;
+	uint64_t nevents;
+
+	/* The screen as of the last event, kept here unless shared */
+	struct vt *vt;
+	int shared;
+	struct bytebuf screen;
+	struct bytebuf line;
+};
+
+struct keyframes *keyframes_open(const char *path, int rows, int cols,
+    uint64_t interval);
+void keyframes_close(struct keyframes *kf);
+void keyframes_share(struct keyframes *kf, struct vt *vt);
+int keyframes_due(const struct keyframes *kf, uint64_t at);
+void keyframes_event(struct keyframes *kf, uint64_t at,
+    const unsigned char *buf, size_t len);
+void keyframes_write(struct keyframes *kf, uint64_t offset);
+
+#endif /* KEYFRAME_H */
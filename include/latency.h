@@ -0,0 +1,6 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+int latency_main(int, char **);
+
+#endif /* LATENCY_H */
@@ -0,0 +1,30 @@
+#ifndef RCLOCK_H
+#define RCLOCK_H
+
+#include <stdint.h>
+
+/* The recording clock, which output is stamped with, in microseconds.
+ * Without audio, it is CLOCK_MONOTONIC. With audio, it is the position in
+ * the audio, so that a cast stays in step with its audio however long it
+ * runs; a sound card's clock drifts from the system's by tens of parts per
+ * million, which adds up to seconds over a long recording.
+ *
+ * The audio position only moves when a capture callback hands over a
+ * period's worth of frames. In between, it is interpolated from
+ * CLOCK_MONOTONIC at the device's rate relative to it. Each callback
+ * corrects the estimate like a phase-locked loop: part of the error goes
+ * into the position and a smaller part into the rate, which smooths out
+ * callback jitter while following drift.
+ */
+
+uint64_t rclock_now(void);
+
+/* Audio capture (re)started at position pos, in microseconds. */
+void rclock_audio_start(uint64_t pos);
+
+/* Audio has been captured up to position pos. Called from the capture
+ * callback; the only writer.
+ */
+void rclock_audio(uint64_t pos);
+
+#endif /* RCLOCK_H */
@@ -2,22 +2,47 @@
 #define RECORD_H
 
 #include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include <stdint.h>
 
 enum control_command {
 	CMD_NONE,
 	CMD_CTRL_A,
 	CMD_MUTE,
 	CMD_PAUSE,
+	CMD_STATS,
 };
 
+/* The single-process recorder is built on epoll(7) and signalfd(2) */
+#ifdef __linux__
+#define SINGLE_OPT "s"
+#else
+#define SINGLE_OPT ""
+#endif
+
 struct outargs {
 	int start_paused;
+	int ascii_only;
 	int controlfd;
 	int masterfd;
 	int rows;
 	int cols;
 	int format_version;
 	int use_raw;
+	int flush_ms;
+	int sync_ms;
+	int coalesce_ms;
+	int fps;
+	int queue_mb;
+	int use_uring;
+	int use_zstd;
+	int binary;
+	int keyframe_s;
+	int max_idle_ms;
+	int broadcastfd;
+	int single;
+	int audio_buf_s;
 
 	const char *cmd;
 	const char *env;
@@ -25,12 +50,23 @@ struct outargs {
 	const char *outfn;
 	const char *devid;
 	const char *audioout;
+	const char *spill_dir;
+	const char *zstd_dict;
 };
 
+void outargs_init(struct outargs *);
 int record_main(int, char **);
 
-void inputproc(int, int);
-void outputproc(struct outargs *oa);
+void input_process(unsigned char *, ssize_t, int, int,
+    void (*)(int, void *, size_t));
+void inputproc(int, int, int);
+int outputproc(struct outargs *oa);
+void relay_command(enum control_command);
+void relay_output(unsigned char *, size_t);
+int term_fd(void);
+int term_flush(void);
+int term_waiting(void);
+int term_write(unsigned char *, size_t, uint64_t);
 void shellproc(const char *, const char *, struct winsize *, int);
 
 #endif
@@ -0,0 +1,6 @@
+#ifndef RECOVER_H
+#define RECOVER_H
+
+int recover_main(int, char **);
+
+#endif /* RECOVER_H */
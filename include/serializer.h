@@ -0,0 +1,40 @@
+#ifndef SERIALIZER_H
+#define SERIALIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "asciicast.h"
+#include "bincast.h"
+#include "evwriter.h"
+#include "keyframe.h"
+#include "vt.h"
+
+enum {
+	SERIALIZER_QUEUE_MB = 16,
+};
+
+/* Events go to bin if set, otherwise to cast. Both write to out. Written
+ * events are also fed to keyframes, if set. With fps set, output goes into a
+ * rows by cols screen model instead, and at most fps times a second an event
+ * brings the recorded screen up to date with it.
+ */
+struct serializer_args {
+	struct evwriter *out;
+	struct asciicast *cast;
+	struct bincast *bin;
+	struct keyframes *keyframes;
+	int coalesce_ms;
+	int fps;
+	int rows;
+	int cols;
+	size_t queue_size;
+};
+
+void serializer_start(const struct serializer_args *sa);
+void serializer_flush(void);
+void serializer_output(uint64_t at, const void *buf, size_t len);
+void serializer_stop(void);
+void serializer_dropped(uint64_t *events, uint64_t *bytes);
+
+#endif /* SERIALIZER_H */
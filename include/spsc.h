@@ -0,0 +1,57 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Single-producer, single-consumer ring of variable-length records. Each
+ * record is stored contiguously (the producer pads to the start of the ring
+ * rather than splitting one), so the consumer can use the payload in place.
+ * When the ring is full, records are dropped and counted rather than
+ * blocking the producer.
+ */
+
+enum spsc_type {
+	SPSC_PAD,
+	SPSC_OUTPUT,
+	SPSC_FLUSH,
+};
+
+struct spsc_rec {
+	uint32_t type;
+	uint32_t len;
+	uint64_t at;
+};
+
+struct spsc {
+	_Alignas(64) _Atomic size_t head;
+	_Alignas(64) _Atomic size_t tail;
+	_Alignas(64) _Atomic int waiting;
+	_Atomic uint64_t dropped;
+	_Atomic uint64_t dropped_bytes;
+
+	size_t size;
+	unsigned char *buf;
+	int wakefd[2];
+};
+
+struct spsc *spsc_create(size_t size);
+void spsc_destroy(struct spsc *q);
+int spsc_push(struct spsc *q, enum spsc_type type, uint64_t at,
+    const void *data, size_t len);
+struct spsc_rec *spsc_peek(struct spsc *q);
+void spsc_pop(struct spsc *q, struct spsc_rec *rec);
+int spsc_sleep(struct spsc *q);
+void spsc_interrupt(struct spsc *q);
+void spsc_wakeup(struct spsc *q);
+void spsc_woken(struct spsc *q);
+
+static inline void *
+spsc_data(struct spsc_rec *rec)
+{
+
+	return rec + 1;
+}
+
+#endif /* SPSC_H */
@@ -0,0 +1,14 @@
+#ifndef URING_H
+#define URING_H
+
+#include "record.h"
+
+#ifdef WITH_URING
+int uring_inputloop(int masterfd, int controlfd);
+int uring_outputloop(struct outargs *oa);
+#define URING_OPT "u"
+#else
+#define URING_OPT ""
+#endif
+
+#endif /* URING_H */
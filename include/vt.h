@@ -0,0 +1,122 @@
+#ifndef VT_H
+#define VT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bytebuf.h"
+
+/* Screen model of the recorded terminal: an xterm-compatible subset that
+ * covers what full-screen programs use (cursor movement, erasure, scroll
+ * regions, insert/delete, SGR colors and attributes, DEC graphics, the
+ * alternate screen and the modes that affect display). Sequences it doesn't
+ * know are parsed and ignored. Combining characters are not modelled.
+ */
+
+enum {
+	VT_MAXPARAMS = 16,
+};
+
+/* Cell attributes */
+enum {
+	VT_BOLD = 1 << 0,
+	VT_DIM = 1 << 1,
+	VT_ITALIC = 1 << 2,
+	VT_UNDERLINE = 1 << 3,
+	VT_BLINK = 1 << 4,
+	VT_REVERSE = 1 << 5,
+	VT_INVISIBLE = 1 << 6,
+	VT_STRIKE = 1 << 7,
+
+	/* Left and right halves of a double-width character */
+	VT_WIDE = 1 << 8,
+	VT_WIDE_CONT = 1 << 9,
+};
+
+/* Colors are the default, a palette index or 24-bit RGB */
+#define VT_COLOR_DEFAULT	0
+#define VT_COLOR_INDEX		0x01000000U
+#define VT_COLOR_RGB		0x02000000U
+#define VT_COLOR_TYPE(c)	((c) & 0xff000000U)
+
+/* Modes kept in the model and restored by a repaint */
+enum {
+	VT_MODE_INSERT = 1 << 0,	/* IRM */
+	VT_MODE_APPCURSOR = 1 << 1,	/* DECCKM */
+	VT_MODE_REVERSE = 1 << 2,	/* DECSCNM */
+	VT_MODE_ORIGIN = 1 << 3,	/* DECOM */
+	VT_MODE_AUTOWRAP = 1 << 4,	/* DECAWM */
+	VT_MODE_HIDECURSOR = 1 << 5,	/* DECTCEM reset */
+	VT_MODE_APPKEYPAD = 1 << 6,	/* DECKPAM */
+	VT_MODE_BRACKETPASTE = 1 << 7,
+};
+
+struct vt_cell {
+	uint32_t ch;
+	uint32_t fg;
+	uint32_t bg;
+	uint32_t attr;
+};
+
+/* What DECSC saves */
+struct vt_cursor {
+	int x;
+	int y;
+	struct vt_cell pen;
+	int origin;
+	int graphics[2];
+	int shift;
+};
+
+struct vt {
+	int rows;
+	int cols;
+
+	/* Lines of the active screen, then of each. Scrolling moves the
+	 * pointers rather than the cells.
+	 */
+	struct vt_cell **screen;
+	struct vt_cell **main;
+	struct vt_cell **alt;
+	struct vt_cell *cells;
+	int altscreen;
+
+	int x;
+	int y;
+	int wrapnext;
+	struct vt_cell pen;
+	int top;
+	int bottom;
+	unsigned modes;
+	unsigned char *tabs;
+
+	/* Character sets: G0/G1 DEC graphics or not, and which is shifted in */
+	int graphics[2];
+	int shift;
+
+	struct vt_cursor saved[2];
+
+	/* Parser */
+	int state;
+	uint32_t utf8state;
+	uint32_t codep;
+	uint32_t lastch;
+	int params[VT_MAXPARAMS];
+	int nparams;
+	char private;
+	char intermediate;
+};
+
+/* Brings a terminal in an unknown state back to what vt_repaint() expects:
+ * cancels any sequence cut off midway, leaves the alternate screen and
+ * resets modes.
+ */
+#define VT_RESET	"\x18\x1b[?1049l\x1b[!p\x1b[?2004l"
+
+struct vt *vt_create(int rows, int cols);
+void vt_destroy(struct vt *vt);
+void vt_write(struct vt *vt, const unsigned char *buf, size_t len);
+void vt_repaint(const struct vt *vt, struct bytebuf *out);
+void vt_diff(struct vt *shown, const struct vt *vt, struct bytebuf *out);
+
+#endif /* VT_H */
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "asciicast.h"
+#include "castty.h"
+#include "jsonesc.h"
+
+/* Format defined at
+ * v1 https://github.com/asciinema/asciinema/blob/master/doc/asciicast-v1.md
+ * v2 https://github.com/asciinema/asciinema/blob/master/doc/asciicast-v2.md
+ */
+
+void
+asciicast_init(struct asciicast *ac, struct evwriter *out, int version,
+    int escape_flags)
+{
+
+	memset(ac, 0, sizeof *ac);
+	ac->out = out;
+	ac->version = version;
+	ac->escape_flags = escape_flags;
+}
+
+/* With v1, we insert an empty first record to avoid the hassle of dealing
+ * with ES (still) not supporting trailing commas.
+ */
+void
+asciicast_header(struct asciicast *ac, const struct cast_header *h)
+{
+
+	evwriter_printf(ac->out,
+	    "{%*s" // have room to write duration later, unless streaming
+	    "\"version\": %d, "
+	    "\"width\": %d, "
+	    "\"height\": %d, "
+	    "\"command\": \"%s\", "
+	    "\"title\": \"%s\", "
+	    "\"env\": %s",
+	    ac->out->stream ? 0 : ASCIICAST_HEADER_PAD, "",
+	    ac->version,
+	    h->cols, h->rows,
+	    h->cmd ? h->cmd : "",
+	    h->title ? h->title : "",
+	    h->env
+	);
+	if (ac->version == 2) {
+		// v2 header finished here, data will be appended in separate lines
+		evwriter_printf(ac->out, "}\n");
+	} else if (ac->version == 1) {
+		// v1 header finished, console data is appended in structure
+		evwriter_printf(ac->out, ",\"stdout\":[[0,\"\"]\n");
+	}
+	evwriter_mark(ac->out, 0);
+}
+
+/* Escape a chunk of output straight into the writer's buffer. */
+static void
+escape_output(struct asciicast *ac, const unsigned char *buf, size_t buflen)
+{
+	enum { CHUNK = EVWRITER_BUFSIZE / JSON_ESCAPE_MAX(1) };
+	struct evwriter *out = ac->out;
+	size_t used;
+
+	if (ac->ncarry) {
+		size_t n = MIN(buflen, 4);
+
+		memcpy(&ac->carry[ac->ncarry], buf, n);
+		evwriter_commit(out, json_escape(
+		    (char *)evwriter_reserve(out, JSON_ESCAPE_MAX(ac->ncarry + n)),
+		    ac->carry, ac->ncarry + n, ac->escape_flags, &used));
+
+		if (used < ac->ncarry) {
+			/* Still incomplete; all of it waits for the next read */
+			ac->ncarry += n;
+			return;
+		}
+
+		buf += used - ac->ncarry;
+		buflen -= used - ac->ncarry;
+		ac->ncarry = 0;
+	}
+
+	while (buflen > 0) {
+		size_t n = MIN(buflen, (size_t)CHUNK);
+		int last = (n == buflen);
+
+		evwriter_commit(out, json_escape(
+		    (char *)evwriter_reserve(out, JSON_ESCAPE_MAX(n)),
+		    buf, n, ac->escape_flags, &used));
+
+		buf += used;
+		buflen -= used;
+
+		if (used < n && last) {
+			/* Read ended mid-sequence; finish it with the next one */
+			memcpy(ac->carry, buf, buflen);
+			ac->ncarry = buflen;
+			break;
+		}
+	}
+}
+
+static void
+event_open(struct asciicast *ac, uint64_t at)
+{
+
+	if (ac->version == 2) {
+		evwriter_printf(ac->out, "[%0.4f,\"o\",\"", at / 1e6);
+	} else if (ac->version == 1) {
+		evwriter_printf(ac->out, ",[%0.4f,\"", (at - ac->last_at) / 1e6);
+	}
+	ac->last_at = at;
+	ac->events++;
+}
+
+static void
+event_close(struct asciicast *ac, uint64_t at)
+{
+
+	evwriter_write(ac->out, "\"]\n", 3);
+	evwriter_mark(ac->out, at);
+}
+
+/* Output at time at (us) into the recording. */
+void
+asciicast_event(struct asciicast *ac, uint64_t at, const unsigned char *buf,
+    size_t len)
+{
+
+	event_open(ac, at);
+	escape_output(ac, buf, len);
+	event_close(ac, at);
+}
+
+void
+asciicast_end(struct asciicast *ac)
+{
+	struct evwriter *out = ac->out;
+
+	/* A character the session ended in the middle of goes out as a
+	 * replacement, in an event of its own at the time of the last one
+	 */
+	if (ac->ncarry) {
+		event_open(ac, ac->last_at);
+		evwriter_commit(out, json_escape(
+		    (char *)evwriter_reserve(out, JSON_ESCAPE_MAX(ac->ncarry)),
+		    ac->carry, ac->ncarry, ac->escape_flags | JSON_ESCAPE_FINAL,
+		    NULL));
+		ac->ncarry = 0;
+		event_close(ac, ac->last_at);
+	}
+
+	if (ac->version == 1) {
+		// closes stdout segment
+		evwriter_printf(out, out->stream ? "]" : "]}\n");
+	}
+}
+
+/* Fill in the duration (us) in the header padding. A stream gets it in a
+ * trailer instead: the last member of a v1 cast, or a final "t" event in
+ * v2 whose data is a JSON object with the duration and number of events.
+ */
+void
+asciicast_duration(struct asciicast *ac, uint64_t duration)
+{
+	char durbuf[ASCIICAST_HEADER_PAD + 1];
+
+	if (ac->out->stream && ac->version == 1) {
+		evwriter_printf(ac->out, ",\"duration\": %.9g}\n",
+		    duration / 1e6);
+		return;
+	} else if (ac->out->stream) {
+		evwriter_printf(ac->out, "[%0.4f,\"t\",\"{\\\"duration\\\": %.9g, "
+		    "\\\"events\\\": %llu}\"]\n", duration / 1e6, duration / 1e6,
+		    (unsigned long long)ac->events);
+		evwriter_mark(ac->out, duration);
+		return;
+	}
+
+	snprintf(durbuf, sizeof durbuf, "\"duration\": %.9g,", duration / 1e6);
+	evwriter_pwrite(ac->out, 1, durbuf, strlen(durbuf));
+}
@@ -1,15 +1,26 @@
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
-#include <signal.h>
 #include <unistd.h>
 
 #include <soundio/soundio.h>
 
 #include "castty.h"
+#include "hist.h"
+#include "rclock.h"
+#include "audio/pcm.h"
 #include "audio/writer.h"
 #include "audio/writer-lame.h"
 #include "audio/writer-raw.h"
@@ -33,7 +44,17 @@ static enum SoundIoFormat formats[] = {
 };
 
 enum {
+	/* Audio held in memory for the writer, unless set with -B */
 	BUF_TIME_S = 10,
+
+	/* With syncing on, sync once this much audio is waiting for it */
+	SYNC_BYTES = 4 * 1024 * 1024,
+
+	/* The writer is woken once this much audio is waiting for it */
+	WAKE_MS = 50,
+
+	/* How often stopping retries waking the backend thread */
+	STOP_RETRY_MS = 10,
 };
 
 static int rates[] = {
@@ -47,11 +68,38 @@ static int rates[] = {
 
 static struct audio_ctx {
 	const char *devid;
-	double clock;
+
+	/* Frames captured, across pauses, lost ones included */
+	uint64_t clock;
 	FILE *fout;
 	int active;
 	int mono;
 	int use_raw;
+	int sync_ms;
+	int buf_s;
+
+	/* Of the current stream, for after it's gone */
+	pcm_kernel kernel;
+	int sample_rate;
+	int wake_bytes;
+
+	/* Frames lost for want of room, which silence is still owed for.
+	 * Capture callback only, until the stream is destroyed.
+	 */
+	uint64_t owed;
+
+	/* Frames recorded as silence because they were lost, and in how
+	 * many runs
+	 */
+	uint64_t lost;
+	uint64_t losses;
+
+	/* Frames an adaptive mp3 encoder added to the audio around its
+	 * changes of level, which the clock moves on by; and how many of them
+	 * the capture callback has seen
+	 */
+	_Atomic uint64_t added;
+	uint64_t added_seen;
 
 	struct SoundIoInStream *stream;
 	struct SoundIoRingBuffer *rb;
@@ -59,38 +107,259 @@ static struct audio_ctx {
 	struct SoundIo *io;
 } ctx;
 
-static volatile int recording;
-static int post = 2;
 static int muted;
 static int mp3;
+static int adaptive;
 
 pthread_t wthread, rthread;
 
-static void *
-writer(void *priv)
+extern FILE *debug_out;
+
+/* A wakeup that stays pending until the sleeper gets to it, so none is
+ * lost between checking for work and going to sleep: an eventfd on Linux,
+ * a pipe elsewhere. Signalling never blocks, so the capture callback can.
+ */
+struct wake {
+	int rd;
+	int wr;
+};
+
+/* The capture callback wakes the writer once wake_bytes are waiting */
+static struct wake writer_wake = { -1, -1 };
+
+/* With a spill directory, audio is moved out of the ring into a temporary
+ * file there once the ring is half full, so that a writer held up by the
+ * disk or the encoder loses nothing until that fills up too. The writer
+ * catches up from the file before going back to the ring, and the file is
+ * emptied whenever it has.
+ */
+static struct {
+	int fd;
+	pthread_t thread;
+	struct wake wake;
+
+	/* Around taking from the ring, and the file's unread part [rd, wr) */
+	pthread_mutex_t lock;
+	off_t rd;
+	off_t wr;
+
+	/* The ring is moved out once this much is in it */
+	int bytes;
+	int failed;
+	uint64_t total;
+} spill = { .fd = -1, .wake = { -1, -1 },
+    .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Set by audio_stop(): first for the backend and spill threads, then,
+ * once the stream is gone, for the writer to write out the rest.
+ */
+static atomic_int stopping;
+static atomic_int finishing;
+
+/* The backend thread is done; audio_stop() waits on this */
+static pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reader_cond = PTHREAD_COND_INITIALIZER;
+static int reader_done;
+
+static void
+wake_open(struct wake *w)
 {
-	struct audio_writer *aw;
 
-	(void)priv;
+#ifdef __linux__
+	w->rd = w->wr = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (w->rd == -1) {
+		perror("eventfd");
+		exit(EXIT_FAILURE);
+	}
+#else
+	int fds[2];
+
+	if (pipe(fds) == -1) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	w->rd = fds[0];
+	w->wr = fds[1];
+#endif
+}
+
+static void
+wake_close(struct wake *w)
+{
 
-	stack_t ss;
-	memset(&ss, 0, sizeof(ss));
-	ss.ss_size = 4 * SIGSTKSZ;
-	ss.ss_sp = calloc(1, ss.ss_size);
-	if (ss.ss_sp == NULL) {
-		perror("calloc");
+	if (w->rd == -1) {
+		return;
+	}
+
+	xclose(w->rd);
+	if (w->wr != w->rd) {
+		xclose(w->wr);
+	}
+	w->rd = w->wr = -1;
+}
+
+static void
+wake_signal(struct wake *w)
+{
+	uint64_t one = 1;
+
+	if (write(w->wr, &one, sizeof one) == -1) {
+		/* Full, so a wakeup is already pending */
+	}
+}
+
+/* Sleep until woken or for timeout_ms (-1 for no limit). */
+static void
+wake_wait(struct wake *w, int timeout_ms)
+{
+	unsigned char buf[64];
+	struct pollfd pfd;
+
+	pfd.fd = w->rd;
+	pfd.events = POLLIN;
+
+	if (poll(&pfd, 1, timeout_ms) > 0) {
+		/* An eventfd reads back in one go, a pipe maybe not */
+		while (read(w->rd, buf, sizeof buf) > 0) {
+			continue;
+		}
+	}
+}
+
+static void
+spill_open(const char *dir)
+{
+	size_t len;
+	char *path;
+
+	len = strlen(dir) + sizeof "/castty-audio.XXXXXX";
+	path = malloc(len);
+	if (path == NULL) {
+		perror("malloc");
 		exit(EXIT_FAILURE);
 	}
-	sigaltstack(&ss, 0);
+	snprintf(path, len, "%s/castty-audio.XXXXXX", dir);
 
-	__sync_fetch_and_sub(&post, 1);
-	while (post > 0 || recording == 0) {
-		usleep(10);
+	spill.fd = mkstemp(path);
+	if (spill.fd == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
 	}
 
+	/* Nothing to clean up after, however the recording ends */
+	unlink(path);
+	free(path);
+
+	wake_open(&spill.wake);
+}
+
+/* Get what the writer has written onto disk. */
+static void
+sync_audio(void)
+{
+
+	if (fflush(ctx.fout) == EOF) {
+		perror("fflush");
+		exit(EXIT_FAILURE);
+	}
+	xfdatasync(fileno(ctx.fout));
+}
+
+#ifdef WITH_LAME
+/* How full the ring is, in percent, for the mp3 encoder to adapt to. */
+static int
+backlog(void)
+{
+
+	return (int)((int64_t)soundio_ring_buffer_fill_count(ctx.rb) * 100 /
+	    soundio_ring_buffer_capacity(ctx.rb));
+}
+
+static void
+added(int nframes)
+{
+
+	atomic_fetch_add(&ctx.added, nframes);
+}
+
+static const struct lame_adapt lame_adapt = { backlog, added };
+#endif
+
+/* Next audio for the writer, oldest first: what was spilled, then the
+ * ring. Without spilling, it is written straight from the ring; with it,
+ * up to size bytes are copied into buf, since the spill thread may move
+ * the ring's contents meanwhile. Returns the length, 0 if there is none.
+ */
+static int
+take(char **data, char *buf, int size)
+{
+	int n;
+
+	if (spill.fd == -1) {
+		*data = soundio_ring_buffer_read_ptr(ctx.rb);
+		return soundio_ring_buffer_fill_count(ctx.rb);
+	}
+
+	pthread_mutex_lock(&spill.lock);
+	if (spill.rd < spill.wr) {
+		n = MIN((off_t)size, spill.wr - spill.rd);
+		if (pread(spill.fd, buf, n, spill.rd) != n) {
+			perror("pread");
+			exit(EXIT_FAILURE);
+		}
+
+		spill.rd += n;
+		if (spill.rd == spill.wr) {
+			/* Caught up; the space goes back */
+			spill.rd = spill.wr = 0;
+			if (ftruncate(spill.fd, 0) == -1) {
+				perror("ftruncate");
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else {
+		n = MIN(size, soundio_ring_buffer_fill_count(ctx.rb));
+		memcpy(buf, soundio_ring_buffer_read_ptr(ctx.rb), n);
+		soundio_ring_buffer_advance_read_ptr(ctx.rb, n);
+	}
+	pthread_mutex_unlock(&spill.lock);
+
+	*data = buf;
+
+	return n;
+}
+
+/* Done with n bytes from take(). */
+static void
+taken(int n)
+{
+
+	if (spill.fd == -1) {
+		soundio_ring_buffer_advance_read_ptr(ctx.rb, n);
+	}
+}
+
+static void *
+writer(void *priv)
+{
+	struct audio_writer *aw;
+	uint64_t sync_at;
+	size_t unsynced;
+	char *buf, *data;
+	int size, n;
+
+	(void)priv;
+
+	altstack();
+
 	if (mp3) {
-		aw = audio_writer_lame(ctx.fout, ctx.stream->sample_rate,
-		    ctx.stream->layout.channel_count, BUF_TIME_S, ctx.mono);
+		aw = audio_writer_lame(ctx.fout, ctx.sample_rate, ctx.mono,
+		    adaptive ? &lame_adapt : NULL);
 	} else {
 		aw = audio_writer_raw(ctx.fout);
 	}
@@ -100,58 +369,190 @@ writer(void *priv)
 		exit(EXIT_FAILURE);
 	}
 
-	while (1) {
-		int fill_bytes = soundio_ring_buffer_fill_count(ctx.rb);
-		char *read_buf = soundio_ring_buffer_read_ptr(ctx.rb);
+	/* A second's worth at a time, for spilled audio and silence */
+	size = ctx.sample_rate * PCM_FRAME_BYTES;
+	buf = malloc(size);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
 
-		if (recording) {
-			audio_writer_write(aw, ctx.stream->format, read_buf, fill_bytes,
-			    ctx.stream->bytes_per_frame);
+	sync_at = 0;
+	unsynced = 0;
+	for (;;) {
+		/* Looked at first, so that everything that came in before
+		 * the end is still written out below.
+		 */
+		int finish = atomic_load(&finishing);
+		int timeout;
+
+		n = take(&data, buf, size);
+		if (n > 0) {
+			audio_writer_write(aw, (int16_t *)data,
+			    n / PCM_FRAME_BYTES);
+			taken(n);
+
+			if (unsynced == 0) {
+				sync_at = hist_now() + (uint64_t)ctx.sync_ms * 1000000;
+			}
+			unsynced += n;
 		}
-		soundio_ring_buffer_advance_read_ptr(ctx.rb, fill_bytes);
 
-		usleep(10);
-		if (post > 0) {
+		/* Batched like the cast's; capture keeps going into the ring
+		 * while a sync takes its time
+		 */
+		if (ctx.sync_ms > 0 && unsynced > 0 &&
+		    (unsynced >= SYNC_BYTES || hist_now() >= sync_at)) {
+			audio_writer_flush(aw);
+			sync_audio();
+			unsynced = 0;
+		}
+
+		if (n > 0) {
+			continue;
+		} else if (finish) {
 			break;
 		}
+
+		timeout = -1;
+		if (ctx.sync_ms > 0 && unsynced > 0) {
+			uint64_t now = hist_now();
+
+			timeout = (sync_at > now) ?
+			    (int)((sync_at - now + 999999) / 1000000) : 0;
+		}
+
+		/* More may have come in since; the callback only wakes us
+		 * when the ring fills up past wake_bytes.
+		 */
+		if (soundio_ring_buffer_fill_count(ctx.rb) < ctx.wake_bytes) {
+			wake_wait(&writer_wake, timeout);
+		}
+	}
+
+	/* Silence for what was lost at the very end */
+	memset(buf, 0, size);
+	while (ctx.owed > 0) {
+		n = MIN(ctx.owed, (uint64_t)ctx.sample_rate);
+		audio_writer_write(aw, (int16_t *)buf, n);
+		ctx.owed -= n;
 	}
 
+	free(buf);
 	audio_writer_destroy(aw);
 
 	return NULL;
 }
 
-double
-audio_clock_ms(void)
+/* Move what's in the ring out to the spill file whenever the ring gets
+ * half full.
+ */
+static void *
+spiller(void *priv)
+{
+
+	(void)priv;
+
+	altstack();
+
+	while (!atomic_load(&stopping)) {
+		char *p;
+		int n;
+
+		wake_wait(&spill.wake, -1);
+
+		pthread_mutex_lock(&spill.lock);
+		n = soundio_ring_buffer_fill_count(ctx.rb);
+		p = soundio_ring_buffer_read_ptr(ctx.rb);
+		if (n >= spill.bytes && !spill.failed) {
+			int done = 0;
+
+			while (done < n) {
+				ssize_t w = pwrite(spill.fd, p + done, n - done,
+				    spill.wr + done);
+
+				if (w == -1 && errno == EINTR) {
+					continue;
+				} else if (w == -1) {
+					/* Audio that doesn't fit is lost after
+					 * all, and counted
+					 */
+					perror("castty: Spilling audio");
+					spill.failed = 1;
+					break;
+				}
+				done += w;
+			}
+
+			/* Whole frames only; a partial one is written again */
+			done -= done % PCM_FRAME_BYTES;
+			soundio_ring_buffer_advance_read_ptr(ctx.rb, done);
+			spill.wr += done;
+			spill.total += done;
+		}
+		pthread_mutex_unlock(&spill.lock);
+	}
+
+	return NULL;
+}
+
+/* Read up to n frames from the device, only to throw them away. Returns
+ * how many were read.
+ */
+static int
+discard(struct SoundIoInStream *stream, int n)
 {
+	struct SoundIoChannelArea *areas;
+	int done, err;
+
+	for (done = 0; done < n; ) {
+		int nframe = n - done;
 
-	return (ctx.clock * 1000.) / (double)ctx.stream->sample_rate;
+		if ((err = soundio_instream_begin_read(stream, &areas, &nframe))) {
+			fprintf(stderr, "begin read error: %s", soundio_strerror(err));
+			exit(EXIT_FAILURE);
+		}
+
+		if (!nframe) {
+			break;
+		}
+
+		if ((err = soundio_instream_end_read(stream))) {
+			fprintf(stderr, "end read error: %s", soundio_strerror(err));
+			exit(EXIT_FAILURE);
+		}
+
+		done += nframe;
+	}
+
+	return done;
 }
 
 static void
 audio_record(struct SoundIoInStream *stream, int min_frames, int max_frames)
 {
 	struct SoundIoChannelArea *areas;
-	int err, nfree;
+	int err, nfree, nsilent, nlost, written, fill;
+	uint64_t t, nadded, pos;
 	char *buf;
 
+	(void)min_frames;
+
+	t = hist_now();
+
 	buf = soundio_ring_buffer_write_ptr(ctx.rb);
-	nfree = soundio_ring_buffer_free_count(ctx.rb) / stream->bytes_per_frame;
+	nfree = soundio_ring_buffer_free_count(ctx.rb) / PCM_FRAME_BYTES;
 
-	if (nfree < min_frames) {
-		fprintf(stderr, "ring buffer overflow\n");
-		exit(EXIT_FAILURE);
-	}
+	/* Silence stands in for frames lost earlier, ahead of anything newer */
+	nsilent = MIN(ctx.owed, (uint64_t)nfree);
+	memset(buf, 0, nsilent * PCM_FRAME_BYTES);
+	buf += nsilent * PCM_FRAME_BYTES;
+	nfree -= nsilent;
+	ctx.owed -= nsilent;
 
-	int to_write = MIN(nfree, max_frames);
+	int to_write = ctx.owed ? 0 : MIN(nfree, max_frames);
 	int remaining = to_write;
 
-	if (!recording) {
-		soundio_ring_buffer_advance_write_ptr(ctx.rb,
-		    to_write * stream->bytes_per_frame);
-		return;
-	}
-
 	while (remaining > 0) {
 		int nframe = remaining;
 
@@ -164,33 +565,14 @@ audio_record(struct SoundIoInStream *stream, int min_frames, int max_frames)
 			break;
 
 		if (!areas || muted) {
-			memset(buf, 0, nframe * stream->bytes_per_frame);
-			ctx.clock += nframe;
+			memset(buf, 0, nframe * PCM_FRAME_BYTES);
 		} else {
-			int off = nframe * stream->bytes_per_sample;
-			for (int frame = 0; frame < nframe; frame++) {
-				int ch = 0;
-				memcpy(buf, areas[ch].ptr, stream->bytes_per_sample);
-
-				if (!ctx.mono) {
-					areas[ch].ptr += areas[ch].step;
-					ch++;
-				}
-
-				/* Don't interleave when outputting MP3 */
-				if (!mp3) {
-					buf += stream->bytes_per_sample;
-					memcpy(buf, areas[ch].ptr, stream->bytes_per_sample);
-					buf += stream->bytes_per_sample;
-				} else {
-					memcpy(buf + off, areas[ch].ptr, stream->bytes_per_sample);
-					buf += stream->bytes_per_sample;
-				}
-
-				areas[ch].ptr += areas[ch].step;
-				ctx.clock++;
-			}
+			pcm_convert(ctx.kernel, stream->bytes_per_sample,
+			    (int16_t *)buf, &areas[0], &areas[ctx.mono ? 0 : 1],
+			    nframe);
 		}
+		buf += nframe * PCM_FRAME_BYTES;
+		ctx.clock += nframe;
 
 		if ((err = soundio_instream_end_read(stream))) {
 			fprintf(stderr, "end read error: %s", soundio_strerror(err));
@@ -200,7 +582,45 @@ audio_record(struct SoundIoInStream *stream, int min_frames, int max_frames)
 		remaining -= nframe;
 	}
 
-	soundio_ring_buffer_advance_write_ptr(ctx.rb, to_write * stream->bytes_per_frame);
+	/* What there's no room for is still read, rather than left to
+	 * overflow the device uncounted, and owed as silence, so the audio
+	 * keeps time with the cast.
+	 */
+	nlost = discard(stream, max_frames - to_write);
+	if (nlost > 0) {
+		if (ctx.owed == 0) {
+			ctx.losses++;
+		}
+		ctx.owed += nlost;
+		ctx.lost += nlost;
+		ctx.clock += nlost;
+	}
+
+	written = (nsilent + to_write - remaining) * PCM_FRAME_BYTES;
+	soundio_ring_buffer_advance_write_ptr(ctx.rb, written);
+
+	/* The clock keeps time with the audio as written, so it jumps over
+	 * what the encoder added rather than taking it for drift
+	 */
+	nadded = atomic_load(&ctx.added);
+	pos = (ctx.clock + nadded) * 1000000 / stream->sample_rate;
+	if (nadded != ctx.added_seen) {
+		ctx.added_seen = nadded;
+		rclock_audio_start(pos);
+	} else {
+		rclock_audio(pos);
+	}
+
+	/* Only on crossing a threshold, not for every period after */
+	fill = soundio_ring_buffer_fill_count(ctx.rb);
+	if (fill >= ctx.wake_bytes && fill - written < ctx.wake_bytes) {
+		wake_signal(&writer_wake);
+	}
+	if (spill.fd != -1 && fill >= spill.bytes && fill - written < spill.bytes) {
+		wake_signal(&spill.wake);
+	}
+
+	hist_record(&hist_audio, hist_now() - t);
 }
 
 static void *
@@ -209,34 +629,28 @@ reader(void *priv)
 
 	(void)priv;
 
-	stack_t ss;
-	memset(&ss, 0, sizeof(ss));
-	ss.ss_size = 4 * SIGSTKSZ;
-	ss.ss_sp = calloc(1, ss.ss_size);
-	if (ss.ss_sp == NULL) {
-		perror("calloc");
-		exit(EXIT_FAILURE);
-	}
-	sigaltstack(&ss, 0);
+	altstack();
 
-	__sync_fetch_and_sub(&post, 1);
-	while (post > 0 || recording == 0) {
-		usleep(10);
+	/* Backend and device events, as they come in */
+	while (!atomic_load(&stopping)) {
+		soundio_wait_events(ctx.io);
 	}
 
-	while (1) {
-		soundio_flush_events(ctx.io);
-		usleep(100);
-
-		if (post > 0) {
-			usleep(1000);
-			break;
-		}
-	}
+	pthread_mutex_lock(&reader_lock);
+	reader_done = 1;
+	pthread_cond_signal(&reader_cond);
+	pthread_mutex_unlock(&reader_lock);
 
 	return NULL;
 }
 
+void
+audio_adaptive_mp3(void)
+{
+
+	mp3 = adaptive = 1;
+}
+
 void
 audio_toggle_mp3(void)
 {
@@ -391,7 +805,7 @@ audio_start(void)
 	}
 
 	ctx.rb = soundio_ring_buffer_create(ctx.io,
-		BUF_TIME_S * ctx.stream->sample_rate * ctx.stream->bytes_per_frame);
+		ctx.buf_s * ctx.stream->sample_rate * PCM_FRAME_BYTES);
 	if (ctx.rb == NULL) {
 		fprintf(stderr, "\rCouldn't allocate ring buffer for audio\r");
 		soundio_device_unref(ctx.dev);
@@ -401,14 +815,25 @@ audio_start(void)
 		exit(EXIT_FAILURE);
 	}
 
+	ctx.kernel = pcm_kernel_for(ctx.stream->format);
+	ctx.sample_rate = ctx.stream->sample_rate;
+	ctx.wake_bytes = WAKE_MS * ctx.sample_rate / 1000 * PCM_FRAME_BYTES;
+	spill.bytes = soundio_ring_buffer_capacity(ctx.rb) / 2;
+	atomic_store(&stopping, 0);
+	atomic_store(&finishing, 0);
+	reader_done = 0;
+
+	/* Before the first callback can come in */
+	ctx.added_seen = atomic_load(&ctx.added);
+	rclock_audio_start((ctx.clock + ctx.added_seen) * 1000000 /
+	    ctx.stream->sample_rate);
+
 	err = soundio_instream_start(ctx.stream);
 	if (err) {
 		fprintf(stderr, "Error recording: %s\n", soundio_strerror(err));
 		exit(EXIT_FAILURE);
 	}
 
-	recording = 1;
-
 	if (pthread_create(&wthread, NULL, writer, NULL) != 0) {
 		perror("pthread_create");
 		soundio_device_unref(ctx.dev);
@@ -429,19 +854,33 @@ audio_start(void)
 		exit(EXIT_FAILURE);
 	}
 
-	while (post) {
-		usleep(10);
+	if (spill.fd != -1 &&
+	    pthread_create(&spill.thread, NULL, spiller, NULL) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
 	}
 }
 
+/* With sync_ms, audio written is synced to disk at most sync_ms later.
+ * Up to buf_s seconds of audio wait in memory for the writer, and with a
+ * spill_dir, what doesn't fit waits in a file there.
+ */
 void
-audio_init(const char *devid, const char *outfile, int use_raw)
+audio_init(const char *devid, const char *outfile, int use_raw, int sync_ms,
+    int buf_s, const char *spill_dir)
 {
 
 	ctx.active = 1;
 	ctx.fout = xfopen(outfile, "wb");
 	ctx.devid = devid;
 	ctx.use_raw = use_raw;
+	ctx.sync_ms = sync_ms;
+	ctx.buf_s = buf_s ? buf_s : BUF_TIME_S;
+	wake_open(&writer_wake);
+
+	if (spill_dir != NULL) {
+		spill_open(spill_dir);
+	}
 }
 
 void
@@ -452,18 +891,47 @@ audio_stop(void)
 		return;
 	}
 
-	if (ctx.io) {
-		soundio_flush_events(ctx.io);
-		usleep(100);
+	atomic_store(&stopping, 1);
+	if (spill.fd != -1) {
+		wake_signal(&spill.wake);
+		pthread_join(spill.thread, NULL);
 	}
 
-	post = 2;
+	/* Some backends drop a wakeup that comes in before the thread is
+	 * waiting, so it is repeated until the thread is done.
+	 */
+	pthread_mutex_lock(&reader_lock);
+	while (!reader_done) {
+		struct timespec ts;
 
-	pthread_join(wthread, NULL);
+		soundio_wakeup(ctx.io);
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += STOP_RETRY_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&reader_cond, &reader_lock, &ts);
+	}
+	pthread_mutex_unlock(&reader_lock);
 	pthread_join(rthread, NULL);
 
+	/* With capture over, what's owed is settled; the writer writes out
+	 * all that's left.
+	 */
 	if (ctx.stream) {
 		soundio_instream_destroy(ctx.stream);
+		ctx.stream = NULL;
+	}
+
+	atomic_store(&finishing, 1);
+	wake_signal(&writer_wake);
+	pthread_join(wthread, NULL);
+
+	if (ctx.rb) {
+		soundio_ring_buffer_destroy(ctx.rb);
+		ctx.rb = NULL;
 	}
 
 	if (ctx.dev) {
@@ -480,8 +948,32 @@ audio_exit(void)
 {
 
 	if (ctx.fout) {
+		if (ctx.sync_ms > 0) {
+			sync_audio();
+		}
 		xfclose(ctx.fout);
 	}
+
+	wake_close(&writer_wake);
+	if (spill.fd != -1) {
+		wake_close(&spill.wake);
+		xclose(spill.fd);
+	}
+
+	if (ctx.lost) {
+		fprintf(stderr, "castty: %llu frames (%.3f seconds) of audio were "
+		    "lost in %llu gap%s and recorded as silence\r\n",
+		    (unsigned long long)ctx.lost,
+		    (double)ctx.lost / ctx.sample_rate,
+		    (unsigned long long)ctx.losses, ctx.losses == 1 ? "" : "s");
+	}
+
+	if (debug_out && (ctx.lost || spill.total)) {
+		fprintf(debug_out, "audio: %llu bytes spilled, %llu frames lost "
+		    "in %llu gaps\n", (unsigned long long)spill.total,
+		    (unsigned long long)ctx.lost,
+		    (unsigned long long)ctx.losses);
+	}
 }
 
 void
@@ -0,0 +1,281 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "audio/pcm.h"
+
+/* Conversion of captured audio to 16-bit stereo. Every format castty asks
+ * the device for has a kernel, which with SSE2 converts eight samples at a
+ * time, byte-swapping big-endian ones and upmixing mono in the same pass;
+ * what's left over, and everything without SSE2, is done a sample at a
+ * time. Integer samples keep their top 16 bits. Floats are scaled, clamped
+ * and rounded half away from zero, the same either way.
+ */
+
+enum type {
+	T_FLOAT,
+	T_S32,
+	T_U32,
+	T_S24,	/* In the low three bytes of four */
+	T_U24,
+	T_S16,
+	T_U16,
+};
+
+static inline uint32_t
+load32(const char *p, int be)
+{
+	const unsigned char *b = (const unsigned char *)p;
+
+	if (be) {
+		return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 |
+		    (uint32_t)b[2] << 8 | b[3];
+	}
+
+	return (uint32_t)b[3] << 24 | (uint32_t)b[2] << 16 |
+	    (uint32_t)b[1] << 8 | b[0];
+}
+
+static inline uint16_t
+load16(const char *p, int be)
+{
+	const unsigned char *b = (const unsigned char *)p;
+
+	return be ? (uint16_t)(b[0] << 8 | b[1]) : (uint16_t)(b[1] << 8 | b[0]);
+}
+
+static inline int16_t
+from_float(uint32_t bits)
+{
+	float x;
+
+	memcpy(&x, &bits, sizeof x);
+	x *= 32768.f;
+
+	/* NaN ends up at the bottom, as with _mm_max_ps() */
+	if (!(x > -32768.f)) {
+		x = -32768.f;
+	} else if (x > 32767.f) {
+		x = 32767.f;
+	}
+
+	return (int16_t)(x < 0 ? x - .5f : x + .5f);
+}
+
+static inline __attribute__((always_inline)) int16_t
+sample(const char *p, enum type type, int be)
+{
+
+	switch (type) {
+	case T_FLOAT:
+		return from_float(load32(p, be));
+	case T_S32:
+		return (int16_t)(load32(p, be) >> 16);
+	case T_U32:
+		return (int16_t)((load32(p, be) >> 16) ^ 0x8000);
+	case T_S24:
+		return (int16_t)(load32(p, be) >> 8);
+	case T_U24:
+		return (int16_t)((load32(p, be) >> 8) ^ 0x8000);
+	case T_S16:
+		return (int16_t)load16(p, be);
+	case T_U16:
+	default:
+		return (int16_t)(load16(p, be) ^ 0x8000);
+	}
+}
+
+#if defined(__SSE2__)
+static inline __m128i
+bswap16x8(__m128i v)
+{
+
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static inline __m128i
+bswap32x4(__m128i v)
+{
+
+	/* The bytes of each half, then the halves */
+	v = bswap16x8(v);
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+/* Four 32-bit samples to integers in 16-bit range */
+static inline __attribute__((always_inline)) __m128i
+vec4(const char *p, enum type type, int be)
+{
+	const __m128i sign = _mm_set1_epi32(INT32_MIN);
+	__m128i v;
+	__m128 x;
+
+	v = _mm_loadu_si128((const __m128i *)p);
+	if (be) {
+		v = bswap32x4(v);
+	}
+
+	switch (type) {
+	case T_FLOAT:
+		x = _mm_mul_ps(_mm_castsi128_ps(v), _mm_set1_ps(32768.f));
+		x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-32768.f)),
+		    _mm_set1_ps(32767.f));
+		x = _mm_add_ps(x, _mm_or_ps(_mm_set1_ps(.5f),
+		    _mm_and_ps(x, _mm_set1_ps(-0.f))));
+		return _mm_cvttps_epi32(x);
+	case T_S32:
+		return _mm_srai_epi32(v, 16);
+	case T_U32:
+		return _mm_srai_epi32(_mm_xor_si128(v, sign), 16);
+	case T_S24:
+		return _mm_srai_epi32(_mm_slli_epi32(v, 8), 16);
+	case T_U24:
+	default:
+		return _mm_srai_epi32(_mm_xor_si128(_mm_slli_epi32(v, 8), sign),
+		    16);
+	}
+}
+
+/* Eight samples to 16 bits */
+static inline __attribute__((always_inline)) __m128i
+vec8(const char *p, enum type type, int be)
+{
+	__m128i v;
+
+	if (type != T_S16 && type != T_U16) {
+		return _mm_packs_epi32(vec4(p, type, be), vec4(p + 16, type, be));
+	}
+
+	v = _mm_loadu_si128((const __m128i *)p);
+	if (be) {
+		v = bswap16x8(v);
+	}
+	if (type == T_U16) {
+		v = _mm_xor_si128(v, _mm_set1_epi16((short)0x8000));
+	}
+
+	return v;
+}
+#endif
+
+/* Inlined into each kernel with constant type and be, which fold away. */
+static inline __attribute__((always_inline)) void
+convert(int16_t *dst, const char *src, size_t n, int upmix, enum type type,
+    int be)
+{
+	size_t width, i;
+
+	width = (type == T_S16 || type == T_U16) ? 2 : 4;
+	i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = vec8(src + i * width, type, be);
+
+		if (upmix) {
+			_mm_storeu_si128((__m128i *)(dst + 2 * i),
+			    _mm_unpacklo_epi16(v, v));
+			_mm_storeu_si128((__m128i *)(dst + 2 * i + 8),
+			    _mm_unpackhi_epi16(v, v));
+		} else {
+			_mm_storeu_si128((__m128i *)(dst + i), v);
+		}
+	}
+#endif
+
+	for (; i < n; i++) {
+		int16_t s = sample(src + i * width, type, be);
+
+		if (upmix) {
+			dst[2 * i] = dst[2 * i + 1] = s;
+		} else {
+			dst[i] = s;
+		}
+	}
+}
+
+#define KERNEL(name, type, be)						\
+	static void							\
+	name(int16_t *dst, const char *src, size_t n, int upmix)	\
+	{								\
+									\
+		convert(dst, src, n, upmix, type, be);			\
+	}
+
+KERNEL(f32le, T_FLOAT, 0)
+KERNEL(f32be, T_FLOAT, 1)
+KERNEL(s32le, T_S32, 0)
+KERNEL(s32be, T_S32, 1)
+KERNEL(u32le, T_U32, 0)
+KERNEL(u32be, T_U32, 1)
+KERNEL(s24le, T_S24, 0)
+KERNEL(s24be, T_S24, 1)
+KERNEL(u24le, T_U24, 0)
+KERNEL(u24be, T_U24, 1)
+KERNEL(s16le, T_S16, 0)
+KERNEL(s16be, T_S16, 1)
+KERNEL(u16le, T_U16, 0)
+KERNEL(u16be, T_U16, 1)
+
+static const struct {
+	enum SoundIoFormat fmt;
+	pcm_kernel kernel;
+} kernels[] = {
+	{ SoundIoFormatFloat32LE, f32le },
+	{ SoundIoFormatFloat32BE, f32be },
+	{ SoundIoFormatS32LE, s32le },
+	{ SoundIoFormatS32BE, s32be },
+	{ SoundIoFormatU32LE, u32le },
+	{ SoundIoFormatU32BE, u32be },
+	{ SoundIoFormatS24LE, s24le },
+	{ SoundIoFormatS24BE, s24be },
+	{ SoundIoFormatU24LE, u24le },
+	{ SoundIoFormatU24BE, u24be },
+	{ SoundIoFormatS16LE, s16le },
+	{ SoundIoFormatS16BE, s16be },
+	{ SoundIoFormatU16LE, u16le },
+	{ SoundIoFormatU16BE, u16be },
+};
+
+pcm_kernel
+pcm_kernel_for(enum SoundIoFormat fmt)
+{
+
+	for (size_t i = 0; i < sizeof kernels / sizeof kernels[0]; i++) {
+		if (kernels[i].fmt == fmt) {
+			return kernels[i].kernel;
+		}
+	}
+
+	return NULL;
+}
+
+void
+pcm_convert(pcm_kernel k, int bytes_per_sample, int16_t *dst,
+    const struct SoundIoChannelArea *left,
+    const struct SoundIoChannelArea *right, int nframes)
+{
+
+	/* Mono, and stereo interleaved the usual way, go in one run */
+	if (left == right && left->step == bytes_per_sample) {
+		k(dst, left->ptr, nframes, 1);
+		return;
+	}
+
+	if (right->ptr == left->ptr + bytes_per_sample &&
+	    left->step == 2 * bytes_per_sample && right->step == left->step) {
+		k(dst, left->ptr, 2 * (size_t)nframes, 0);
+		return;
+	}
+
+	/* Any other layout a sample at a time */
+	for (int i = 0; i < nframes; i++) {
+		k(dst + 2 * i, left->ptr + (size_t)i * left->step, 1, 0);
+		k(dst + 2 * i + 1, right->ptr + (size_t)i * right->step, 1, 0);
+	}
+}
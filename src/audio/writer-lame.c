@@ -1,106 +1,629 @@
 #include <assert.h>
 #include <lame/lame.h>
-#include <soundio/soundio.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "castty.h"
+#include "hist.h"
+#include "audio/pcm.h"
 #include "audio/writer-lame.h"
 #include "audio/writer.h"
 
+/* MP3 encoding runs as a pipeline. The audio writer thread hands over
+ * frames, which are gathered into blocks of whole MP3 frames; an encoder
+ * thread encodes each block, and an output thread writes the result out.
+ * The stages are joined by bounded queues, so a slow disk and a slow
+ * encode can overlap, and when both fall behind the writer thread waits
+ * and the audio backs up into the ring buffer, where it is accounted for.
+ *
+ * With adaptive quality, the encoder thread watches how long each block
+ * takes against the audio in it, and how much is waiting for it, and moves
+ * between the levels below at MP3 frame boundaries. LAME's settings are
+ * fixed once it starts, so a change finishes the stream so far and starts
+ * another encoder; MP3 frames don't depend on those of another stream, so
+ * the two play back to back as one.
+ */
+
+enum {
+	/* MP3 frames in a block of audio to encode */
+	BLOCK_MP3_FRAMES = 8,
+
+	/* Blocks that can wait between two stages */
+	QUEUE_BLOCKS = 8,
+
+	/* Step down when encoding takes more than BUSY_PCT of real time, or
+	 * the ring is more than BACKLOG_PCT full, or half the blocks are
+	 * waiting; step back up when it takes under IDLE_PCT and nothing is.
+	 */
+	BUSY_PCT = 60,
+	BACKLOG_PCT = 25,
+	IDLE_PCT = 20,
+
+	/* Seconds of audio to encode at a level before stepping down, or up */
+	DOWN_S = 2,
+	UP_S = 30,
+
+	/* A change waits up to SWITCH_WAIT_S seconds of audio for two frames
+	 * in a row with no sample louder than QUIET, to make it between
+	 */
+	SWITCH_WAIT_S = 1,
+	QUIET = 512,
+};
+
+/* Encoder settings, best first. Each level is cheaper to encode than the
+ * one before, and a little worse and smaller.
+ */
+static const struct {
+	int quality;
+	int vbr_q;
+} levels[] = {
+	{ 3, 3 },
+	{ 5, 4 },
+	{ 7, 5 },
+	{ 9, 6 },
+};
+
+#define NLEVELS	((int)(sizeof levels / sizeof levels[0]))
+
+struct block {
+	unsigned char *buf;
+	size_t len;
+};
+
+/* Blocks go in at the tail and come out at the head, each filled and used
+ * in place. The producer waits while all are in use, and the consumer
+ * while none are.
+ */
+struct queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct block blocks[QUEUE_BLOCKS];
+	unsigned head;
+	unsigned tail;
+	int closed;
+};
+
 struct lame {
 	FILE *outfile;
 	lame_t lflags;
-	unsigned char *buf;
-	size_t buf_size;
+	int sample_rate;
+	int mono;
+
+	/* Frames in an MP3 frame, and in a block */
+	int framesize;
+	int block_frames;
+
+	/* Audio to encode, and encoded audio to write out */
+	struct queue pcm;
+	struct queue mp3;
+
+	/* The block being filled, if any */
+	struct block *fill;
+
+	pthread_t encoder;
+	pthread_t output;
+
+	/* NULL to stay at the best level */
+	const struct lame_adapt *adapt;
+
+	/* Encoder thread only: the current level, the one to change to,
+	 * frames encoded at the current one and waited for a quiet moment to
+	 * change in, the smoothed share of real time spent encoding, in
+	 * percent, and whether the last frame encoded was quiet
+	 */
+	int level;
+	int next;
+	uint64_t level_frames;
+	uint64_t waited;
+	unsigned load;
+	int quiet;
+
+	/* Level changes, and frames the encoder added for them */
+	int changes;
+	uint64_t added;
 };
 
+extern FILE *debug_out;
+
+/* LAME's worst case for encoding nframes */
+static size_t
+mp3_size(int nframes)
+{
+
+	return (size_t)nframes * 5 / 4 + 7200;
+}
+
 static void
-lame_write(struct audio_writer *writer, enum SoundIoFormat fmt, char *data, int size,
-    int bytes_per_frame)
+queue_init(struct queue *q, size_t size)
 {
-	int nsamples, blen = 0;
-	char *left, *right;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->head = q->tail = 0;
+	q->closed = 0;
+
+	for (int i = 0; i < QUEUE_BLOCKS; i++) {
+		q->blocks[i].buf = malloc(size);
+		if (q->blocks[i].buf == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		q->blocks[i].len = 0;
+	}
+}
+
+static void
+queue_free(struct queue *q)
+{
+
+	for (int i = 0; i < QUEUE_BLOCKS; i++) {
+		free(q->blocks[i].buf);
+	}
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+}
+
+/* The next block to fill, once there is a free one. */
+static struct block *
+queue_tail(struct queue *q)
+{
+	struct block *b;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->tail - q->head == QUEUE_BLOCKS) {
+		pthread_cond_wait(&q->cond, &q->lock);
+	}
+	b = &q->blocks[q->tail % QUEUE_BLOCKS];
+	pthread_mutex_unlock(&q->lock);
+
+	b->len = 0;
+
+	return b;
+}
+
+static void
+queue_push(struct queue *q)
+{
+
+	pthread_mutex_lock(&q->lock);
+	q->tail++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* The oldest block, once there is one; NULL once the queue is closed and
+ * empty.
+ */
+static struct block *
+queue_head(struct queue *q)
+{
+	struct block *b = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->head == q->tail && !q->closed) {
+		pthread_cond_wait(&q->cond, &q->lock);
+	}
+	if (q->head != q->tail) {
+		b = &q->blocks[q->head % QUEUE_BLOCKS];
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return b;
+}
+
+static void
+queue_pop(struct queue *q)
+{
+
+	pthread_mutex_lock(&q->lock);
+	q->head++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void
+queue_close(struct queue *q)
+{
+
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Blocks pushed and not yet done with, the one in use included. */
+static unsigned
+queue_depth(struct queue *q)
+{
+	unsigned n;
+
+	pthread_mutex_lock(&q->lock);
+	n = q->tail - q->head;
+	pthread_mutex_unlock(&q->lock);
+
+	return n;
+}
+
+/* Wait for the consumer to be done with everything pushed. */
+static void
+queue_drain(struct queue *q)
+{
+
+	pthread_mutex_lock(&q->lock);
+	while (q->head != q->tail) {
+		pthread_cond_wait(&q->cond, &q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+}
+
+static lame_t
+encoder_new(struct lame *lame, int level, int tag)
+{
+	lame_t lflags;
+
+	lflags = lame_init();
+	if (lflags == NULL) {
+		fprintf(stderr, "Couldn't initialize lame encoder\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Mono is upmixed on capture, and mixed back down by LAME */
+	lame_set_num_channels(lflags, 2);
+	lame_set_mode(lflags, lame->mono ? MONO : STEREO);
+	lame_set_error_protection(lflags, 1);
+	lame_set_in_samplerate(lflags, lame->sample_rate);
+	lame_set_findReplayGain(lflags, 1);
+	lame_set_asm_optimizations(lflags, MMX, 1);
+	lame_set_asm_optimizations(lflags, SSE, 1);
+	lame_set_quality(lflags, levels[level].quality);
+	lame_set_bWriteVbrTag(lflags, tag);
+	lame_set_VBR(lflags, vbr_mtrh);
+	lame_set_VBR_q(lflags, levels[level].vbr_q);
+	lame_set_VBR_min_bitrate_kbps(lflags, 96);
+	lame_set_VBR_max_bitrate_kbps(lflags, 320);
+
+	lame_init_params(lflags);
+
+	return lflags;
+}
+
+/* Write out what LAME still holds on to. */
+static void
+encoder_flush(struct lame *lame)
+{
+	struct block *out;
+	int blen;
+
+	out = queue_tail(&lame->mp3);
+	blen = lame_encode_flush(lame->lflags, out->buf,
+	    mp3_size(lame->block_frames));
+	out->len = blen > 0 ? blen : 0;
+	queue_push(&lame->mp3);
+}
+
+/* Finish the stream so far and go on at level. Every stream starts with
+ * LAME's encoder delay and ends padded out to a whole MP3 frame, which
+ * together make up a frame or two of audio that wasn't captured. All that
+ * was captured is kept, and the recorder is told how much was added so it
+ * can move the cast along with the audio. The next stream has no VBR tag,
+ * which belongs at the start of the file.
+ */
+static void
+encoder_restart(struct lame *lame, int level)
+{
+	int added;
+
+	encoder_flush(lame);
+	added = lame_get_encoder_delay(lame->lflags) +
+	    lame_get_encoder_padding(lame->lflags);
+	lame_close(lame->lflags);
+
+	lame->adapt->added(added);
+	lame->added += added;
+
+	lame->lflags = encoder_new(lame, level, 0);
+	lame->level = level;
+	lame->level_frames = 0;
+	lame->waited = 0;
+	lame->changes++;
+}
+
+/* Encode nframes of pcm, returning how long LAME took. */
+static uint64_t
+encode(struct lame *lame, short *pcm, int nframes)
+{
+	struct block *out;
+	uint64_t t;
+	int blen;
+
+	if (nframes == 0) {
+		return 0;
+	}
+
+	out = queue_tail(&lame->mp3);
+
+	t = hist_now();
+	blen = lame_encode_buffer_interleaved(lame->lflags, pcm, nframes,
+	    out->buf, mp3_size(lame->block_frames));
+	if (blen < 0) {
+		fprintf(stderr, "Couldn't encode audio: %d\n", blen);
+		exit(EXIT_FAILURE);
+	}
+	t = hist_now() - t;
+	out->len = blen;
+
+	queue_push(&lame->mp3);
+
+	return t;
+}
+
+static int
+quiet(const short *pcm, int nframes)
+{
+
+	for (int i = 0; i < 2 * nframes; i++) {
+		if (pcm[i] > QUIET || pcm[i] < -QUIET) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Where in a block of nframes to change level: between two quiet frames,
+ * so what the encoders add around the join is heard as part of a silence,
+ * or at the start once the change has waited long enough for one.
+ * nframes if it is to wait longer.
+ */
+static int
+switch_at(struct lame *lame, const short *pcm, int nframes)
+{
+	int fs = lame->framesize;
+
+	if (lame->waited >= (uint64_t)SWITCH_WAIT_S * lame->sample_rate) {
+		return 0;
+	}
+
+	for (int f = 0; f + fs <= nframes; f += fs) {
+		int q = quiet(pcm + 2 * f, fs);
+
+		if (q && lame->quiet) {
+			return f;
+		}
+		lame->quiet = q;
+	}
+	lame->waited += nframes;
+
+	return nframes;
+}
+
+/* After a whole block of nframes took ns to encode, pick the level for
+ * the next one. Encoding times are noisy, so they are smoothed, and a level
+ * is kept for a while before moving again.
+ */
+static void
+adapt(struct lame *lame, int nframes, uint64_t ns)
+{
+	unsigned pct, waiting;
+	int backlog, level;
+
+	pct = ns * lame->sample_rate / ((uint64_t)nframes * 10000000);
+	lame->load = (3 * lame->load + pct) / 4;
+	lame->level_frames += nframes;
+
+	waiting = queue_depth(&lame->pcm);
+	backlog = lame->adapt->backlog();
+	level = lame->level;
+
+	if (level + 1 < NLEVELS &&
+	    lame->level_frames >= (uint64_t)DOWN_S * lame->sample_rate &&
+	    (lame->load > BUSY_PCT || backlog > BACKLOG_PCT ||
+	    waiting >= QUEUE_BLOCKS / 2)) {
+		level++;
+	} else if (level > 0 &&
+	    lame->level_frames >= (uint64_t)UP_S * lame->sample_rate &&
+	    lame->load < IDLE_PCT && backlog < BACKLOG_PCT / 2 &&
+	    waiting == 0) {
+		level--;
+	}
+
+	if (level != lame->level && level != lame->next && debug_out) {
+		fprintf(debug_out, "mp3: quality level %d -> %d (encoding at "
+		    "%u%% of real time, %u blocks waiting, ring %d%% full)\n",
+		    lame->level, level, lame->load, waiting, backlog);
+	}
+
+	lame->next = level;
+}
+
+static void *
+encoder(void *priv)
+{
+	struct lame *lame = priv;
+	struct block *in;
+
+	altstack();
+
+	while ((in = queue_head(&lame->pcm)) != NULL) {
+		short *pcm = (short *)in->buf;
+		int nframes = in->len / PCM_FRAME_BYTES;
+		int at = nframes;
+		uint64_t t;
+
+		if (lame->next != lame->level) {
+			at = switch_at(lame, pcm, nframes);
+		} else {
+			lame->waited = 0;
+		}
+
+		/* Changing level only once there's more to encode means the
+		 * last stream is never empty
+		 */
+		t = encode(lame, pcm, at);
+		if (at < nframes) {
+			encoder_restart(lame, lame->next);
+			t += encode(lame, pcm + 2 * at, nframes - at);
+		}
+
+		if (lame->adapt != NULL && nframes >= lame->framesize) {
+			lame->quiet = quiet(pcm + 2 * (nframes - lame->framesize),
+			    lame->framesize);
+		}
+		queue_pop(&lame->pcm);
+
+		hist_record(&hist_encode, t);
+		if (lame->adapt != NULL && nframes == lame->block_frames) {
+			adapt(lame, nframes, t);
+		}
+	}
+
+	encoder_flush(lame);
+	queue_close(&lame->mp3);
+
+	return NULL;
+}
+
+static void *
+output(void *priv)
+{
+	struct lame *lame = priv;
+	struct block *b;
+
+	altstack();
+
+	while ((b = queue_head(&lame->mp3)) != NULL) {
+		if (b->len > 0 &&
+		    fwrite(b->buf, 1, b->len, lame->outfile) != b->len) {
+			perror("fwrite");
+			exit(EXIT_FAILURE);
+		}
+		queue_pop(&lame->mp3);
+	}
+
+	return NULL;
+}
+
+/* Hand the block being filled to the encoder. Unless this is the end,
+ * only its whole MP3 frames go; the rest starts the next block.
+ */
+static void
+commit(struct lame *lame, int end)
+{
+	size_t whole, keep;
+	struct block *b;
+
+	b = lame->fill;
+	if (b == NULL) {
+		return;
+	}
+
+	whole = (size_t)lame->framesize * PCM_FRAME_BYTES;
+	keep = end ? 0 : b->len % whole;
+	if (b->len == keep) {
+		return;
+	}
+
+	b->len -= keep;
+	queue_push(&lame->pcm);
+	lame->fill = NULL;
+
+	/* The encoder only reads what was pushed, and the next block to
+	 * fill is never the same one
+	 */
+	if (keep > 0) {
+		lame->fill = queue_tail(&lame->pcm);
+		memcpy(lame->fill->buf, b->buf + b->len, keep);
+		lame->fill->len = keep;
+	}
+}
+
+static void
+lame_write(struct audio_writer *writer, int16_t *frames, int nframes)
+{
+	size_t block_bytes;
 	struct lame *lame;
 
 	assert(writer != NULL);
-	assert(data != NULL);
+	assert(frames != NULL);
 
 	lame = writer->context;
+	block_bytes = (size_t)lame->block_frames * PCM_FRAME_BYTES;
 
-	left = data;
-	right = data + size / 2;
-	nsamples = size / bytes_per_frame;
-
-	switch (fmt) {
-	case SoundIoFormatFloat32LE:
-	case SoundIoFormatFloat32BE:
-		blen = lame_encode_buffer_ieee_float(lame->lflags,
-		    (float *)left, (float *)right, nsamples,
-		    lame->buf, lame->buf_size);
-		break;
-
-	case SoundIoFormatU32BE:
-	case SoundIoFormatU32LE:
-		blen = lame_encode_buffer_long2(lame->lflags,
-		    (long *)left, (long *)right, nsamples,
-		    lame->buf, lame->buf_size);
-		break;
-
-	case SoundIoFormatS32BE:
-	case SoundIoFormatS32LE:
-	case SoundIoFormatS24BE:
-	case SoundIoFormatS24LE:
-	case SoundIoFormatU24BE:
-	case SoundIoFormatU24LE:
-		blen = lame_encode_buffer_int(lame->lflags,
-		    (int *)left, (int *)right, nsamples,
-		    lame->buf, lame->buf_size);
-		break;
-
-	case SoundIoFormatS16BE:
-	case SoundIoFormatS16LE:
-	case SoundIoFormatU16BE:
-	case SoundIoFormatU16LE:
-		blen = lame_encode_buffer(lame->lflags,
-		     (short *)left, (short *)right, nsamples,
-		     lame->buf, lame->buf_size);
-		break;
-	default:
-		fprintf(stderr, "Invalid format\n");
-		exit(EXIT_FAILURE);
+	while (nframes > 0) {
+		struct block *b;
+		int n;
+
+		if (lame->fill == NULL) {
+			lame->fill = queue_tail(&lame->pcm);
+		}
+		b = lame->fill;
+
+		n = MIN((size_t)nframes, (block_bytes - b->len) / PCM_FRAME_BYTES);
+		memcpy(b->buf + b->len, frames, n * PCM_FRAME_BYTES);
+		b->len += n * PCM_FRAME_BYTES;
+		frames += 2 * n;
+		nframes -= n;
+
+		if (b->len == block_bytes) {
+			commit(lame, 0);
+		}
 	}
+}
+
+/* Everything handed over so far, up to the last partial MP3 frame, is
+ * encoded and in the file's buffer.
+ */
+static void
+lame_flush(struct audio_writer *writer)
+{
+	struct lame *lame;
+
+	assert(writer != NULL);
+	lame = writer->context;
 
-	fwrite(lame->buf, 1, blen, lame->outfile);
+	commit(lame, 0);
+	queue_drain(&lame->pcm);
+	queue_drain(&lame->mp3);
 }
 
 static void
 lame_destroy(struct audio_writer *writer)
 {
 	struct lame *lame;
-	int blen;
 
 	assert(writer);
 	lame = writer->context;
 
-	blen = lame_encode_flush(lame->lflags, lame->buf, lame->buf_size);
-	fwrite(lame->buf, 1, blen, lame->outfile);
+	commit(lame, 1);
+	queue_close(&lame->pcm);
+	pthread_join(lame->encoder, NULL);
+	pthread_join(lame->output, NULL);
+
+	if (debug_out && lame->changes) {
+		fprintf(debug_out, "mp3: %d quality changes, ending at level %d; "
+		    "%llu frames added for them\n", lame->changes, lame->level,
+		    (unsigned long long)lame->added);
+	}
 
 	lame_close(lame->lflags);
-	free(lame->buf);
+	queue_free(&lame->pcm);
+	queue_free(&lame->mp3);
 	free(lame);
 	free(writer);
 }
 
 struct audio_writer *
-audio_writer_lame(FILE *outfile, int sample_rate, int nchannels, int buf_time_s, int mono)
+audio_writer_lame(FILE *outfile, int sample_rate, int mono,
+    const struct lame_adapt *adapt)
 {
 	struct audio_writer *writer;
 	struct lame *lame;
 
 	assert(outfile != NULL);
 	assert(sample_rate > 0);
-	assert(nchannels > 0);
-	assert(buf_time_s >= 1);
 
 	writer = malloc(sizeof *writer);
 	if (!writer) {
@@ -115,38 +638,37 @@ audio_writer_lame(FILE *outfile, int sample_rate, int nchannels, int buf_time_s,
 	}
 
 	lame->outfile = outfile;
+	lame->sample_rate = sample_rate;
+	lame->mono = mono;
+	lame->adapt = adapt;
 
-	lame->lflags = lame_init();
-	if (lame->lflags == NULL) {
-		fprintf(stderr, "Couldn't initialize lame encoder\n");
-		exit(EXIT_FAILURE);
-	}
+	lame->level = lame->next = 0;
+	lame->level_frames = 0;
+	lame->waited = 0;
+	lame->load = 0;
+	lame->quiet = 0;
+	lame->changes = 0;
+	lame->added = 0;
 
-	lame->buf_size = 1.25 * buf_time_s * sample_rate + 7200;
-	lame->buf = malloc(lame->buf_size);
-	if (lame->buf == NULL) {
-		fprintf(stderr, "No memory for mp3 buffer\n");
-		exit(EXIT_FAILURE);
-	}
+	lame->lflags = encoder_new(lame, 0, 1);
 
-	lame_set_num_channels(lame->lflags, nchannels);
-	lame_set_mode(lame->lflags, mono ? MONO : STEREO);
-	lame_set_error_protection(lame->lflags, 1);
-	lame_set_in_samplerate(lame->lflags, sample_rate);
-	lame_set_findReplayGain(lame->lflags, 1);
-	lame_set_asm_optimizations(lame->lflags, MMX, 1);
-	lame_set_asm_optimizations(lame->lflags, SSE, 1);
-	lame_set_quality(lame->lflags, 3);
-	lame_set_bWriteVbrTag(lame->lflags, 1);
-	lame_set_VBR(lame->lflags, vbr_mtrh);
-	lame_set_VBR_q(lame->lflags, 3);
-	lame_set_VBR_min_bitrate_kbps(lame->lflags, 96);
-	lame_set_VBR_max_bitrate_kbps(lame->lflags, 320);
+	/* 1152 frames, or 576 at the lower rates of MPEG-2 */
+	lame->framesize = lame_get_framesize(lame->lflags);
+	lame->block_frames = BLOCK_MP3_FRAMES * lame->framesize;
+	lame->fill = NULL;
 
-	lame_init_params(lame->lflags);
+	queue_init(&lame->pcm, (size_t)lame->block_frames * PCM_FRAME_BYTES);
+	queue_init(&lame->mp3, mp3_size(lame->block_frames));
+
+	if (pthread_create(&lame->encoder, NULL, encoder, lame) != 0 ||
+	    pthread_create(&lame->output, NULL, output, lame) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
 
 	writer->context = lame;
 	writer->write = lame_write;
+	writer->flush = lame_flush;
 	writer->destroy = lame_destroy;
 
 	return writer;
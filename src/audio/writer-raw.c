@@ -1,8 +1,8 @@
 #include <assert.h>
-#include <soundio/soundio.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "audio/pcm.h"
 #include "audio/writer-raw.h"
 #include "audio/writer.h"
 
@@ -11,22 +11,18 @@ struct raw {
 };
 
 static void
-raw_write(struct audio_writer *writer, enum SoundIoFormat fmt, char *data, int size,
-    int bytes_per_frame)
+raw_write(struct audio_writer *writer, int16_t *frames, int nframes)
 {
 	struct raw *raw;
 	size_t amt;
 
-	(void)fmt;
-	(void)bytes_per_frame;
-
 	assert(writer != NULL);
-	assert(data != NULL);
+	assert(frames != NULL);
 
 	raw = writer->context;
 
-	amt = fwrite(data, 1, size, raw->outfile);
-	if ((int)amt != size) {
+	amt = fwrite(frames, PCM_FRAME_BYTES, nframes, raw->outfile);
+	if ((int)amt != nframes) {
 		perror("fwrite");
 		exit(EXIT_FAILURE);
 	}
@@ -67,6 +63,7 @@ audio_writer_raw(FILE *outfile)
 
 	writer->context = raw;
 	writer->write = raw_write;
+	writer->flush = NULL;
 	writer->destroy = raw_destroy;
 
 	return writer;
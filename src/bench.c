@@ -0,0 +1,591 @@
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "broadcast.h"
+#include "bytebuf.h"
+#include "castty.h"
+#include "record.h"
+#include "serializer.h"
+
+/* End-to-end throughput benchmark. Each workload is written into the slave
+ * side of a pty, as a program in the recorded shell would write it, while a
+ * forked outputproc() relays the master side to /dev/null and records it.
+ * The recorder's CPU time comes from its rusage, so the cost of generating
+ * the workload isn't counted. Bulk workloads are measured per megabyte and
+ * the interactive one per keystroke. A run whose event queue overflowed
+ * recorded only part of its input, so it is reported as such instead.
+ *
+ * Features that keep a model of the screen can be turned on as for record,
+ * to see what each costs: -t relays to a pty drained by another process,
+ * standing in for a terminal the relay keeps a model of to repaint.
+ */
+
+enum {
+	ROWS = 24,
+	COLS = 80,
+
+	/* Bulk workloads repeat a pattern of this size */
+	PATTERN_SIZE = 1024 * 1024,
+
+	/* Interactive workload: one keystroke's echo every BURST_US */
+	BURSTS = 2000,
+	BURST_US = 500,
+};
+
+struct workload {
+	const char *name;
+	void (*generate)(struct bytebuf *b);
+	int interactive;
+};
+
+struct result {
+	double secs;
+	double cpu;
+	uint64_t in;
+	uint64_t out;
+	uint64_t events;
+
+	/* Events and bytes the recorder had no room to queue */
+	uint64_t dropped[2];
+};
+
+/* Recorder features, as for castty record */
+static int fps, keyframe_s, tty;
+static const char *broadcast;
+
+static uint32_t
+rnd(uint32_t *s)
+{
+
+	*s = *s * 1103515245 + 12345;
+	return *s >> 16;
+}
+
+/* Log spew: plain ASCII lines */
+static void
+gen_ascii(struct bytebuf *b)
+{
+	static const char *levels[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+	static const char *paths[] = {
+		"/api/v1/users", "/api/v1/orders/search", "/static/app.js",
+		"/healthz", "/api/v1/sessions/refresh",
+	};
+	uint32_t s = 1;
+
+	while (b->len < PATTERN_SIZE) {
+		bytebuf_printf(b, "2026-01-%02u 12:%02u:%02u.%03u %-5s "
+		    "[worker-%u] GET %s status=%u bytes=%u took=%ums\r\n",
+		    rnd(&s) % 28 + 1, rnd(&s) % 60, rnd(&s) % 60, rnd(&s) % 1000,
+		    levels[rnd(&s) % 4], rnd(&s) % 16, paths[rnd(&s) % 5],
+		    (rnd(&s) % 8) ? 200 : 500, rnd(&s) % 65536, rnd(&s) % 250);
+	}
+}
+
+/* Text that is mostly multibyte: accented Latin, CJK, emoji, box drawing */
+static void
+gen_utf8(struct bytebuf *b)
+{
+	static const char *words[] = {
+		"héllo", "wörld", "naïve", "日本語",
+		"テキスト", "中文", "한국어",
+		"Ελληνικά",
+		"Кириллица",
+		"\U0001f600", "\U0001f680", "✓", "─┼─",
+		"→", "…",
+	};
+	uint32_t s = 2;
+
+	while (b->len < PATTERN_SIZE) {
+		int col = 0;
+
+		while (col < 60) {
+			const char *w = words[rnd(&s) % 15];
+
+			bytebuf_printf(b, "%s ", w);
+			col += strlen(w) / 2 + 1;
+		}
+		bytebuf_put(b, "\r\n", 2);
+	}
+}
+
+/* Full-screen redraws in the style of top: cursor positioning, 256-color
+ * SGR and erasure on every row.
+ */
+static void
+gen_tui(struct bytebuf *b)
+{
+	uint32_t s = 3;
+
+	for (unsigned f = 0; b->len < PATTERN_SIZE; f++) {
+		bytebuf_printf(b, "\x1b[H\x1b[1;37;44m top - 12:%02u:%02u up 3 days, "
+		    "load average: %u.%02u, %u.%02u\x1b[K\x1b[0m", f / 60 % 60,
+		    f % 60, rnd(&s) % 8, rnd(&s) % 100, rnd(&s) % 8, rnd(&s) % 100);
+
+		for (unsigned y = 2; y <= ROWS; y++) {
+			bytebuf_printf(b, "\x1b[%u;1H\x1b[38;5;%um%7u \x1b[1mproc-%-8u"
+			    "\x1b[22m \x1b[48;5;%um%5u.%u%%\x1b[49m %9uK %c\x1b[0m"
+			    "\x1b[K", y, rnd(&s) % 256, rnd(&s) % 100000,
+			    rnd(&s) % 1000, 232 + rnd(&s) % 24, rnd(&s) % 100,
+			    rnd(&s) % 10, rnd(&s) % 1000000, "RSDZ"[rnd(&s) % 4]);
+		}
+	}
+}
+
+/* Typing at a prompt: a keystroke's echo at a time, with the odd newline
+ * and prompt.
+ */
+static void
+gen_interactive(struct bytebuf *b)
+{
+	static const char *cmds[] = {
+		"ls -la", "git status", "make -j8", "vim README.md",
+		"cd ..", "grep -rn castty src",
+	};
+	uint32_t s = 4;
+
+	while (b->len < BURSTS) {
+		const char *c = cmds[rnd(&s) % 6];
+
+		bytebuf_put(b, c, strlen(c));
+		bytebuf_put(b, "\r\n$ ", 4);
+	}
+}
+
+static const struct workload workloads[] = {
+	{ "ascii", gen_ascii, 0 },
+	{ "utf8", gen_utf8, 0 },
+	{ "tui", gen_tui, 0 },
+	{ "interactive", gen_interactive, 1 },
+};
+
+static void
+usage(int status)
+{
+
+	fprintf(stderr, "usage: castty bench [-12ht] [-f <fps>] [-K <seconds>] "
+	    "[-s <MiB>] [-W <[host:]port>]\n"
+	    "                    [-w <workload>]\n"
+	    " -1             Only record asciicast v1.\n"
+	    " -2             Only record asciicast v2.\n"
+	    " -f <fps>       Record the screen at most <fps> times a second.\n"
+	    " -h             Show this help.\n"
+	    " -K <seconds>   Write keyframes at most every <seconds>.\n"
+	    " -s <MiB>       Write <MiB> of each bulk workload (default 64).\n"
+	    " -t             Relay to a terminal rather than /dev/null.\n"
+	    " -W <[host:]port>\n"
+	    "                Broadcast to viewers on <[host:]port>.\n"
+	    " -w <workload>  Only run <workload>: ascii, utf8, tui or\n"
+	    "                interactive.\n");
+	exit(status);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+cpu_children(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_CHILDREN, &ru) == -1) {
+		perror("getrusage");
+		exit(EXIT_FAILURE);
+	}
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Count the events in a cast: each starts a line, with "[" in v2 and ",["
+ * in v1.
+ */
+static uint64_t
+count_events(const char *path, int version)
+{
+	unsigned char buf[BUFSIZ];
+	uint64_t n;
+	size_t len;
+	int nl;
+	FILE *f;
+
+	f = xfopen(path, "r");
+
+	n = 0;
+	nl = 0;
+	while ((len = fread(buf, 1, sizeof buf, f)) > 0) {
+		for (size_t i = 0; i < len; i++) {
+			if (nl && buf[i] == (version == 1 ? ',' : '[')) {
+				n++;
+			}
+			nl = (buf[i] == '\n');
+		}
+	}
+	xfclose(f);
+
+	return n;
+}
+
+/* A pty whose master is opened with O_RDWR | O_NOCTTY; the slave is
+ * returned, in raw output mode, and the master in *masterp.
+ */
+static int
+open_pty(int *masterp)
+{
+	struct termios tt;
+	int master, slave;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+		perror("posix_openpt");
+		exit(EXIT_FAILURE);
+	}
+
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (slave == -1) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Output goes through untouched, as from a program in raw mode */
+	xtcgetattr(slave, &tt);
+	tt.c_oflag &= ~OPOST;
+	xtcsetattr(slave, TCSANOW, &tt);
+
+	*masterp = master;
+
+	return slave;
+}
+
+/* Read the terminal's side of the pty until the recorder goes away, as
+ * a terminal that keeps up would.
+ */
+static pid_t
+drain(int master, int slave)
+{
+	unsigned char buf[64 * 1024];
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	} else if (pid > 0) {
+		return pid;
+	}
+
+	xclose(slave);
+	while (read(master, buf, sizeof buf) > 0)
+		;
+	_exit(EXIT_SUCCESS);
+}
+
+static void
+run(const struct workload *w, const struct bytebuf *pattern, int version,
+    uint64_t size, struct result *r)
+{
+	char path[] = "/tmp/castty-bench.XXXXXX";
+	char idx[sizeof path + sizeof ".idx"];
+	int master, slave, controlfd[2], resultfd[2], status, fd, term;
+	struct outargs oa;
+	struct stat st;
+	double start, cpu;
+	pid_t pid, drainer;
+
+	fd = mkstemp(path);
+	if (fd == -1) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	xclose(fd);
+
+	/* Before the workload's pty, which the drainer mustn't hold open */
+	drainer = -1;
+	if (tty) {
+		int tmaster;
+
+		term = open_pty(&tmaster);
+		drainer = drain(tmaster, term);
+		xclose(tmaster);
+	} else {
+		term = open("/dev/null", O_WRONLY);
+		if (term == -1) {
+			perror("/dev/null");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	slave = open_pty(&master);
+
+	if (pipe(controlfd) != 0 || pipe(resultfd) != 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	outargs_init(&oa);
+	oa.masterfd = master;
+	oa.controlfd = controlfd[0];
+	oa.rows = ROWS;
+	oa.cols = COLS;
+	oa.format_version = version;
+	oa.env = "{}";
+	oa.outfn = path;
+	oa.fps = fps;
+	oa.keyframe_s = keyframe_s;
+
+	cpu = cpu_children();
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0) {
+		xdup2(term, STDOUT_FILENO);
+		xclose(term);
+		xclose(slave);
+		xclose(controlfd[1]);
+		xclose(resultfd[0]);
+
+		if (broadcast != NULL) {
+			oa.broadcastfd = broadcast_listen(broadcast);
+		}
+
+		status = outputproc(&oa);
+		serializer_dropped(&r->dropped[0], &r->dropped[1]);
+		xwrite_all(resultfd[1], r->dropped, sizeof r->dropped);
+		exit(status);
+	}
+
+	xclose(master);
+	xclose(term);
+	xclose(controlfd[0]);
+	xclose(resultfd[1]);
+
+	start = now();
+
+	r->in = 0;
+	if (w->interactive) {
+		struct timespec ts = { 0, BURST_US * 1000 };
+
+		for (size_t i = 0; i < pattern->len; i++) {
+			xwrite_all(slave, &pattern->buf[i], 1);
+			nanosleep(&ts, NULL);
+		}
+		r->in = pattern->len;
+	} else {
+		while (r->in < size) {
+			for (size_t off = 0; off < pattern->len && r->in < size;
+			    off += BUFSIZ) {
+				size_t n = MIN((size_t)BUFSIZ, pattern->len - off);
+
+				n = MIN(n, size - r->in);
+				xwrite_all(slave, &pattern->buf[off], n);
+				r->in += n;
+			}
+		}
+	}
+
+	/* The recorder finishes once it has read everything and sees the
+	 * hangup.
+	 */
+	xclose(slave);
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			perror("waitpid");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	r->secs = now() - start;
+	r->cpu = cpu_children() - cpu;
+	xclose(controlfd[1]);
+
+	/* Reaped only now, so its time isn't counted as the recorder's */
+	if (drainer != -1) {
+		waitpid(drainer, NULL, 0);
+	}
+
+	/* Nothing comes back from a recorder that failed */
+	if (read(resultfd[0], r->dropped, sizeof r->dropped) !=
+	    sizeof r->dropped) {
+		fprintf(stderr, "castty: Recorder failed on %s\n", w->name);
+		exit(EXIT_FAILURE);
+	}
+	xclose(resultfd[0]);
+
+	if (stat(path, &st) == -1) {
+		perror("stat");
+		exit(EXIT_FAILURE);
+	}
+	r->out = st.st_size;
+	r->events = count_events(path, version);
+
+	unlink(path);
+	if (keyframe_s) {
+		snprintf(idx, sizeof idx, "%s.idx", path);
+		unlink(idx);
+	}
+}
+
+int
+bench_main(int argc, char **argv)
+{
+	const char *only;
+	int ch, versions;
+	uint64_t size;
+	char *e;
+
+	size = 64;
+	versions = 1 << 1 | 1 << 2;
+	only = NULL;
+
+	while ((ch = getopt(argc, argv, "?12f:hK:s:tW:w:")) != EOF) {
+		switch (ch) {
+		case '1':
+			versions = 1 << 1;
+			break;
+		case '2':
+			versions = 1 << 2;
+			break;
+		case 's':
+			errno = 0;
+			size = strtoull(optarg, &e, 10);
+			if (e == optarg || errno != 0 || size < 1 || size > 65536) {
+				fprintf(stderr, "castty: Invalid size: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'f':
+			errno = 0;
+			fps = strtol(optarg, &e, 10);
+			if (e == optarg || errno != 0 || fps < 0 || fps > 1000 ||
+			    (*e && strcmp(e, "fps"))) {
+				fprintf(stderr, "castty: Invalid frame rate: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'K':
+			errno = 0;
+			keyframe_s = strtol(optarg, &e, 10);
+			if (e == optarg || errno != 0 || keyframe_s < 0 ||
+			    keyframe_s > 86400 || (*e && strcmp(e, "s"))) {
+				fprintf(stderr, "castty: Invalid keyframe interval: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			tty = 1;
+			break;
+		case 'W':
+			broadcast = optarg;
+			break;
+		case 'w':
+			only = optarg;
+			break;
+		case 'h':
+		case '?':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (only != NULL) {
+		unsigned i;
+
+		for (i = 0; i < sizeof workloads / sizeof workloads[0]; i++) {
+			if (strcmp(workloads[i].name, only) == 0) {
+				break;
+			}
+		}
+
+		if (i == sizeof workloads / sizeof workloads[0]) {
+			fprintf(stderr, "castty: Unknown workload: %s\n", only);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Children are reaped here, not by the handler */
+	signal(SIGCHLD, SIG_DFL);
+
+	for (unsigned i = 0, header = 0; i < sizeof workloads / sizeof workloads[0];
+	    i++) {
+		const struct workload *w = &workloads[i];
+		struct bytebuf pattern;
+
+		if (only != NULL && strcmp(w->name, only) != 0) {
+			continue;
+		}
+
+		/* A table for each kind of workload */
+		if (!(header & 1 << w->interactive)) {
+			printf("%s%-12s %-4s %10s %10s %10s %8s\n",
+			    header ? "\n" : "", "workload", "cast",
+			    w->interactive ? "keys/s" : "MB/s",
+			    w->interactive ? "events/key" : "events/s",
+			    w->interactive ? "CPU us/key" : "CPU ms/MB",
+			    w->interactive ? "B/key" : "size");
+			header |= 1 << w->interactive;
+		}
+
+		memset(&pattern, 0, sizeof pattern);
+		w->generate(&pattern);
+
+		for (int v = 1; v <= 2; v++) {
+			struct result r;
+			double mb;
+
+			if (!(versions & 1 << v)) {
+				continue;
+			}
+
+			run(w, &pattern, v, size << 20, &r);
+
+			mb = r.in / 1e6;
+			if (r.dropped[0] > 0) {
+				printf("%-12s v%-3d   incomplete: %llu events (%.1f MB) "
+				    "overflowed the queue\n", w->name, v,
+				    (unsigned long long)r.dropped[0],
+				    r.dropped[1] / 1e6);
+			} else if (w->interactive) {
+				printf("%-12s v%-3d %10.1f %10.2f %10.2f %8.1f\n",
+				    w->name, v, r.in / r.secs,
+				    (double)r.events / r.in, r.cpu * 1e6 / r.in,
+				    (double)r.out / r.in);
+			} else {
+				printf("%-12s v%-3d %10.1f %10.0f %10.2f %7.2fx\n",
+				    w->name, v, mb / r.secs, r.events / r.secs,
+				    r.cpu * 1000 / mb, (double)r.out / r.in);
+			}
+		}
+
+		bytebuf_free(&pattern);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bincast.h"
+#include "castty.h"
+
+enum {
+	/* Longest encoding of a 64-bit varint */
+	VARINT_MAX = 10,
+};
+
+static void
+put_varint(struct bytebuf *b, uint64_t v)
+{
+
+	bytebuf_grow(b, VARINT_MAX);
+
+	while (v >= 0x80) {
+		b->buf[b->len++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	b->buf[b->len++] = v;
+}
+
+static void
+put_string(struct bytebuf *b, const char *s)
+{
+	size_t len;
+
+	if (s == NULL) {
+		s = "";
+	}
+
+	len = strlen(s);
+	put_varint(b, len);
+	bytebuf_put(b, s, len);
+}
+
+static int
+get_varint(const unsigned char **pp, const unsigned char *end, uint64_t *v)
+{
+	const unsigned char *p = *pp;
+	uint64_t r = 0;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (p == end) {
+			return -1;
+		}
+
+		r |= (uint64_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*pp = p;
+			*v = r;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static char *
+get_string(const unsigned char **pp, const unsigned char *end)
+{
+	uint64_t len;
+	char *s;
+
+	if (get_varint(pp, end, &len) != 0 || len > (uint64_t)(end - *pp)) {
+		return NULL;
+	}
+
+	s = malloc(len + 1);
+	if (s == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(s, *pp, len);
+	s[len] = '\0';
+	*pp += len;
+
+	return s;
+}
+
+static uint64_t
+zigzag(int64_t v)
+{
+
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t
+unzigzag(uint64_t v)
+{
+
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+void
+bincast_init(struct bincast *bc, struct evwriter *out)
+{
+
+	memset(bc, 0, sizeof *bc);
+	bc->out = out;
+}
+
+void
+bincast_header(struct bincast *bc, const struct cast_header *h)
+{
+	struct bytebuf b;
+
+	memset(&b, 0, sizeof b);
+	bytebuf_put(&b, BINCAST_MAGIC, sizeof BINCAST_MAGIC - 1);
+	bytebuf_putc(&b, BINCAST_VERSION);
+
+	put_varint(&b, h->cols);
+	put_varint(&b, h->rows);
+	put_string(&b, h->cmd);
+	put_string(&b, h->title);
+	put_string(&b, h->env);
+
+	evwriter_write(bc->out, b.buf, b.len);
+	evwriter_mark(bc->out, 0);
+	bytebuf_free(&b);
+}
+
+/* Output at time at (us) into the recording. */
+void
+bincast_event(struct bincast *bc, uint64_t at, const unsigned char *buf,
+    size_t len)
+{
+	int64_t delta;
+
+	if (bc->nevents == 0) {
+		bc->first_at = at;
+		bc->prev_at = 0;
+		bc->prev_delta = 0;
+
+		/* The block counts as buffered output for the flush interval */
+		evwriter_arm(bc->out);
+	}
+
+	delta = at - bc->prev_at;
+	put_varint(&bc->ts, zigzag(delta - bc->prev_delta));
+	bc->prev_at = at;
+	bc->prev_delta = delta;
+
+	put_varint(&bc->lens, len);
+
+	bytebuf_put(&bc->data, buf, len);
+
+	bc->nevents++;
+
+	if (bc->nevents >= BINCAST_BLOCK_EVENTS ||
+	    bc->data.len >= BINCAST_BLOCK_BYTES || bc->out->flush_ms == 0) {
+		bincast_flush(bc);
+	}
+}
+
+/* Write out the block being built, if it has anything in it. */
+void
+bincast_flush(struct bincast *bc)
+{
+	struct bytebuf hdr;
+
+	if (bc->nevents == 0) {
+		return;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	bytebuf_putc(&hdr, 'B');
+	put_varint(&hdr, bc->nevents);
+	put_varint(&hdr, bc->ts.len);
+	put_varint(&hdr, bc->lens.len);
+	put_varint(&hdr, bc->data.len);
+
+	evwriter_write(bc->out, hdr.buf, hdr.len);
+	evwriter_write(bc->out, bc->ts.buf, bc->ts.len);
+	evwriter_write(bc->out, bc->lens.buf, bc->lens.len);
+	evwriter_write(bc->out, bc->data.buf, bc->data.len);
+	evwriter_mark(bc->out, bc->first_at);
+	bytebuf_free(&hdr);
+
+	bc->nevents = 0;
+	bc->ts.len = 0;
+	bc->lens.len = 0;
+	bc->data.len = 0;
+}
+
+/* Write the last block and the trailer, with the duration in us. */
+void
+bincast_end(struct bincast *bc, uint64_t duration)
+{
+	struct bytebuf b;
+
+	bincast_flush(bc);
+
+	memset(&b, 0, sizeof b);
+	bytebuf_putc(&b, 'E');
+	put_varint(&b, duration);
+	evwriter_write(bc->out, b.buf, b.len);
+	bytebuf_free(&b);
+
+	bytebuf_free(&bc->ts);
+	bytebuf_free(&bc->lens);
+	bytebuf_free(&bc->data);
+}
+
+/* Start reading a binary cast held in buf. Returns -1 if it isn't one. */
+int
+bincast_open(struct bincast_reader *r, const void *buf, size_t len)
+{
+	const unsigned char *p = buf, *end = p + len;
+	uint64_t cols, rows;
+
+	memset(r, 0, sizeof *r);
+
+	if (len < sizeof BINCAST_MAGIC ||
+	    memcmp(p, BINCAST_MAGIC, sizeof BINCAST_MAGIC - 1) != 0 ||
+	    p[sizeof BINCAST_MAGIC - 1] != BINCAST_VERSION) {
+		return -1;
+	}
+	p += sizeof BINCAST_MAGIC;
+
+	if (get_varint(&p, end, &cols) != 0 || get_varint(&p, end, &rows) != 0) {
+		return -1;
+	}
+	r->header.cols = cols;
+	r->header.rows = rows;
+
+	if ((r->header.cmd = get_string(&p, end)) == NULL ||
+	    (r->header.title = get_string(&p, end)) == NULL ||
+	    (r->header.env = get_string(&p, end)) == NULL) {
+		bincast_close(r);
+		return -1;
+	}
+
+	r->p = p;
+	r->end = end;
+
+	return 0;
+}
+
+static int
+next_block(struct bincast_reader *r)
+{
+	uint64_t n, tslen, lenlen, datalen;
+	const unsigned char *p = r->p;
+
+	if (p == r->end) {
+		/* Cut short; no trailer */
+		return 0;
+	}
+
+	switch (*p++) {
+	case 'E':
+		if (get_varint(&p, r->end, &r->duration) != 0) {
+			return -1;
+		}
+		r->has_duration = 1;
+		r->p = p;
+		return 0;
+	case 'B':
+		break;
+	default:
+		return -1;
+	}
+
+	if (get_varint(&p, r->end, &n) != 0 ||
+	    get_varint(&p, r->end, &tslen) != 0 ||
+	    get_varint(&p, r->end, &lenlen) != 0 ||
+	    get_varint(&p, r->end, &datalen) != 0) {
+		return -1;
+	}
+
+	if (n == 0 || tslen > (uint64_t)(r->end - p) ||
+	    lenlen > (uint64_t)(r->end - p) - tslen ||
+	    datalen > (uint64_t)(r->end - p) - tslen - lenlen) {
+		return -1;
+	}
+
+	r->left = n;
+	r->at = 0;
+	r->delta = 0;
+	r->ts = p;
+	r->tsend = r->lens = p + tslen;
+	r->lensend = r->data = r->lens + lenlen;
+	r->dataend = r->data + datalen;
+	r->p = r->dataend;
+
+	return 1;
+}
+
+/* Returns 1 with the next event, 0 at the end, -1 if the cast is corrupt
+ * or truncated mid-block. data points into the buffer given to
+ * bincast_open.
+ */
+int
+bincast_next(struct bincast_reader *r, uint64_t *at,
+    const unsigned char **data, size_t *len)
+{
+	uint64_t dod, n;
+	int s;
+
+	if (r->left == 0 && (s = next_block(r)) != 1) {
+		return s;
+	}
+
+	if (get_varint(&r->ts, r->tsend, &dod) != 0 ||
+	    get_varint(&r->lens, r->lensend, &n) != 0 ||
+	    n > (uint64_t)(r->dataend - r->data)) {
+		return -1;
+	}
+
+	r->delta += unzigzag(dod);
+	r->at += r->delta;
+	r->left--;
+
+	*at = r->at;
+	*data = r->data;
+	*len = n;
+	r->data += n;
+
+	return 1;
+}
+
+void
+bincast_close(struct bincast_reader *r)
+{
+
+	free((char *)r->header.cmd);
+	free((char *)r->header.title);
+	free((char *)r->header.env);
+	memset(&r->header, 0, sizeof r->header);
+}
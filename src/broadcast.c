@@ -0,0 +1,803 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "broadcast.h"
+#include "bytebuf.h"
+#include "castty.h"
+#include "vt.h"
+
+/* Output is copied once, into a ring that every viewer reads from at its
+ * own position: a viewer costs a cursor and a writev(2) per wakeup of the
+ * broadcast thread, not a copy of the stream. The ring never waits for a
+ * viewer. One that falls a whole ring behind, or whose data was overwritten
+ * while it was being sent, is brought back with a repaint of the latest
+ * screen instead, which the broadcast thread keeps a model of.
+ */
+
+enum {
+	RING_SIZE = 1024 * 1024,
+	MAX_VIEWERS = 64,
+
+	/* Largest WebSocket frame of output */
+	FRAME_MAX = 64 * 1024,
+
+	/* Longest HTTP request taken from a viewer */
+	REQUEST_MAX = 8192,
+};
+
+#define WS_GUID		"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+struct viewer {
+	int fd;
+	int websocket;
+	int streaming;
+	int resync;
+	int blocked;
+
+	/* The request, until it has been answered */
+	struct bytebuf req;
+
+	/* Sent ahead of the ring data: the response, frame headers and
+	 * repaints
+	 */
+	struct bytebuf out;
+	size_t outoff;
+
+	/* Next ring byte to send, and the end of the frame it is in */
+	uint64_t pos;
+	uint64_t frame_end;
+};
+
+static struct {
+	unsigned char *buf;
+
+	/* Output up to head is in the ring; the producer may be overwriting
+	 * anything before writing - RING_SIZE.
+	 */
+	_Alignas(64) _Atomic uint64_t head;
+	_Atomic uint64_t writing;
+	_Alignas(64) _Atomic int sleeping;
+	_Atomic int done;
+	int wakefd[2];
+
+	pthread_t thread;
+	int listenfd;
+	int rows;
+	int cols;
+
+	/* Broadcast thread: the screen as of vtpos */
+	struct vt *vt;
+	uint64_t vtpos;
+	struct bytebuf repaint;
+	uint64_t repaint_at;
+
+	struct viewer *viewers[MAX_VIEWERS];
+	int nviewers;
+} bc;
+
+/* SHA-1, for the WebSocket handshake only */
+static void
+sha1(const unsigned char *data, size_t len, unsigned char digest[20])
+{
+	uint32_t h[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+	};
+	unsigned char block[64];
+	uint64_t bits = (uint64_t)len * 8;
+	size_t off = 0;
+	int last = 0;
+
+	while (!last) {
+		uint32_t w[80], a, b, c, d, e, t;
+		size_t n = (len > off) ? MIN(len - off, 64) : 0;
+
+		memset(block, 0, sizeof block);
+		if (n > 0) {
+			memcpy(block, data + off, n);
+		}
+		if (n < 64 && off <= len) {
+			block[n] = 0x80;
+		}
+		if (n < 56) {
+			for (int i = 0; i < 8; i++) {
+				block[63 - i] = bits >> (i * 8);
+			}
+			last = 1;
+		}
+		off += 64;
+
+		for (int i = 0; i < 16; i++) {
+			w[i] = (uint32_t)block[i * 4] << 24 |
+			    (uint32_t)block[i * 4 + 1] << 16 |
+			    (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+		}
+		for (int i = 16; i < 80; i++) {
+			t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+			w[i] = t << 1 | t >> 31;
+		}
+
+		a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; i++) {
+			uint32_t f, k;
+
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+
+			t = (a << 5 | a >> 27) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = b << 30 | b >> 2;
+			b = a;
+			a = t;
+		}
+		h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+	}
+
+	for (int i = 0; i < 20; i++) {
+		digest[i] = h[i / 4] >> (24 - (i % 4) * 8);
+	}
+}
+
+static void
+base64(const unsigned char *src, size_t len, char *dst)
+{
+	static const char digits[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	for (size_t i = 0; i < len; i += 3) {
+		uint32_t v = (uint32_t)src[i] << 16;
+
+		if (i + 1 < len) {
+			v |= (uint32_t)src[i + 1] << 8;
+		}
+		if (i + 2 < len) {
+			v |= src[i + 2];
+		}
+
+		*dst++ = digits[v >> 18];
+		*dst++ = digits[(v >> 12) & 0x3f];
+		*dst++ = (i + 1 < len) ? digits[(v >> 6) & 0x3f] : '=';
+		*dst++ = (i + 2 < len) ? digits[v & 0x3f] : '=';
+	}
+	*dst = '\0';
+}
+
+/* Listen on [host:]port, loopback unless a host is given (an empty one
+ * means all addresses). Done before recording starts, so that a port in
+ * use is reported up front.
+ */
+int
+broadcast_listen(const char *spec)
+{
+	struct addrinfo hints, *res, *ai;
+	const char *port, *colon;
+	char host[256];
+	int fd, on, err;
+
+	colon = strrchr(spec, ':');
+	if (colon == NULL) {
+		snprintf(host, sizeof host, "127.0.0.1");
+		port = spec;
+	} else {
+		size_t len = colon - spec;
+
+		if (len >= 2 && spec[0] == '[' && spec[len - 1] == ']') {
+			spec++;
+			len -= 2;
+		}
+		if (len >= sizeof host) {
+			fprintf(stderr, "castty: Invalid address: %s\n", spec);
+			exit(EXIT_FAILURE);
+		}
+		memcpy(host, spec, len);
+		host[len] = '\0';
+		port = colon + 1;
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+	err = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+	if (err != 0) {
+		fprintf(stderr, "castty: %s: %s\n", spec, gai_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+
+	fd = -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+
+		on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, 16) == 0) {
+			break;
+		}
+
+		err = errno;
+		close(fd);
+		errno = err;
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd == -1) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Not for the recorded shell */
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+/* Producer (serializer thread): add output to the ring. */
+void
+broadcast_output(const void *data, size_t len)
+{
+	static const char c = 0;
+	const unsigned char *p = data;
+	uint64_t head;
+
+	if (bc.buf == NULL || len == 0) {
+		return;
+	}
+
+	head = atomic_load_explicit(&bc.head, memory_order_relaxed);
+
+	/* Only the last ring's worth can still be read */
+	if (len > RING_SIZE) {
+		head += len - RING_SIZE;
+		p += len - RING_SIZE;
+		len = RING_SIZE;
+	}
+
+	atomic_store_explicit(&bc.writing, head + len, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	while (len > 0) {
+		size_t off = head & (RING_SIZE - 1);
+		size_t n = MIN(len, RING_SIZE - off);
+
+		memcpy(&bc.buf[off], p, n);
+		head += n;
+		p += n;
+		len -= n;
+	}
+
+	atomic_store_explicit(&bc.head, head, memory_order_seq_cst);
+
+	if (atomic_exchange_explicit(&bc.sleeping, 0, memory_order_seq_cst)) {
+		if (write(bc.wakefd[1], &c, 1) == -1 && errno != EAGAIN) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* Whether ring data from pos that was just read may have been overwritten
+ * while it was.
+ */
+static int
+torn(uint64_t pos)
+{
+
+	atomic_thread_fence(memory_order_acquire);
+
+	return atomic_load_explicit(&bc.writing, memory_order_relaxed) >
+	    pos + RING_SIZE;
+}
+
+/* Bring the screen model up to head; returns how far it got. */
+static uint64_t
+catch_up(uint64_t head)
+{
+	static unsigned char chunk[64 * 1024];
+
+	while (bc.vtpos < head) {
+		uint64_t pos = bc.vtpos;
+		size_t n, off, first;
+
+		if (head - pos > RING_SIZE) {
+			/* Flooded past what the model could keep up with;
+			 * start again from a blank screen
+			 */
+			vt_destroy(bc.vt);
+			bc.vt = vt_create(bc.rows, bc.cols);
+			bc.vtpos = head;
+			break;
+		}
+
+		n = MIN(head - pos, sizeof chunk);
+		off = pos & (RING_SIZE - 1);
+		first = MIN(n, RING_SIZE - off);
+		memcpy(chunk, &bc.buf[off], first);
+		memcpy(chunk + first, bc.buf, n - first);
+
+		if (torn(pos)) {
+			head = atomic_load_explicit(&bc.head, memory_order_acquire);
+			continue;
+		}
+
+		vt_write(bc.vt, chunk, n);
+		bc.vtpos += n;
+	}
+
+	return bc.vtpos;
+}
+
+static void
+frame_header(struct bytebuf *b, int opcode, uint64_t len)
+{
+
+	bytebuf_putc(b, 0x80 | opcode);
+	if (len < 126) {
+		bytebuf_putc(b, len);
+	} else if (len < 65536) {
+		bytebuf_putc(b, 126);
+		bytebuf_putc(b, len >> 8);
+		bytebuf_putc(b, len);
+	} else {
+		bytebuf_putc(b, 127);
+		for (int i = 7; i >= 0; i--) {
+			bytebuf_putc(b, len >> (i * 8));
+		}
+	}
+}
+
+/* Queue a repaint of the latest screen; v picks up the ring after it. */
+static void
+resync(struct viewer *v)
+{
+
+	/* Viewers joining or falling behind together share one repaint */
+	if (bc.repaint.len == 0 || bc.repaint_at != bc.vtpos) {
+		bc.repaint.len = 0;
+		bytebuf_put(&bc.repaint, VT_RESET, sizeof VT_RESET - 1);
+		vt_repaint(bc.vt, &bc.repaint);
+		bc.repaint_at = bc.vtpos;
+	}
+
+	if (v->websocket) {
+		frame_header(&v->out, 0x2, bc.repaint.len);
+	}
+	bytebuf_put(&v->out, bc.repaint.buf, bc.repaint.len);
+
+	v->pos = v->frame_end = bc.vtpos;
+	v->resync = 0;
+}
+
+/* Send v what it's due, up to head. Returns -1 if it has gone away. */
+static int
+pump(struct viewer *v, uint64_t head)
+{
+
+	if (!v->streaming) {
+		return 0;
+	}
+
+	for (;;) {
+		struct iovec iov[3];
+		uint64_t pos = v->pos;
+		size_t want, fromout;
+		ssize_t r;
+		int n = 0;
+
+		if (v->outoff == v->out.len && pos == v->frame_end) {
+			v->out.len = v->outoff = 0;
+
+			if (v->resync || head - pos > RING_SIZE) {
+				resync(v);
+				pos = v->pos;
+			} else if (pos == head) {
+				return 0;
+			} else {
+				v->frame_end = pos + MIN(head - pos, FRAME_MAX);
+				if (v->websocket) {
+					frame_header(&v->out, 0x2, v->frame_end - pos);
+				}
+			}
+		}
+
+		want = 0;
+		if (v->outoff < v->out.len) {
+			iov[n].iov_base = v->out.buf + v->outoff;
+			iov[n].iov_len = v->out.len - v->outoff;
+			want += iov[n++].iov_len;
+		}
+		if (pos < v->frame_end) {
+			size_t len = v->frame_end - pos;
+			size_t off = pos & (RING_SIZE - 1);
+			size_t first = MIN(len, RING_SIZE - off);
+
+			iov[n].iov_base = &bc.buf[off];
+			iov[n].iov_len = first;
+			want += iov[n++].iov_len;
+			if (len > first) {
+				iov[n].iov_base = bc.buf;
+				iov[n].iov_len = len - first;
+				want += iov[n++].iov_len;
+			}
+		}
+
+		if (n == 0) {
+			continue;
+		}
+
+		r = writev(v->fd, iov, n);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		} else if (r == -1 && errno == EAGAIN) {
+			v->blocked = 1;
+			return 0;
+		} else if (r == -1) {
+			return -1;
+		}
+
+		fromout = MIN((size_t)r, v->out.len - v->outoff);
+		v->outoff += fromout;
+		v->pos += r - fromout;
+
+		/* What went out may be garbage; the frame is finished
+		 * regardless and the screen repainted after it
+		 */
+		if ((size_t)r > fromout && torn(pos)) {
+			v->resync = 1;
+		}
+
+		if ((size_t)r < want) {
+			v->blocked = 1;
+			return 0;
+		}
+	}
+}
+
+/* Find header name in an HTTP request and copy its value into dst. */
+static int
+header_value(const char *req, const char *name, char *dst, size_t size)
+{
+	size_t namelen = strlen(name);
+	const char *line, *end;
+
+	for (line = strstr(req, "\r\n"); line != NULL;
+	    line = strstr(line, "\r\n")) {
+		line += 2;
+		if (strncasecmp(line, name, namelen) != 0 ||
+		    line[namelen] != ':') {
+			continue;
+		}
+
+		line += namelen + 1;
+		line += strspn(line, " \t");
+		end = strstr(line, "\r\n");
+		if (end == NULL || (size_t)(end - line) >= size) {
+			return -1;
+		}
+
+		memcpy(dst, line, end - line);
+		dst[end - line] = '\0';
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Answer a complete request. Returns -1 to hang up. */
+static int
+respond(struct viewer *v)
+{
+	char key[128], upgrade[64], accept[32];
+	unsigned char digest[20];
+	const char *req;
+	char size[64];
+	int n;
+
+	bytebuf_putc(&v->req, '\0');
+	req = (const char *)v->req.buf;
+
+	if (strncmp(req, "GET ", 4) != 0) {
+		return -1;
+	}
+
+	if (header_value(req, "Upgrade", upgrade, sizeof upgrade) == 0 &&
+	    strcasecmp(upgrade, "websocket") == 0 &&
+	    header_value(req, "Sec-WebSocket-Key", key, sizeof key) == 0) {
+		strncat(key, WS_GUID, sizeof key - strlen(key) - 1);
+		sha1((unsigned char *)key, strlen(key), digest);
+		base64(digest, sizeof digest, accept);
+
+		bytebuf_printf(&v->out, "HTTP/1.1 101 Switching Protocols\r\n"
+		    "Upgrade: websocket\r\n"
+		    "Connection: Upgrade\r\n"
+		    "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+
+		n = snprintf(size, sizeof size, "{\"width\": %d, \"height\": %d}",
+		    bc.cols, bc.rows);
+		frame_header(&v->out, 0x1, n);
+		bytebuf_put(&v->out, size, n);
+
+		v->websocket = 1;
+	} else {
+		bytebuf_printf(&v->out, "HTTP/1.1 200 OK\r\n"
+		    "Content-Type: application/octet-stream\r\n"
+		    "Cache-Control: no-cache\r\n"
+		    "Connection: close\r\n\r\n");
+	}
+
+	bytebuf_free(&v->req);
+	v->streaming = 1;
+	v->resync = 1;
+
+	return 0;
+}
+
+/* v is readable. Returns -1 if it has gone away. */
+static int
+viewer_read(struct viewer *v)
+{
+	unsigned char buf[1024];
+	ssize_t n;
+
+	n = read(v->fd, buf, sizeof buf);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+		return 0;
+	} else if (n <= 0) {
+		return -1;
+	}
+
+	if (v->streaming) {
+		/* Viewers have nothing to say, short of a close frame */
+		if (v->websocket && (buf[0] & 0x0f) == 0x8) {
+			return -1;
+		}
+		return 0;
+	}
+
+	bytebuf_put(&v->req, buf, n);
+	bytebuf_putc(&v->req, '\0');
+	v->req.len--;
+
+	if (strstr((char *)v->req.buf, "\r\n\r\n") != NULL) {
+		return respond(v);
+	}
+
+	return (v->req.len < REQUEST_MAX) ? 0 : -1;
+}
+
+static void
+viewer_accept(void)
+{
+	struct viewer *v;
+	int fd, on;
+
+	fd = accept(bc.listenfd, NULL, NULL);
+	if (fd == -1) {
+		return;
+	}
+
+	if (bc.nviewers == MAX_VIEWERS) {
+		close(fd);
+		return;
+	}
+
+	v = calloc(1, sizeof *v);
+	if (v == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+	v->fd = fd;
+	bc.viewers[bc.nviewers++] = v;
+}
+
+static void
+viewer_close(struct viewer *v)
+{
+
+	close(v->fd);
+	bytebuf_free(&v->req);
+	bytebuf_free(&v->out);
+	free(v);
+}
+
+static void *
+broadcaster(void *priv)
+{
+	struct pollfd pollfds[2 + MAX_VIEWERS];
+	char drain[64];
+
+	(void)priv;
+
+	for (;;) {
+		uint64_t head;
+		int i, j, n;
+
+		head = catch_up(atomic_load_explicit(&bc.head,
+		    memory_order_acquire));
+
+		for (i = 0; i < bc.nviewers; i++) {
+			struct viewer *v = bc.viewers[i];
+
+			if (!v->blocked && pump(v, head) == -1) {
+				viewer_close(v);
+				bc.viewers[i] = NULL;
+			}
+		}
+
+		for (i = j = 0; i < bc.nviewers; i++) {
+			if (bc.viewers[i] != NULL) {
+				bc.viewers[j++] = bc.viewers[i];
+			}
+		}
+		bc.nviewers = j;
+
+		if (atomic_load(&bc.done)) {
+			break;
+		}
+
+		pollfds[0].fd = bc.wakefd[0];
+		pollfds[0].events = POLLIN;
+		pollfds[1].fd = bc.listenfd;
+		pollfds[1].events = POLLIN;
+		for (i = 0; i < bc.nviewers; i++) {
+			pollfds[2 + i].fd = bc.viewers[i]->fd;
+			pollfds[2 + i].events = POLLIN |
+			    (bc.viewers[i]->blocked ? POLLOUT : 0);
+		}
+		n = 2 + bc.nviewers;
+
+		atomic_store_explicit(&bc.sleeping, 1, memory_order_seq_cst);
+		if (atomic_load_explicit(&bc.head, memory_order_seq_cst) != head) {
+			atomic_store_explicit(&bc.sleeping, 0, memory_order_relaxed);
+			continue;
+		}
+
+		if (poll(pollfds, n, -1) == -1 && errno != EINTR) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+
+		atomic_store_explicit(&bc.sleeping, 0, memory_order_relaxed);
+		while (read(bc.wakefd[0], drain, sizeof drain) > 0)
+			;
+
+		for (i = 0; i < n - 2; i++) {
+			struct viewer *v = bc.viewers[i];
+			short revents = pollfds[2 + i].revents;
+
+			if (revents & POLLOUT) {
+				v->blocked = 0;
+			}
+
+			if ((revents & (POLLIN | POLLHUP | POLLERR)) &&
+			    viewer_read(v) == -1) {
+				viewer_close(v);
+				bc.viewers[i] = NULL;
+			}
+		}
+
+		for (i = j = 0; i < bc.nviewers; i++) {
+			if (bc.viewers[i] != NULL) {
+				bc.viewers[j++] = bc.viewers[i];
+			}
+		}
+		bc.nviewers = j;
+
+		if (pollfds[1].revents & POLLIN) {
+			viewer_accept();
+		}
+	}
+
+	for (int i = 0; i < bc.nviewers; i++) {
+		viewer_close(bc.viewers[i]);
+	}
+	bc.nviewers = 0;
+
+	return NULL;
+}
+
+/* Serve viewers on the socket from broadcast_listen() until
+ * broadcast_stop().
+ */
+void
+broadcast_start(int fd, int rows, int cols)
+{
+	sigset_t all, old;
+
+	bc.listenfd = fd;
+	bc.rows = rows;
+	bc.cols = cols;
+	bc.vt = vt_create(rows, cols);
+
+	bc.buf = malloc(RING_SIZE);
+	if (bc.buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pipe(bc.wakefd) == -1) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	fcntl(bc.wakefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(bc.wakefd[1], F_SETFL, O_NONBLOCK);
+
+	/* Viewers hanging up fail the write instead */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Signals are for the relay thread to handle */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&bc.thread, NULL, broadcaster, NULL) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Called once the producer has stopped. */
+void
+broadcast_stop(void)
+{
+	static const char c = 0;
+
+	if (bc.buf == NULL) {
+		return;
+	}
+
+	atomic_store(&bc.done, 1);
+	if (write(bc.wakefd[1], &c, 1) == -1 && errno != EAGAIN) {
+		perror("write");
+	}
+	pthread_join(bc.thread, NULL);
+
+	xclose(bc.wakefd[0]);
+	xclose(bc.wakefd[1]);
+	xclose(bc.listenfd);
+	vt_destroy(bc.vt);
+	bytebuf_free(&bc.repaint);
+	free(bc.buf);
+	bc.buf = NULL;
+}
@@ -0,0 +1,76 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytebuf.h"
+
+/* Make room for len more bytes. */
+void
+bytebuf_grow(struct bytebuf *b, size_t len)
+{
+	unsigned char *p;
+	size_t ns;
+
+	if (b->len + len <= b->size) {
+		return;
+	}
+
+	ns = b->size ? b->size : 1024;
+	while (ns < b->len + len) {
+		ns *= 2;
+	}
+
+	p = realloc(b->buf, ns);
+	if (p == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+
+	b->buf = p;
+	b->size = ns;
+}
+
+void
+bytebuf_put(struct bytebuf *b, const void *data, size_t len)
+{
+
+	bytebuf_grow(b, len);
+	memcpy(&b->buf[b->len], data, len);
+	b->len += len;
+}
+
+void
+bytebuf_printf(struct bytebuf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	bytebuf_grow(b, 64);
+
+	va_start(ap, fmt);
+	n = vsnprintf((char *)&b->buf[b->len], b->size - b->len, fmt, ap);
+	va_end(ap);
+
+	assert(n >= 0);
+
+	if ((size_t)n >= b->size - b->len) {
+		/* Didn't fit; make room and format again */
+		bytebuf_grow(b, n + 1);
+
+		va_start(ap, fmt);
+		vsnprintf((char *)&b->buf[b->len], n + 1, fmt, ap);
+		va_end(ap);
+	}
+
+	b->len += n;
+}
+
+void
+bytebuf_free(struct bytebuf *b)
+{
+
+	free(b->buf);
+	memset(b, 0, sizeof *b);
+}
@@ -2,16 +2,28 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "bench.h"
 #include "castty.h"
+#include "convert.h"
+#include "latency.h"
 #include "record.h"
+#include "recover.h"
 
 static void
 usage(int status)
 {
 
-	fprintf(stderr, "usage: castty record [options]\n"
+	fprintf(stderr, "usage: castty <command> [options]\n"
 	    " record    Create a new recording. See castty record -h for\n"
-	    "           options specific to recording.\n");
+	    "           options specific to recording.\n"
+	    " convert   Convert a recording to another format. See castty\n"
+	    "           convert -h.\n"
+	    " recover   Repair a recording cut short by a crash. See castty\n"
+	    "           recover -h.\n"
+	    " bench     Measure how fast output is recorded. See castty\n"
+	    "           bench -h.\n"
+	    " latency   Measure how long typed keys take to echo. See castty\n"
+	    "           latency -h.\n");
 
 	exit(status);
 }
@@ -31,6 +43,14 @@ main(int argc, char **argv)
 
 	if (strcmp(argv[0], "record") == 0) {
 		return record_main(argc, argv);
+	} else if (strcmp(argv[0], "convert") == 0) {
+		return convert_main(argc, argv);
+	} else if (strcmp(argv[0], "recover") == 0) {
+		return recover_main(argc, argv);
+	} else if (strcmp(argv[0], "bench") == 0) {
+		return bench_main(argc, argv);
+	} else if (strcmp(argv[0], "latency") == 0) {
+		return latency_main(argc, argv);
 	} else {
 		usage(EXIT_FAILURE);
 	}
@@ -0,0 +1,792 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "asciicast.h"
+#include "bincast.h"
+#include "bytebuf.h"
+#include "castty.h"
+#include "convert.h"
+#include "evwriter.h"
+#include "idle.h"
+#include "jsonesc.h"
+#include "jsontok.h"
+
+enum {
+	/* Cast lines are copied through in pieces of this size */
+	LINE_CHUNK = 64 * 1024,
+
+	/* Longest header line accepted */
+	HEADER_MAX = 1024 * 1024,
+};
+
+static void
+usage(int status)
+{
+
+	fprintf(stderr, "usage: castty convert [-12Aahior] <in.cast> <out.cast>\n"
+	    " -1             Output asciicast v1.\n"
+	    " -2             Output asciicast v2 (the default).\n"
+	    " -A             Escape non-ASCII output as \\uXXXX. This is the default for\n"
+	    "                v1; v2 casts otherwise carry validated UTF-8 as-is.\n"
+	    " -a <audio>     Raw audio recorded with the cast (16-bit stereo). With -i,\n"
+	    "                only gaps where the audio is silent are cut, and they are\n"
+	    "                cut from the audio too. Requires -o.\n"
+	    " -h             Show this help.\n"
+	    " -i <seconds>   Shorten gaps between events to at most <seconds>.\n"
+	    " -o <outfile>   Write the cut audio to <outfile>.\n"
+	    " -r <rate>      Sample rate of the audio (default 44100).\n"
+	    "\n"
+	    " <in.cast>      Binary cast recorded with castty record -b, or an\n"
+	    "                asciicast v1 or v2 cast.\n"
+	    " <out.cast>     Where to write the converted cast.\n");
+	exit(status);
+}
+
+/* Map a whole file for reading. */
+static void *
+map_file(const char *path, size_t *len)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+
+	*len = st.st_size;
+	if (*len == 0) {
+		xclose(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	xclose(fd);
+
+	return p;
+}
+
+/* Binary to asciicast. Events are escaped and timed exactly as castty
+ * record would have written them.
+ */
+static int
+from_binary(struct bincast_reader *r, struct evwriter *out, int version,
+    int ascii_only, struct idle *idle)
+{
+	struct asciicast cast;
+	const unsigned char *data;
+	uint64_t at, last;
+	size_t len;
+	int s;
+
+	asciicast_init(&cast, out, version,
+	    (version == 2 && !ascii_only) ? JSON_ESCAPE_UTF8 : 0);
+	asciicast_header(&cast, &r->header);
+
+	last = 0;
+	while ((s = bincast_next(r, &at, &data, &len)) == 1) {
+		asciicast_event(&cast, idle_map(idle, at), data, len);
+		last = at;
+	}
+
+	asciicast_end(&cast);
+
+	if (s == -1) {
+		fprintf(stderr, "castty: Input is corrupt or truncated; converted "
+		    "up to %.4f seconds\n", last / 1e6);
+	} else if (!r->has_duration) {
+		fprintf(stderr, "castty: Input has no trailer; recording was "
+		    "cut short\n");
+	}
+
+	asciicast_duration(&cast,
+	    idle_end(idle, r->has_duration ? r->duration : last));
+
+	return (s == -1) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Where the value of key starts in the text of a JSON object, or NULL.
+ * The key's opening quote is stored in *start. Strings inside values
+ * can't match, as their quotes are preceded by a backslash rather than by
+ * '{' or ','.
+ */
+static const char *
+json_key(const char *obj, const char *key, const char **start)
+{
+	size_t klen = strlen(key);
+
+	for (const char *p = obj; (p = strchr(p, '"')) != NULL; p++) {
+		const char *q = p;
+
+		while (q > obj && strchr(" \t\r\n", q[-1]) != NULL) {
+			q--;
+		}
+
+		if (q == obj || (q[-1] != '{' && q[-1] != ',') ||
+		    strncmp(p + 1, key, klen) != 0 || p[klen + 1] != '"') {
+			continue;
+		}
+
+		q = p + klen + 2;
+		q += strspn(q, " \t\r\n");
+		if (*q != ':') {
+			continue;
+		}
+
+		if (start != NULL) {
+			*start = p;
+		}
+
+		q++;
+		return q + strspn(q, " \t\r\n");
+	}
+
+	return NULL;
+}
+
+/* asciicast v2 to v2, with event times rewritten and everything else
+ * copied as-is. Lines go through a fixed buffer, so memory use doesn't
+ * depend on the size of the cast or of its events. The duration goes at
+ * the front of the header, as castty record writes it, and is filled in
+ * at the end from the header, a streamed cast's trailer or the last event.
+ */
+static int
+from_v2(FILE *in, const char *header, struct evwriter *out,
+    struct idle *idle)
+{
+	static char chunk[LINE_CHUNK];
+	struct asciicast cast;
+	const char *key, *v;
+	char *e;
+	double duration;
+	uint64_t at, last, events;
+	size_t lineno, n;
+	int pad;
+
+	pad = out->stream ? 0 : ASCIICAST_HEADER_PAD;
+	duration = -1;
+	v = json_key(header, "duration", &key);
+	if (v != NULL) {
+		duration = strtod(v, &e);
+		if (e == v || !(duration >= 0)) {
+			fprintf(stderr, "castty: Invalid duration in header\n");
+			return EXIT_FAILURE;
+		}
+
+		e += strspn(e, " \t");
+		if (*e == ',') {
+			e++;
+			e += strspn(e, " \t");
+		} else {
+			/* Last member; take the comma before it instead */
+			while (strchr(" \t", key[-1]) != NULL) {
+				key--;
+			}
+			if (key[-1] == ',') {
+				key--;
+			}
+		}
+
+		evwriter_printf(out, "{%*s", pad, "");
+		evwriter_write(out, header + 1, key - header - 1);
+		evwriter_write(out, e, strlen(e));
+	} else {
+		evwriter_printf(out, "{%*s", pad, "");
+		evwriter_write(out, header + 1, strlen(header + 1));
+	}
+	evwriter_mark(out, 0);
+
+	/* in starts at the end of the header line */
+	last = 0;
+	events = 0;
+	lineno = 0;
+	while (fgets(chunk, sizeof chunk, in) != NULL) {
+		int trailer;
+		double t;
+		char *p;
+
+		lineno++;
+
+		p = chunk + strspn(chunk, " \t\r\n");
+		if (*p == '\0') {
+			continue;
+		}
+
+		t = (*p == '[') ? strtod(p + 1, &e) : -1;
+		if (!(t >= 0) || e == p + 1 || *(e += strspn(e, " \t")) != ',') {
+			fprintf(stderr, "castty: Line %zu is not an event\n", lineno);
+			return EXIT_FAILURE;
+		}
+
+		/* A trailer is replaced by the duration in the header */
+		trailer = (strncmp(e + 1 + strspn(e + 1, " \t"), "\"t\"", 3) == 0);
+		if (trailer) {
+			duration = MAX(duration, t);
+		} else {
+			last = t * 1e6 + 0.5;
+			at = idle_map(idle, last);
+			evwriter_printf(out, "[%0.4f", at / 1e6);
+			events++;
+		}
+
+		/* The rest of the line, however long */
+		for (;;) {
+			n = strlen(e);
+			if (!trailer) {
+				evwriter_write(out, e, n);
+			}
+			if (n > 0 && e[n - 1] == '\n') {
+				break;
+			}
+
+			if (fgets(chunk, sizeof chunk, in) == NULL) {
+				fprintf(stderr, "castty: Line %zu is cut short\n",
+				    lineno);
+				if (!trailer) {
+					evwriter_write(out, "\n", 1);
+				}
+				break;
+			}
+			e = chunk;
+		}
+		if (!trailer) {
+			evwriter_mark(out, at);
+		}
+	}
+
+	if (ferror(in)) {
+		perror("fgets");
+		exit(EXIT_FAILURE);
+	}
+
+	asciicast_init(&cast, out, 2, 0);
+	cast.events = events;
+	asciicast_duration(&cast, idle_end(idle,
+	    MAX(duration >= 0 ? (uint64_t)(duration * 1e6 + 0.5) : 0, last)));
+
+	return EXIT_SUCCESS;
+}
+
+/* Header of an asciicast being read. command and title are unescaped; env
+ * is the JSON text of the object.
+ */
+struct json_header {
+	int version;
+	int width;
+	int height;
+	double duration;
+	struct bytebuf command;
+	struct bytebuf title;
+	struct bytebuf env;
+};
+
+/* Read a string (or null) value into b, NUL-terminated. */
+static int
+read_string(struct jsontok *t, enum json_token tok, struct bytebuf *b)
+{
+	ssize_t n;
+
+	b->len = 0;
+	bytebuf_grow(b, 1);
+	b->buf[0] = '\0';
+
+	if (tok == JSON_NULL) {
+		return 0;
+	} else if (tok != JSON_STRING) {
+		return -1;
+	}
+
+	do {
+		bytebuf_grow(b, BUFSIZ);
+		n = jsontok_string(t, &b->buf[b->len], b->size - b->len - 1);
+		if (n == -1) {
+			return -1;
+		}
+		b->len += n;
+	} while (n > 0 && b->len < HEADER_MAX);
+	b->buf[b->len] = '\0';
+
+	return (n == 0) ? 0 : -1;
+}
+
+/* Read header members up to the end of the object or, in v1, up to the
+ * events in "stdout". Returns 1 if stopped at the events, 0 at the end of
+ * the object and -1 if it is malformed.
+ */
+static int
+read_header(struct jsontok *t, struct json_header *h)
+{
+	enum json_token tok;
+	unsigned char key[32];
+	ssize_t n;
+
+	for (;;) {
+		tok = jsontok_next(t);
+		if (tok == JSON_OBJECT_END) {
+			return 0;
+		} else if (tok != JSON_STRING) {
+			return -1;
+		}
+
+		/* Longer keys than fit aren't any we want */
+		if ((n = jsontok_string(t, key, sizeof key - 1)) == -1) {
+			return -1;
+		}
+		key[t->instring ? 0 : n] = '\0';
+
+		tok = jsontok_next(t);
+		if (tok == JSON_NUMBER && strcmp((char *)key, "version") == 0) {
+			h->version = t->number;
+		} else if (tok == JSON_NUMBER && strcmp((char *)key, "width") == 0) {
+			h->width = t->number;
+		} else if (tok == JSON_NUMBER && strcmp((char *)key, "height") == 0) {
+			h->height = t->number;
+		} else if (tok == JSON_NUMBER &&
+		    strcmp((char *)key, "duration") == 0) {
+			h->duration = t->number;
+		} else if (strcmp((char *)key, "command") == 0) {
+			if (read_string(t, tok, &h->command) != 0) {
+				return -1;
+			}
+		} else if (strcmp((char *)key, "title") == 0) {
+			if (read_string(t, tok, &h->title) != 0) {
+				return -1;
+			}
+		} else if (tok == JSON_OBJECT && strcmp((char *)key, "env") == 0) {
+			h->env.len = 0;
+			bytebuf_putc(&h->env, '{');
+			t->raw = &h->env;
+			n = jsontok_skip(t, tok);
+			t->raw = NULL;
+			if (n != 0 || h->env.len > HEADER_MAX) {
+				return -1;
+			}
+			bytebuf_putc(&h->env, '\0');
+
+			/* Strings can't hold raw line breaks, so these are
+			 * whitespace and the v2 header stays on one line
+			 */
+			for (size_t i = 0; i < h->env.len; i++) {
+				if (h->env.buf[i] == '\r' || h->env.buf[i] == '\n') {
+					h->env.buf[i] = ' ';
+				}
+			}
+		} else if (tok == JSON_ARRAY && h->version != 2 &&
+		    strcmp((char *)key, "stdout") == 0) {
+			return 1;
+		} else if (jsontok_skip(t, tok) != 0) {
+			return -1;
+		}
+	}
+}
+
+/* Escape s into b for a header field. */
+static const char *
+escape_string(const struct bytebuf *s, int flags, struct bytebuf *b)
+{
+	size_t used;
+
+	if (s->len == 0) {
+		return "";
+	}
+
+	b->len = 0;
+	bytebuf_grow(b, JSON_ESCAPE_MAX(s->len) + 1);
+	b->len = json_escape((char *)b->buf, s->buf, s->len,
+	    flags | JSON_ESCAPE_FINAL, &used);
+	b->buf[b->len] = '\0';
+
+	return (char *)b->buf;
+}
+
+/* Copy the events of a v1 "stdout" array, or the lines of a v2 cast after
+ * the header, up to the end of the array or the file. v1 times are deltas;
+ * v2 times are from the start. Output is read in pieces, so an event
+ * longer than that becomes several at the same time. Only output ("o")
+ * events are kept; the number of others is added to *dropped.
+ */
+static int
+copy_events(struct jsontok *t, int inversion, struct asciicast *cast,
+    struct idle *idle, uint64_t *last, size_t *dropped)
+{
+	static unsigned char data[LINE_CHUNK];
+	enum json_token tok;
+	unsigned char type[16];
+	double secs;
+	uint64_t at;
+	ssize_t n;
+	int output;
+
+	secs = 0;
+	for (;;) {
+		tok = jsontok_next(t);
+		if ((inversion == 1 && tok == JSON_ARRAY_END) ||
+		    (inversion == 2 && tok == JSON_EOF)) {
+			return 0;
+		}
+
+		if (tok != JSON_ARRAY || jsontok_next(t) != JSON_NUMBER) {
+			return -1;
+		}
+
+		secs = (inversion == 1) ? secs + t->number : t->number;
+		if (!(secs >= 0)) {
+			return -1;
+		}
+		at = secs * 1e6 + 0.5;
+
+		output = 1;
+		if (inversion == 2) {
+			if (jsontok_next(t) != JSON_STRING ||
+			    (n = jsontok_string(t, type, sizeof type - 1)) == -1) {
+				return -1;
+			}
+			output = (n == 1 && type[0] == 'o' && !t->instring);
+		}
+
+		if (jsontok_next(t) != JSON_STRING) {
+			return -1;
+		}
+
+		*last = MAX(*last, at);
+		at = idle_map(idle, at);
+
+		if (output) {
+			while ((n = jsontok_string(t, data, sizeof data)) > 0) {
+				asciicast_event(cast, at, data, n);
+			}
+			if (n == -1) {
+				return -1;
+			}
+		} else if (!(n == 1 && type[0] == 't')) {
+			/* A streamed cast's trailer only carries the duration */
+			(*dropped)++;
+		}
+
+		if (jsontok_next(t) != JSON_ARRAY_END) {
+			return -1;
+		}
+	}
+}
+
+/* asciicast v1 or v2 to asciicast, read through the tokenizer. t is at the
+ * events (the "stdout" array in v1, if there is one); h holds the header
+ * read so far.
+ */
+static int
+from_json(struct jsontok *t, struct json_header *h, int events,
+    struct evwriter *out, int version, int ascii_only, struct idle *idle)
+{
+	struct bytebuf command, title;
+	struct cast_header hdr;
+	struct asciicast cast;
+	uint64_t last;
+	size_t dropped;
+	int flags, s;
+
+	flags = (version == 2 && !ascii_only) ? JSON_ESCAPE_UTF8 : 0;
+
+	memset(&command, 0, sizeof command);
+	memset(&title, 0, sizeof title);
+	memset(&hdr, 0, sizeof hdr);
+	hdr.cols = h->width;
+	hdr.rows = h->height;
+	hdr.cmd = escape_string(&h->command, flags, &command);
+	hdr.title = escape_string(&h->title, flags, &title);
+	hdr.env = h->env.len ? (char *)h->env.buf : "{}";
+
+	asciicast_init(&cast, out, version, flags);
+	asciicast_header(&cast, &hdr);
+
+	last = 0;
+	dropped = 0;
+	s = 0;
+	if (events) {
+		s = copy_events(t, h->version, &cast, idle, &last, &dropped);
+	}
+
+	/* v1 members after "stdout"; only the duration is of use by now */
+	if (s == 0 && events && h->version == 1 && read_header(t, h) != 0) {
+		s = -1;
+	}
+
+	asciicast_end(&cast);
+
+	if (s == -1) {
+		fprintf(stderr, "castty: Input is corrupt or truncated; converted "
+		    "up to %.4f seconds\n", last / 1e6);
+	}
+	if (dropped > 0) {
+		fprintf(stderr, "castty: Dropped %zu input, marker and resize "
+		    "events\n", dropped);
+	}
+
+	asciicast_duration(&cast, idle_end(idle,
+	    MAX(h->duration >= 0 ? (uint64_t)(h->duration * 1e6 + 0.5) : 0,
+	    last)));
+
+	bytebuf_free(&command);
+	bytebuf_free(&title);
+
+	return (s == -1) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* The header line of a v2 cast, which ends at off, for copying through. */
+static char *
+header_text(int fd, off_t off)
+{
+	ssize_t n;
+	char *p;
+
+	if (off > HEADER_MAX) {
+		fprintf(stderr, "castty: Header is too long\n");
+		exit(EXIT_FAILURE);
+	}
+
+	p = malloc(off + 2);
+	if (p == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	n = pread(fd, p, off, 0);
+	if (n != off) {
+		perror("pread");
+		exit(EXIT_FAILURE);
+	}
+
+	/* A header spread over lines is joined into one */
+	for (ssize_t i = 0; i < n; i++) {
+		if (p[i] == '\r' || p[i] == '\n') {
+			p[i] = ' ';
+		}
+	}
+	p[n] = '\n';
+	p[n + 1] = '\0';
+
+	return p;
+}
+
+int
+convert_main(int argc, char **argv)
+{
+	static struct jsontok tok;
+	char magic[sizeof BINCAST_MAGIC - 1];
+	const char *audioin, *audioout;
+	struct bincast_reader r;
+	struct json_header h;
+	struct evwriter *out;
+	struct idle idle;
+	FILE *ain, *aout;
+	int ch, version, ascii_only, status, rate, fd, s;
+	uint64_t max_idle;
+	double secs;
+	ssize_t n;
+	size_t len;
+	void *buf;
+	char *e;
+
+	version = 0;
+	ascii_only = 0;
+	audioin = audioout = NULL;
+	max_idle = 0;
+	rate = 44100;
+
+	while ((ch = getopt(argc, argv, "?12Aa:hi:o:r:")) != EOF) {
+		switch (ch) {
+		case '1':
+			version = 1;
+			break;
+		case '2':
+			version = 2;
+			break;
+		case 'A':
+			ascii_only = 1;
+			break;
+		case 'a':
+			audioin = optarg;
+			break;
+		case 'i':
+			errno = 0;
+			secs = strtod(optarg, &e);
+			if (e == optarg || errno != 0 || !(secs >= 0.001) ||
+			    secs > 86400 || (*e && strcmp(e, "s"))) {
+				fprintf(stderr, "castty: Invalid idle limit: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			max_idle = secs * 1e6;
+			break;
+		case 'o':
+			audioout = optarg;
+			break;
+		case 'r':
+			errno = 0;
+			rate = strtol(optarg, &e, 10);
+			if (e == optarg || errno != 0 || rate < 1000 ||
+			    rate > 384000 || (*e && strcmp(e, "Hz"))) {
+				fprintf(stderr, "castty: Invalid sample rate: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'h':
+		case '?':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2) {
+		usage(EXIT_FAILURE);
+	}
+
+	if ((audioin == NULL) != (audioout == NULL)) {
+		fprintf(stderr, "If -a or -o are specified, both must appear.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (audioin != NULL && max_idle == 0) {
+		fprintf(stderr, "Audio (-a) is only rewritten to match -i.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fd = open(argv[0], O_RDONLY);
+	if (fd == -1) {
+		perror(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	n = read(fd, magic, sizeof magic);
+	if (n == -1) {
+		perror("read");
+		exit(EXIT_FAILURE);
+	}
+
+	idle_init(&idle, max_idle);
+	ain = aout = NULL;
+	if (audioin != NULL) {
+		ain = xfopen(audioin, "r");
+		aout = xfopen(audioout, "w");
+		idle_audio(&idle, ain, aout, rate);
+	}
+
+	if (n == sizeof magic && memcmp(magic, BINCAST_MAGIC, n) == 0) {
+		xclose(fd);
+
+		buf = map_file(argv[0], &len);
+		if (buf == NULL || bincast_open(&r, buf, len) != 0) {
+			fprintf(stderr, "castty: %s: Not a binary cast\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+
+		out = evwriter_open(argv[1], EVWRITER_BUFSIZE, EVWRITER_FLUSH_MS);
+		status = from_binary(&r, out, version ? version : 2, ascii_only,
+		    &idle);
+		evwriter_close(out);
+
+		bincast_close(&r);
+		munmap(buf, len);
+
+		goto done;
+	}
+
+	memset(&h, 0, sizeof h);
+	h.duration = -1;
+
+	jsontok_init(&tok, fd);
+	jsontok_seek(&tok, 0);
+	if (jsontok_next(&tok) != JSON_OBJECT ||
+	    (s = read_header(&tok, &h)) == -1) {
+		fprintf(stderr, "castty: %s: Not a cast\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (s == 1 && (h.version == 0 || h.width == 0 || h.height == 0)) {
+		off_t events = jsontok_offset(&tok);
+
+		/* The events come before the rest of the header; read it
+		 * and come back.
+		 */
+		if (jsontok_skip(&tok, JSON_ARRAY) != 0 ||
+		    read_header(&tok, &h) != 0) {
+			fprintf(stderr, "castty: %s: Not a cast\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		jsontok_seek(&tok, events);
+	}
+
+	if (h.version != 1 && h.version != 2) {
+		fprintf(stderr, "castty: %s: Not an asciicast v1 or v2 cast\n",
+		    argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (h.width <= 0 || h.height <= 0) {
+		fprintf(stderr, "castty: %s: Cast has no size\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (version == 0) {
+		version = 2;
+	}
+
+	out = evwriter_open(argv[1], EVWRITER_BUFSIZE, EVWRITER_FLUSH_MS);
+	if (h.version == 2 && version == 2 && !ascii_only) {
+		/* v2 is copied through with only the times rewritten */
+		off_t off = jsontok_offset(&tok);
+		char *header = header_text(fd, off);
+		FILE *in;
+
+		in = fdopen(fd, "r");
+		if (in == NULL || fseeko(in, off, SEEK_SET) == -1) {
+			perror(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+
+		status = from_v2(in, header + strspn(header, " \t"), out, &idle);
+		xfclose(in);
+		free(header);
+	} else {
+		status = from_json(&tok, &h, h.version == 2 || s == 1, out,
+		    version, ascii_only, &idle);
+		xclose(fd);
+	}
+	evwriter_close(out);
+
+	bytebuf_free(&h.command);
+	bytebuf_free(&h.title);
+	bytebuf_free(&h.env);
+
+done:
+	if (audioin != NULL) {
+		xfclose(ain);
+		xfclose(aout);
+	}
+
+	return status;
+}
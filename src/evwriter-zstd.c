@@ -0,0 +1,345 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zstd.h>
+
+#include "castty.h"
+#include "evwriter-zstd.h"
+
+/* Compressed cast output, in the zstd seekable format:
+ *
+ * - The cast is cut into independently decodable zstd frames, always at a
+ *   record boundary. The header is a frame of its own; after that a frame
+ *   ends once it holds ZSTD_FRAME_SIZE bytes or spans ZSTD_FRAME_US of
+ *   recording time.
+ * - A skippable frame (magic ZSTD_INDEX_MAGIC) holds the recording time of
+ *   the first record of each frame, followed by the duration of the
+ *   recording (the time of the last mark).
+ * - The file ends with the standard seek table, which lists all of the above
+ *   (the time index as a frame decompressing to nothing), so that frame N's
+ *   offset is the sum of the sizes before it.
+ *
+ * To read a time range, find its frames in the time index, then seek to and
+ * decompress just those. The whole file also decompresses as-is with plain
+ * zstd, which ignores skippable frames. If the recording dies before the
+ * trailer is written, everything flushed so far is still valid zstd.
+ *
+ * All integers in the index and seek table are little-endian.
+ */
+
+enum {
+	ZSTD_FRAME_SIZE = 1024 * 1024,
+	ZSTD_FRAME_US = 10 * 1000000,
+};
+
+#define ZSTD_SKIPPABLE_MAGIC	0x184D2A50U
+#define ZSTD_SEEKTABLE_MAGIC	0x184D2A5EU
+#define ZSTD_SEEKABLE_MAGIC	0x8F92EAB1U
+#define ZSTD_INDEX_MAGIC	(ZSTD_SKIPPABLE_MAGIC | 0xC)
+#define ZSTD_INDEX_TAG		0x49545443U	/* "CTTI" */
+
+struct zframe {
+	uint32_t csize;
+	uint32_t dsize;
+	uint64_t at;
+};
+
+struct zstd_context {
+	int fd;
+	ZSTD_CCtx *cctx;
+	unsigned char *out;
+	size_t outsize;
+
+	/* Compressed bytes written so far, time of the last mark */
+	uint64_t written;
+	uint64_t last_at;
+
+	/* Frame being written */
+	int inframe;
+	int marked;
+	uint64_t frame_off;
+	size_t frame_len;
+	uint64_t frame_at;
+
+	struct zframe *frames;
+	size_t nframes;
+	size_t maxframes;
+};
+
+static void
+compress(struct zstd_context *z, const void *data, size_t len,
+    ZSTD_EndDirective mode)
+{
+	ZSTD_inBuffer in = { data, len, 0 };
+
+	for (;;) {
+		ZSTD_outBuffer out = { z->out, z->outsize, 0 };
+		size_t r;
+
+		r = ZSTD_compressStream2(z->cctx, &out, &in, mode);
+		if (ZSTD_isError(r)) {
+			fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(r));
+			exit(EXIT_FAILURE);
+		}
+
+		xwrite_all(z->fd, z->out, out.pos);
+		z->written += out.pos;
+
+		/* continue is done when input is used up, the others when
+		 * nothing is left in the compressor either
+		 */
+		if (mode == ZSTD_e_continue ? in.pos == in.size : r == 0) {
+			break;
+		}
+	}
+}
+
+static void
+add_frame(struct zstd_context *z, uint32_t csize, uint32_t dsize, uint64_t at)
+{
+
+	if (z->nframes == z->maxframes) {
+		size_t n = z->maxframes ? z->maxframes * 2 : 256;
+		struct zframe *p;
+
+		p = realloc(z->frames, n * sizeof *p);
+		if (p == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+
+		z->frames = p;
+		z->maxframes = n;
+	}
+
+	z->frames[z->nframes].csize = csize;
+	z->frames[z->nframes].dsize = dsize;
+	z->frames[z->nframes].at = at;
+	z->nframes++;
+}
+
+static void
+end_frame(struct zstd_context *z)
+{
+
+	compress(z, NULL, 0, ZSTD_e_end);
+	add_frame(z, z->written - z->frame_off, z->frame_len, z->frame_at);
+
+	z->inframe = 0;
+	z->marked = 0;
+}
+
+static void
+zstd_write(struct evsink *sink, const void *data, size_t len)
+{
+	struct zstd_context *z = sink->context;
+
+	if (!z->inframe) {
+		z->inframe = 1;
+		z->frame_off = z->written;
+		z->frame_len = 0;
+	}
+
+	z->frame_len += len;
+	compress(z, data, len, ZSTD_e_continue);
+}
+
+/* Get everything written so far onto disk without ending the frame. */
+static void
+zstd_flush(struct evsink *sink)
+{
+	struct zstd_context *z = sink->context;
+
+	if (z->inframe) {
+		compress(z, NULL, 0, ZSTD_e_flush);
+	}
+}
+
+static void
+zstd_mark(struct evsink *sink, uint64_t at)
+{
+	struct zstd_context *z = sink->context;
+
+	z->last_at = at;
+	if (!z->inframe) {
+		return;
+	}
+
+	if (!z->marked) {
+		z->marked = 1;
+		z->frame_at = at;
+	}
+
+	if (z->nframes == 0 || z->frame_len >= ZSTD_FRAME_SIZE ||
+	    at - z->frame_at >= ZSTD_FRAME_US) {
+		end_frame(z);
+	}
+}
+
+static unsigned char *
+put32(unsigned char *p, uint32_t v)
+{
+
+	for (int i = 0; i < 4; i++) {
+		*p++ = v >> (8 * i);
+	}
+
+	return p;
+}
+
+static unsigned char *
+put64(unsigned char *p, uint64_t v)
+{
+
+	p = put32(p, v);
+	return put32(p, v >> 32);
+}
+
+/* Write the time index and seek table. */
+static void
+write_trailer(struct zstd_context *z)
+{
+	unsigned char *buf, *p;
+	size_t nidx, isize, ssize;
+
+	nidx = z->nframes;
+
+	/* magic, size, tag, count, times, duration */
+	isize = 4 + 4 + 4 + 4 + nidx * 8 + 8;
+
+	/* magic, size, entries (one more, for the index), footer */
+	ssize = 4 + 4 + (nidx + 1) * 8 + 9;
+
+	buf = malloc(isize + ssize);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	p = put32(buf, ZSTD_INDEX_MAGIC);
+	p = put32(p, isize - 8);
+	p = put32(p, ZSTD_INDEX_TAG);
+	p = put32(p, nidx);
+	for (size_t i = 0; i < nidx; i++) {
+		p = put64(p, z->frames[i].at);
+	}
+	p = put64(p, z->last_at);
+
+	add_frame(z, isize, 0, z->last_at);
+
+	p = put32(p, ZSTD_SEEKTABLE_MAGIC);
+	p = put32(p, ssize - 8);
+	for (size_t i = 0; i < z->nframes; i++) {
+		p = put32(p, z->frames[i].csize);
+		p = put32(p, z->frames[i].dsize);
+	}
+	p = put32(p, z->nframes);
+	*p++ = 0;	/* descriptor: no checksums */
+	p = put32(p, ZSTD_SEEKABLE_MAGIC);
+
+	assert((size_t)(p - buf) == isize + ssize);
+
+	xwrite_all(z->fd, buf, p - buf);
+	free(buf);
+}
+
+static void
+zstd_destroy(struct evsink *sink)
+{
+	struct zstd_context *z = sink->context;
+
+	if (z->inframe) {
+		end_frame(z);
+	}
+
+	write_trailer(z);
+
+	ZSTD_freeCCtx(z->cctx);
+	free(z->frames);
+	free(z->out);
+	free(z);
+	free(sink);
+}
+
+static void
+load_dict(ZSTD_CCtx *cctx, const char *path)
+{
+	FILE *f;
+	void *dict;
+	long size;
+	size_t r;
+
+	f = xfopen(path, "rb");
+	if (fseek(f, 0, SEEK_END) == -1 || (size = ftell(f)) == -1) {
+		perror("fseek");
+		exit(EXIT_FAILURE);
+	}
+	rewind(f);
+
+	dict = malloc(size ? size : 1);
+	if (dict == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (fread(dict, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "castty: Couldn't read dictionary %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	xfclose(f);
+
+	/* The dictionary is copied; its ID goes into each frame header */
+	r = ZSTD_CCtx_loadDictionary(cctx, dict, size);
+	if (ZSTD_isError(r)) {
+		fprintf(stderr, "castty: %s: %s\n", path, ZSTD_getErrorName(r));
+		exit(EXIT_FAILURE);
+	}
+	free(dict);
+}
+
+struct evsink *
+evsink_zstd(int fd, const char *dictpath)
+{
+	struct zstd_context *z;
+	struct evsink *sink;
+
+	z = calloc(1, sizeof *z);
+	sink = calloc(1, sizeof *sink);
+	if (z == NULL || sink == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	z->fd = fd;
+	z->cctx = ZSTD_createCCtx();
+	if (z->cctx == NULL) {
+		fprintf(stderr, "castty: Couldn't create zstd context\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel,
+	    ZSTD_CLEVEL_DEFAULT);
+	ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_checksumFlag, 1);
+
+	if (dictpath != NULL) {
+		load_dict(z->cctx, dictpath);
+	}
+
+	z->outsize = ZSTD_CStreamOutSize();
+	z->out = malloc(z->outsize);
+	if (z->out == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	sink->context = z;
+	sink->write = zstd_write;
+	sink->flush = zstd_flush;
+	sink->mark = zstd_mark;
+	sink->destroy = zstd_destroy;
+
+	return sink;
+}
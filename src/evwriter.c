@@ -0,0 +1,471 @@
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "castty.h"
+#include "evwriter.h"
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Connect to the UNIX stream socket at path. */
+static int
+open_socket(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof sun.sun_path) {
+		fprintf(stderr, "%s: Socket path is too long\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof sun) == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+struct evwriter *
+evwriter_open(const char *path, size_t size, int flush_ms)
+{
+	struct evwriter *w;
+	struct stat st;
+
+	assert(path != NULL);
+	assert(size > 0);
+	assert(flush_ms >= 0);
+
+	w = calloc(1, sizeof *w);
+	if (w == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	w->buf = malloc(size);
+	if (w->buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		w->fd = open_socket(path);
+	} else {
+		/* A FIFO blocks here until something reads it */
+		w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (w->fd == -1) {
+			perror("open");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (fstat(w->fd, &st) == -1) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+	w->stream = !S_ISREG(st.st_mode);
+
+	w->size = size;
+	w->flush_ms = flush_ms;
+	w->timerfd = -1;
+
+#ifdef __linux__
+	if (flush_ms > 0) {
+		w->timerfd = timerfd_create(CLOCK_MONOTONIC,
+		    TFD_NONBLOCK | TFD_CLOEXEC);
+		if (w->timerfd == -1) {
+			perror("timerfd_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+
+	return w;
+}
+
+void
+evwriter_close(struct evwriter *w)
+{
+
+	evwriter_flush(w);
+
+	if (w->sink != NULL) {
+		w->sink->destroy(w->sink);
+	}
+
+	if (w->sync_ms > 0) {
+		xfdatasync(w->fd);
+	}
+
+	if (w->timerfd != -1) {
+		xclose(w->timerfd);
+	}
+	xclose(w->fd);
+
+	free(w->buf);
+	free(w);
+}
+
+/* The timer goes off at the earlier of the flush and sync deadlines. */
+static void
+set_timer(struct evwriter *w)
+{
+#ifdef __linux__
+	struct itimerspec its;
+	uint64_t deadline, now;
+
+	if (w->timerfd == -1) {
+		return;
+	}
+
+	memset(&its, 0, sizeof its);
+	if (w->armed || w->sync_armed) {
+		if (!w->sync_armed) {
+			deadline = w->deadline;
+		} else if (!w->armed) {
+			deadline = w->sync_deadline;
+		} else {
+			deadline = MIN(w->deadline, w->sync_deadline);
+		}
+
+		/* An all-zero time would disarm it instead */
+		now = now_ms();
+		its.it_value.tv_nsec = 1;
+		if (deadline > now) {
+			its.it_value.tv_sec = (deadline - now) / 1000;
+			its.it_value.tv_nsec = ((deadline - now) % 1000) * 1000000L;
+		}
+	}
+
+	if (timerfd_settime(w->timerfd, 0, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		exit(EXIT_FAILURE);
+	}
+#else
+	(void)w;
+#endif
+}
+
+/* Hand data to the sink, or write it to the file if there isn't one. */
+static void
+output(struct evwriter *w, const void *data, size_t len)
+{
+
+	if (w->sink != NULL) {
+		w->sink->write(w->sink, data, len);
+	} else {
+		xwrite_all(w->fd, data, len);
+	}
+
+	w->written += len;
+
+	if (w->sync_ms == 0) {
+		return;
+	}
+
+	if (w->written - w->synced >= EVWRITER_SYNC_BYTES) {
+		evwriter_sync(w);
+	} else if (!w->sync_armed) {
+		w->sync_armed = 1;
+		w->sync_deadline = now_ms() + w->sync_ms;
+		set_timer(w);
+	}
+}
+
+/* Send on whatever is buffered. Unlike evwriter_flush, a sink may keep
+ * holding on to it; this is what a full buffer does.
+ */
+void
+evwriter_drain(struct evwriter *w)
+{
+
+	if (w->len == 0) {
+		return;
+	}
+
+	output(w, w->buf, w->len);
+	w->len = 0;
+}
+
+void
+evwriter_flush(struct evwriter *w)
+{
+
+	evwriter_drain(w);
+
+	if (w->sink != NULL) {
+		w->sink->flush(w->sink);
+	}
+}
+
+/* Route all output through sink from here on; the writer owns it and
+ * destroys it on close.
+ */
+void
+evwriter_set_sink(struct evwriter *w, struct evsink *sink)
+{
+
+	evwriter_flush(w);
+	w->sink = sink;
+}
+
+/* Sync to disk every sync_ms (0 for never). Not for streams, which have
+ * no disk to sync to.
+ */
+void
+evwriter_set_sync(struct evwriter *w, int sync_ms)
+{
+
+	assert(sync_ms >= 0);
+
+	if (w->stream) {
+		return;
+	}
+
+	w->sync_ms = sync_ms;
+
+#ifdef __linux__
+	if (sync_ms > 0 && w->timerfd == -1) {
+		w->timerfd = timerfd_create(CLOCK_MONOTONIC,
+		    TFD_NONBLOCK | TFD_CLOEXEC);
+		if (w->timerfd == -1) {
+			perror("timerfd_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+}
+
+/* Sync whatever has been written out so far; a group commit. */
+void
+evwriter_sync(struct evwriter *w)
+{
+
+	xfdatasync(w->fd);
+	w->synced = w->written;
+
+	if (w->sync_armed) {
+		w->sync_armed = 0;
+		set_timer(w);
+	}
+}
+
+/* Called when the first byte lands in an empty buffer. The timer is
+ * one-shot; if the buffer is flushed for size before it fires, it will
+ * simply flush whatever accumulated since, which is still within bound.
+ */
+void
+evwriter_arm(struct evwriter *w)
+{
+
+	if (w->armed || w->flush_ms == 0) {
+		return;
+	}
+
+	w->armed = 1;
+	w->deadline = now_ms() + w->flush_ms;
+	set_timer(w);
+}
+
+/* End of a record at time at (us). With a zero flush interval, every record
+ * is written out as soon as it is complete.
+ */
+void
+evwriter_mark(struct evwriter *w, uint64_t at)
+{
+
+	if (w->sink != NULL && w->sink->mark != NULL) {
+		/* The sink must see the record whole before it is told */
+		evwriter_drain(w);
+		w->sink->mark(w->sink, at);
+	}
+
+	if (w->flush_ms == 0) {
+		evwriter_flush(w);
+	}
+}
+
+/* Must be called when the timer descriptor polls readable. Where there is
+ * no timer descriptor, call after every poll wakeup; the deadline is then
+ * checked against the clock.
+ */
+void
+evwriter_timer(struct evwriter *w)
+{
+	uint64_t now;
+
+	if (!w->armed && !w->sync_armed) {
+		return;
+	}
+
+	if (w->timerfd != -1) {
+		uint64_t expirations;
+
+		if (read(w->timerfd, &expirations, sizeof expirations) == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				return;
+			}
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	now = now_ms();
+	if (w->armed && now >= w->deadline) {
+		w->armed = 0;
+		evwriter_flush(w);
+	}
+	if (w->sync_armed && now >= w->sync_deadline) {
+		evwriter_sync(w);
+	}
+
+	set_timer(w);
+}
+
+/* Timeout suitable for poll(2) when no timer descriptor is available. */
+int
+evwriter_timeout(struct evwriter *w)
+{
+	uint64_t deadline, now;
+
+	if (w->timerfd != -1 || (!w->armed && !w->sync_armed)) {
+		return -1;
+	}
+
+	if (!w->sync_armed) {
+		deadline = w->deadline;
+	} else if (!w->armed) {
+		deadline = w->sync_deadline;
+	} else {
+		deadline = MIN(w->deadline, w->sync_deadline);
+	}
+
+	now = now_ms();
+	if (now >= deadline) {
+		return 0;
+	}
+
+	return deadline - now;
+}
+
+void
+evwriter_write(struct evwriter *w, const void *data, size_t len)
+{
+
+	if (len == 0) {
+		return;
+	}
+
+	if (w->len + len > w->size) {
+		evwriter_drain(w);
+		if (len >= w->size) {
+			output(w, data, len);
+			return;
+		}
+	}
+
+	if (w->len == 0) {
+		evwriter_arm(w);
+	}
+
+	memcpy(&w->buf[w->len], data, len);
+	w->len += len;
+}
+
+/* Make room for len bytes (at most the buffer size) and return where they
+ * go. Follow with evwriter_commit for however much was actually used.
+ */
+unsigned char *
+evwriter_reserve(struct evwriter *w, size_t len)
+{
+
+	assert(len <= w->size);
+
+	if (w->size - w->len < len) {
+		evwriter_drain(w);
+	}
+
+	return &w->buf[w->len];
+}
+
+void
+evwriter_printf(struct evwriter *w, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf((char *)&w->buf[w->len], w->size - w->len, fmt, ap);
+	va_end(ap);
+
+	assert(n >= 0);
+
+	if ((size_t)n < w->size - w->len) {
+		if (w->len == 0) {
+			evwriter_arm(w);
+		}
+		w->len += n;
+		return;
+	}
+
+	/* Didn't fit; flush and format into a buffer of the right size. */
+	char *p = malloc(n + 1);
+	if (p == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(p, n + 1, fmt, ap);
+	va_end(ap);
+
+	evwriter_write(w, p, n);
+	free(p);
+}
+
+/* Overwrite already-written data, e.g. to fill in the header duration. */
+void
+evwriter_pwrite(struct evwriter *w, off_t off, const void *data, size_t len)
+{
+
+	assert(w->sink == NULL);
+	assert(!w->stream);
+
+	evwriter_flush(w);
+
+	if (pwrite(w->fd, data, len, off) != (ssize_t)len) {
+		perror("pwrite");
+		exit(EXIT_FAILURE);
+	}
+}
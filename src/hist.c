@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "castty.h"
+#include "hist.h"
+
+struct hist hist_relay = HIST_INIT("relay", "us", 1000);
+struct hist hist_read = HIST_INIT("read", "bytes", 1);
+struct hist hist_serialize = HIST_INIT("serialize", "us", 1000);
+struct hist hist_audio = HIST_INIT("audio", "us", 1000);
+struct hist hist_encode = HIST_INIT("encode", "us", 1000);
+
+/* The largest value that lands in bucket i */
+static uint64_t
+bucket_high(int i)
+{
+	uint64_t m;
+	int shift;
+
+	if (i < 2 * HIST_SUB) {
+		return i;
+	}
+
+	shift = i / HIST_SUB - 1;
+	m = i - shift * HIST_SUB;
+
+	return ((m + 1) << shift) - 1;
+}
+
+/* Percentiles for ps[0..n-1], which must be ascending */
+static void
+percentiles(struct hist *h, uint64_t count, const double *ps, uint64_t *vs,
+    int n)
+{
+	uint64_t max, rank, seen;
+	int i, j;
+
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	seen = 0;
+	for (i = j = 0; i < HIST_BUCKETS && j < n; i++) {
+		seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+
+		/* Nearest rank */
+		while (j < n) {
+			rank = ps[j] * count;
+			if (rank < ps[j] * count || rank == 0) {
+				rank++;
+			}
+			if (seen < rank) {
+				break;
+			}
+			vs[j++] = MIN(bucket_high(i), max);
+		}
+	}
+
+	/* Counted while the buckets were being read */
+	while (j < n) {
+		vs[j++] = max;
+	}
+}
+
+void
+hist_print(struct hist *h, FILE *out)
+{
+	static const double ps[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t count, vs[4];
+	double scale;
+
+	count = atomic_load_explicit(&h->count, memory_order_relaxed);
+	if (count == 0) {
+		fprintf(out, "%-10s %10s %6s\n", h->name, "0", h->unit);
+		return;
+	}
+
+	percentiles(h, count, ps, vs, 4);
+
+	scale = h->scale;
+	fprintf(out, "%-10s %10llu %6s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+	    h->name, (unsigned long long)count, h->unit,
+	    atomic_load_explicit(&h->sum, memory_order_relaxed) / scale / count,
+	    vs[0] / scale, vs[1] / scale, vs[2] / scale, vs[3] / scale,
+	    atomic_load_explicit(&h->max, memory_order_relaxed) / scale);
+}
+
+/* Summarize the recorder's histograms; why says what prompted it */
+void
+hist_dump(FILE *out, const char *why)
+{
+
+	fprintf(out, "histograms (%s):\n", why);
+	fprintf(out, "%-10s %10s %6s %9s %9s %9s %9s %9s %9s\n", "stage",
+	    "count", "unit", "mean", "p50", "p90", "p99", "p99.9", "max");
+	hist_print(&hist_relay, out);
+	hist_print(&hist_read, out);
+	hist_print(&hist_serialize, out);
+	hist_print(&hist_audio, out);
+	hist_print(&hist_encode, out);
+	fflush(out);
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "castty.h"
+#include "idle.h"
+
+enum {
+	/* Bytes in a frame of 16-bit stereo */
+	FRAME_BYTES = 4,
+
+	/* Audio is judged silent or not in blocks of 10ms */
+	BLOCKS_PER_S = 100,
+
+	/* Peaks below about -40dBFS count as silence */
+	SILENCE_PEAK = 328,
+};
+
+static uint64_t
+frames_us(const struct idle *idle, uint64_t frames)
+{
+
+	return frames * 1000000 / idle->rate;
+}
+
+void
+idle_init(struct idle *idle, uint64_t max)
+{
+
+	memset(idle, 0, sizeof *idle);
+	idle->max = max;
+}
+
+/* Cut the raw audio read from in to match, writing it to out. */
+void
+idle_audio(struct idle *idle, FILE *in, FILE *out, int rate)
+{
+
+	idle->ain = in;
+	idle->aout = out;
+	idle->rate = rate;
+	idle->blockframes = MAX(rate / BLOCKS_PER_S, 1);
+
+	idle->block = malloc(idle->blockframes * FRAME_BYTES);
+	if (idle->block == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The block after an event is always kept, so times between an event
+	 * and the next block boundary map straight through.
+	 */
+	idle->keep = MAX(idle->max * rate / 1000000, idle->blockframes);
+}
+
+/* Copy the next block of audio through, unless it is silence that has
+ * gone on too long. Returns 0 once the audio is exhausted.
+ */
+static int
+audio_block(struct idle *idle)
+{
+	int peak;
+	size_t n;
+
+	n = fread(idle->block, FRAME_BYTES, idle->blockframes, idle->ain);
+	if (n == 0) {
+		if (ferror(idle->ain)) {
+			perror("fread");
+			exit(EXIT_FAILURE);
+		}
+		return 0;
+	}
+	idle->in_frames += n;
+
+	peak = 0;
+	for (size_t i = 0; i < n * FRAME_BYTES; i += 2) {
+		int s = (int16_t)(idle->block[i] | idle->block[i + 1] << 8);
+
+		peak = MAX(peak, abs(s));
+	}
+
+	if (peak >= SILENCE_PEAK) {
+		idle->quiet = 0;
+	} else if ((idle->quiet += n) > idle->keep) {
+		return 1;
+	}
+
+	if (fwrite(idle->block, FRAME_BYTES, n, idle->aout) != n) {
+		perror("fwrite");
+		exit(EXIT_FAILURE);
+	}
+	idle->out_frames += n;
+
+	return 1;
+}
+
+static uint64_t
+map(struct idle *idle, uint64_t at)
+{
+	uint64_t f, gap;
+
+	if (at < idle->in_at) {
+		at = idle->in_at;
+	}
+
+	if (idle->ain != NULL) {
+		f = at * idle->rate / 1000000;
+
+		while (idle->in_frames + idle->blockframes <= f) {
+			if (audio_block(idle)) {
+				continue;
+			}
+
+			/* Audio ended before the cast did; cap the rest alone */
+			if (frames_us(idle, idle->in_frames) > idle->in_at) {
+				idle->in_at = frames_us(idle, idle->in_frames);
+				idle->out_at = MAX(idle->out_at,
+				    frames_us(idle, idle->out_frames));
+			}
+			idle->ain = NULL;
+			break;
+		}
+
+		if (idle->ain != NULL) {
+			idle->in_at = at;
+			idle->out_at = frames_us(idle,
+			    idle->out_frames + f - idle->in_frames);
+			return idle->out_at;
+		}
+	}
+
+	gap = at - idle->in_at;
+	if (idle->max && gap > idle->max) {
+		gap = idle->max;
+	}
+
+	idle->in_at = at;
+	idle->out_at += gap;
+
+	return idle->out_at;
+}
+
+/* Time (us) in the output of an event at (us) in the input. */
+uint64_t
+idle_map(struct idle *idle, uint64_t at)
+{
+	uint64_t r;
+
+	r = map(idle, at);
+	idle->quiet = 0;
+
+	return r;
+}
+
+/* Map the recording's duration (us) and copy out the rest of the audio,
+ * whose trailing silence is capped as well.
+ */
+uint64_t
+idle_end(struct idle *idle, uint64_t duration)
+{
+	uint64_t r;
+
+	r = map(idle, duration);
+
+	if (idle->ain != NULL) {
+		while (audio_block(idle)) {
+			continue;
+		}
+		idle->ain = NULL;
+	}
+
+	free(idle->block);
+	idle->block = NULL;
+
+	return r;
+}
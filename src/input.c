@@ -6,84 +6,114 @@
 
 #include "castty.h"
 #include "record.h"
+#include "uring.h"
 
-void
-inputproc(int masterfd, int controlfd)
+static enum input_state {
+	STATE_PASSTHROUGH,
+	STATE_COMMAND,
+} input_state;
+
+static void
+blocking_write(int fd, void *buf, size_t len)
 {
-	unsigned char ibuf[BUFSIZ], *p;
-	enum input_state {
-		STATE_PASSTHROUGH,
-		STATE_COMMAND,
-	} input_state;
-	ssize_t nread;
 
-	input_state = STATE_PASSTHROUGH;
+	xwrite(fd, buf, len);
+}
 
-	while ((nread = read(STDIN_FILENO, ibuf, BUFSIZ)) > 0) {
-		unsigned char *cmdstart;
-
-		p = ibuf;
-
-		cmdstart = memchr(ibuf, 0x01, nread);
-		if (cmdstart) {
-			switch (input_state) {
-			case STATE_PASSTHROUGH:
-				/* Switching into command mode: pass through anything
-				 * preceding our command
-				 */
-				if (cmdstart > ibuf) {
-					xwrite(masterfd, ibuf, cmdstart - ibuf);
-				}
-				cmdstart++;
-				nread -= (cmdstart - ibuf);
-
-				p = cmdstart;
-				input_state = STATE_COMMAND;
+/* Split a chunk of keyboard input into input for the pty and runtime
+ * commands for the output process. emit performs the actual writes, so
+ * that I/O backends can queue them rather than block.
+ */
+void
+input_process(unsigned char *ibuf, ssize_t nread, int masterfd, int controlfd,
+    void (*emit)(int, void *, size_t))
+{
+	unsigned char *cmdstart, *p;
 
-				break;
-			case STATE_COMMAND:
-				break;
-			}
-		}
+	p = ibuf;
 
+	cmdstart = memchr(ibuf, 0x01, nread);
+	if (cmdstart) {
 		switch (input_state) {
 		case STATE_PASSTHROUGH:
-			xwrite(masterfd, ibuf, nread);
-			break;
+			/* Switching into command mode: pass through anything
+			 * preceding our command
+			 */
+			if (cmdstart > ibuf) {
+				emit(masterfd, ibuf, cmdstart - ibuf);
+			}
+			cmdstart++;
+			nread -= (cmdstart - ibuf);
 
+			p = cmdstart;
+			input_state = STATE_COMMAND;
+
+			break;
 		case STATE_COMMAND:
-			if (nread) {
-				enum control_command cmd = CMD_NONE;
-
-				switch (*p) {
-				/* Passthrough a literal ^a */
-				case 'a':
-				case  0x01:
-					cmd = CMD_CTRL_A;
-					break;
-				case 'p':
-					cmd = CMD_PAUSE;
-					break;
-				case 'm':
-					cmd = CMD_MUTE;
-					break;
-				default:
-					input_state = STATE_PASSTHROUGH;
-					break;
-				}
-
-				if (cmd != CMD_NONE) {
-					xwrite(controlfd, &cmd, sizeof cmd);
-				}
-
-				if (nread > 1) {
-					xwrite(masterfd, p + 1, nread - 1);
-				}
+			break;
+		}
+	}
+
+	switch (input_state) {
+	case STATE_PASSTHROUGH:
+		emit(masterfd, ibuf, nread);
+		break;
 
+	case STATE_COMMAND:
+		if (nread) {
+			enum control_command cmd = CMD_NONE;
+
+			switch (*p) {
+			/* Passthrough a literal ^a */
+			case 'a':
+			case  0x01:
+				cmd = CMD_CTRL_A;
+				break;
+			case 'p':
+				cmd = CMD_PAUSE;
+				break;
+			case 's':
+				cmd = CMD_STATS;
+				break;
+			case 'm':
+				cmd = CMD_MUTE;
+				break;
+			default:
 				input_state = STATE_PASSTHROUGH;
+				break;
 			}
-			break;
+
+			if (cmd != CMD_NONE) {
+				emit(controlfd, &cmd, sizeof cmd);
+			}
+
+			if (nread > 1) {
+				emit(masterfd, p + 1, nread - 1);
+			}
+
+			input_state = STATE_PASSTHROUGH;
 		}
+		break;
+	}
+}
+
+void
+inputproc(int masterfd, int controlfd, int use_uring)
+{
+	unsigned char ibuf[BUFSIZ];
+	ssize_t nread;
 
+	input_state = STATE_PASSTHROUGH;
+
+#ifdef WITH_URING
+	if (use_uring && uring_inputloop(masterfd, controlfd) == 0) {
+		return;
+	}
+#else
+	(void)use_uring;
+#endif
+
+	while ((nread = read(STDIN_FILENO, ibuf, BUFSIZ)) > 0) {
+		input_process(ibuf, nread, masterfd, controlfd, blocking_write);
 	}
 }
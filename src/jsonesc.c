@@ -0,0 +1,542 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "jsonesc.h"
+#include "utf8.h"
+
+/* Escaper for terminal output headed into JSON strings. Runs of bytes that
+ * can be copied verbatim are found and copied in bulk: printable ASCII,
+ * found with SSE2 or AVX2 where available, and with JSON_ESCAPE_UTF8 also
+ * valid multibyte UTF-8, checked a character at a time along the run.
+ * Everything else takes the scalar path, where multibyte UTF-8 is validated
+ * with the DFA in utf8.h and either passed through or written as \u
+ * escapes. Invalid input becomes U+FFFD.
+ */
+
+static const char hex[] = "0123456789abcdef";
+
+static inline int
+needs_escape(unsigned char c)
+{
+
+	return c < 0x20 || c == '"' || c == '\\' || c >= 0x7f;
+}
+
+static size_t
+scan_scalar(const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (needs_escape(p[i])) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+#if defined(__SSE2__)
+static size_t
+scan_sse2(const unsigned char *p, size_t len)
+{
+	const __m128i ctl = _mm_set1_epi8(0x20);
+	const __m128i quot = _mm_set1_epi8('"');
+	const __m128i bsl = _mm_set1_epi8('\\');
+	const __m128i del = _mm_set1_epi8(0x7f);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v, m;
+		int mask;
+
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+
+		/* Signed compare: catches both controls and bytes >= 0x80 */
+		m = _mm_or_si128(
+		    _mm_or_si128(_mm_cmplt_epi8(v, ctl), _mm_cmpeq_epi8(v, quot)),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, bsl), _mm_cmpeq_epi8(v, del)));
+
+		mask = _mm_movemask_epi8(m);
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i + scan_scalar(p + i, len - i);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(const unsigned char *p, size_t len)
+{
+	const __m256i ctl = _mm256_set1_epi8(0x20);
+	const __m256i quot = _mm256_set1_epi8('"');
+	const __m256i bsl = _mm256_set1_epi8('\\');
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v, m;
+		unsigned mask;
+
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+
+		m = _mm256_or_si256(
+		    _mm256_or_si256(_mm256_cmpgt_epi8(ctl, v),
+			_mm256_cmpeq_epi8(v, quot)),
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, bsl),
+			_mm256_cmpeq_epi8(v, del)));
+
+		mask = _mm256_movemask_epi8(m);
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i + scan_scalar(p + i, len - i);
+}
+#endif
+
+/* Length of the valid multibyte character at p, or 0 if it is invalid or
+ * cut off. Accepts what the DFA does: no overlong forms, surrogates or
+ * code points past U+10FFFF.
+ */
+static inline size_t
+u8_valid(const unsigned char *p, size_t len)
+{
+	unsigned char c = p[0], lo = 0x80, hi = 0xbf;
+	size_t n;
+
+	if (c >= 0xc2 && c <= 0xdf) {
+		n = 2;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		n = 3;
+		if (c == 0xe0) {
+			lo = 0xa0;
+		} else if (c == 0xed) {
+			hi = 0x9f;
+		}
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		n = 4;
+		if (c == 0xf0) {
+			lo = 0x90;
+		} else if (c == 0xf4) {
+			hi = 0x8f;
+		}
+	} else {
+		return 0;
+	}
+
+	if (n > len || p[1] < lo || p[1] > hi) {
+		return 0;
+	}
+	for (size_t k = 2; k < n; k++) {
+		if ((p[k] & 0xc0) != 0x80) {
+			return 0;
+		}
+	}
+
+	return n;
+}
+
+static size_t scan_resolve(const unsigned char *, size_t);
+static size_t utf8_resolve(const unsigned char *, size_t);
+static size_t (*scan)(const unsigned char *, size_t) = scan_resolve;
+static size_t (*scan_utf8)(const unsigned char *, size_t) = utf8_resolve;
+
+/* The run scans below find the length of the run at p that
+ * JSON_ESCAPE_UTF8 copies as it is: printable ASCII and whole, valid
+ * multibyte characters. It ends before anything to escape, an invalid
+ * sequence or one cut off by the end of the input.
+ */
+static size_t
+utf8_scalar(const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		size_t n;
+
+		if (p[i] >= 0x80) {
+			n = u8_valid(p + i, len - i);
+		} else if (i + 1 < len && p[i + 1] < 0x80) {
+			/* Longer ASCII runs go to the vector scan */
+			n = scan(p + i, len - i);
+		} else {
+			n = !needs_escape(p[i]);
+		}
+
+		if (n == 0) {
+			break;
+		}
+		i += n;
+	}
+
+	return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Each byte is checked against the three before it, 32 at a time, with the
+ * table lookups of Keiser and Lemire, "Validating UTF-8 In Less Than One
+ * Instruction Per Byte" (2021). A lookup on each of the high and low nibble
+ * of the previous byte and the high nibble of this one gives the errors
+ * each allows; what all three allow is an error.
+ */
+enum {
+	U8_TOO_SHORT = 0x01,	/* Lead or ASCII, then a lead or ASCII */
+	U8_TOO_LONG = 0x02,	/* ASCII, then a continuation */
+	U8_OVERLONG_3 = 0x04,
+	U8_TOO_LARGE = 0x08,
+	U8_SURROGATE = 0x10,
+	U8_OVERLONG_2 = 0x20,
+	U8_TOO_LARGE_1000 = 0x40,
+	U8_OVERLONG_4 = 0x40,
+	U8_TWO_CONTS = 0x80,	/* Two continuations: fine in third or fourth */
+	U8_CARRY = U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS,
+};
+
+static const unsigned char u8_byte1_high[16] = {
+	U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+	U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+	U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+	U8_TOO_SHORT | U8_OVERLONG_2,
+	U8_TOO_SHORT,
+	U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+	U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+};
+
+static const unsigned char u8_byte1_low[16] = {
+	U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+	U8_CARRY | U8_OVERLONG_2,
+	U8_CARRY,
+	U8_CARRY,
+	U8_CARRY | U8_TOO_LARGE,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+};
+
+static const unsigned char u8_byte2_high[16] = {
+	U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+	U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 |
+	    U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 |
+	    U8_TOO_LARGE,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE |
+	    U8_TOO_LARGE,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE |
+	    U8_TOO_LARGE,
+	U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+};
+
+/* v with the last n bytes of prev shifted in ahead of it */
+#define U8_PREV(v, prev, n)						\
+	_mm256_alignr_epi8((v), _mm256_permute2x128_si256((prev), (v), 0x21), \
+	    16 - (n))
+
+__attribute__((target("avx2")))
+static inline __m256i
+u8_table(const unsigned char *t)
+{
+
+	return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t));
+}
+
+/* Bytes of v that are errors given the bytes before them, prev included */
+__attribute__((target("avx2")))
+static inline __m256i
+u8_errors(__m256i v, __m256i prev)
+{
+	const __m256i nib = _mm256_set1_epi8(0x0f);
+	__m256i prev1, sc, must23;
+
+	prev1 = U8_PREV(v, prev, 1);
+	sc = _mm256_and_si256(_mm256_and_si256(
+	    _mm256_shuffle_epi8(u8_table(u8_byte1_high),
+		_mm256_and_si256(_mm256_srli_epi16(prev1, 4), nib)),
+	    _mm256_shuffle_epi8(u8_table(u8_byte1_low),
+		_mm256_and_si256(prev1, nib))),
+	    _mm256_shuffle_epi8(u8_table(u8_byte2_high),
+		_mm256_and_si256(_mm256_srli_epi16(v, 4), nib)));
+
+	/* The third and fourth bytes of a character must be continuations;
+	 * only 111_____ two back and 1111____ three back reach 0x80
+	 */
+	must23 = _mm256_or_si256(
+	    _mm256_subs_epu8(U8_PREV(v, prev, 2), _mm256_set1_epi8(0xe0 - 0x80)),
+	    _mm256_subs_epu8(U8_PREV(v, prev, 3), _mm256_set1_epi8(0xf0 - 0x80)));
+	must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+
+	return _mm256_xor_si256(must23, sc);
+}
+
+/* Where a run of valid text ending at end stops, backing off a last
+ * character it cuts off.
+ */
+static size_t
+u8_whole(const unsigned char *p, size_t end)
+{
+	size_t s = end;
+
+	while (s > 0 && end - s < 3 && (p[s - 1] & 0xc0) == 0x80) {
+		s--;
+	}
+	if (s == 0 || p[s - 1] < 0xc0) {
+		return end;
+	}
+
+	s--;
+	return end - s < (size_t)(p[s] >= 0xf0 ? 4 : p[s] >= 0xe0 ? 3 : 2) ?
+	    s : end;
+}
+
+__attribute__((target("avx2")))
+static size_t
+utf8_avx2(const unsigned char *p, size_t len)
+{
+	const __m256i ctl = _mm256_set1_epi8(0x1f);
+	const __m256i quot = _mm256_set1_epi8('"');
+	const __m256i bsl = _mm256_set1_epi8('\\');
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	__m256i v, prev = _mm256_setzero_si256();
+	unsigned char tail[32];
+	unsigned stop, bad;
+	size_t i;
+
+	for (i = 0; ; i += 32) {
+		/* The end looks like a control character after the input */
+		if (i + 32 <= len) {
+			v = _mm256_loadu_si256((const __m256i *)(p + i));
+		} else {
+			memset(tail, 0, sizeof tail);
+			memcpy(tail, p + i, len - i);
+			v = _mm256_loadu_si256((const __m256i *)tail);
+		}
+
+		stop = _mm256_movemask_epi8(_mm256_or_si256(
+		    _mm256_or_si256(
+			_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v),
+			_mm256_cmpeq_epi8(v, quot)),
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, bsl),
+			_mm256_cmpeq_epi8(v, del))));
+		bad = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+		    u8_errors(v, prev), _mm256_setzero_si256()));
+
+		if (stop == 0 && bad == 0) {
+			prev = v;
+			continue;
+		}
+
+		/* Errors are flagged on the byte that shows them, so any
+		 * before the first byte to stop at are in the run, and one
+		 * the stop itself shows is a character it cuts off
+		 */
+		if (stop != 0 && (bad & ((1u << __builtin_ctz(stop)) - 1)) == 0) {
+			return u8_whole(p, i + __builtin_ctz(stop));
+		}
+		break;
+	}
+
+	/* An invalid sequence: found exactly, from the last character
+	 * known to be whole
+	 */
+	i = u8_whole(p, i);
+	return i + utf8_scalar(p + i, len - i);
+}
+#endif
+
+static void
+resolve(void)
+{
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan = scan_avx2;
+		scan_utf8 = utf8_avx2;
+		return;
+	}
+#endif
+#if defined(__SSE2__)
+	scan = scan_sse2;
+#else
+	scan = scan_scalar;
+#endif
+	scan_utf8 = utf8_scalar;
+}
+
+static size_t
+scan_resolve(const unsigned char *p, size_t len)
+{
+
+	resolve();
+	return scan(p, len);
+}
+
+static size_t
+utf8_resolve(const unsigned char *p, size_t len)
+{
+
+	resolve();
+	return scan_utf8(p, len);
+}
+
+static char *
+put_u(char *o, uint32_t cp)
+{
+
+	*o++ = '\\';
+	*o++ = 'u';
+	*o++ = hex[(cp >> 12) & 0xf];
+	*o++ = hex[(cp >> 8) & 0xf];
+	*o++ = hex[(cp >> 4) & 0xf];
+	*o++ = hex[cp & 0xf];
+
+	return o;
+}
+
+static char *
+put_replacement(char *o, int flags)
+{
+
+	if (flags & JSON_ESCAPE_UTF8) {
+		memcpy(o, "\xef\xbf\xbd", 3);
+		return o + 3;
+	}
+
+	return put_u(o, 0xfffd);
+}
+
+static char *
+put_ascii(char *o, unsigned char c)
+{
+
+	switch (c) {
+	case '"':
+	case '\\':
+		*o++ = '\\';
+		*o++ = c;
+		break;
+	case '\b':
+		*o++ = '\\';
+		*o++ = 'b';
+		break;
+	case '\f':
+		*o++ = '\\';
+		*o++ = 'f';
+		break;
+	case '\n':
+		*o++ = '\\';
+		*o++ = 'n';
+		break;
+	case '\r':
+		*o++ = '\\';
+		*o++ = 'r';
+		break;
+	case '\t':
+		*o++ = '\\';
+		*o++ = 't';
+		break;
+	default:
+		o = put_u(o, c);
+		break;
+	}
+
+	return o;
+}
+
+/* Escape len bytes of src into dst, which must have room for
+ * JSON_ESCAPE_MAX(len) bytes. Returns the number of bytes written. Unless
+ * JSON_ESCAPE_FINAL is given, a UTF-8 sequence truncated at the end of src is
+ * left unconsumed so the caller can complete it with the next chunk; the
+ * number of input bytes used is stored in *consumed.
+ */
+size_t
+json_escape(char *dst, const unsigned char *src, size_t len, int flags,
+    size_t *consumed)
+{
+	char *o = dst;
+	size_t i = 0;
+
+	while (i < len) {
+		uint32_t state, cp;
+		size_t run, j;
+
+		if (flags & JSON_ESCAPE_UTF8) {
+			run = scan_utf8(src + i, len - i);
+		} else {
+			run = scan(src + i, len - i);
+		}
+		if (run) {
+			memcpy(o, src + i, run);
+			o += run;
+			i += run;
+			if (i == len) {
+				break;
+			}
+		}
+
+		if (src[i] < 0x80) {
+			o = put_ascii(o, src[i++]);
+			continue;
+		}
+
+		state = UTF8_ACCEPT;
+		cp = 0;
+		for (j = i; j < len; j++) {
+			if (u8_decode(&state, &cp, src[j]) <= UTF8_REJECT) {
+				break;
+			}
+		}
+
+		if (state == UTF8_ACCEPT) {
+			j++;
+			if (flags & JSON_ESCAPE_UTF8) {
+				memcpy(o, src + i, j - i);
+				o += j - i;
+			} else if (cp > 0xffff) {
+				o = put_u(o, ((cp - 0x10000) >> 10) + 0xd800);
+				o = put_u(o, ((cp - 0x10000) & 0x3ff) + 0xdc00);
+			} else {
+				o = put_u(o, cp);
+			}
+			i = j;
+		} else if (state == UTF8_REJECT) {
+			/* One replacement for the longest valid prefix, then
+			 * resume at the offending byte.
+			 */
+			o = put_replacement(o, flags);
+			i = (j > i) ? j : i + 1;
+		} else {
+			/* Input ends mid-sequence */
+			if (!(flags & JSON_ESCAPE_FINAL)) {
+				break;
+			}
+			o = put_replacement(o, flags);
+			i = len;
+		}
+	}
+
+	if (consumed) {
+		*consumed = i;
+	}
+
+	return o - dst;
+}
@@ -0,0 +1,369 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "castty.h"
+#include "jsontok.h"
+
+void
+jsontok_init(struct jsontok *t, int fd)
+{
+
+	t->fd = fd;
+	t->offset = 0;
+	t->pos = t->len = 0;
+	t->instring = 0;
+	t->number = 0;
+	t->raw = NULL;
+}
+
+static int
+fill(struct jsontok *t)
+{
+	ssize_t n;
+
+	t->offset += t->len;
+	t->pos = t->len = 0;
+
+	do {
+		n = read(t->fd, t->buf, sizeof t->buf);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1) {
+		perror("read");
+		exit(EXIT_FAILURE);
+	}
+
+	t->len = n;
+
+	return n > 0;
+}
+
+static int
+peek(struct jsontok *t)
+{
+
+	if (t->pos == t->len && !fill(t)) {
+		return -1;
+	}
+
+	return t->buf[t->pos];
+}
+
+static int
+get(struct jsontok *t)
+{
+	int c;
+
+	c = peek(t);
+	if (c != -1) {
+		t->pos++;
+		if (t->raw != NULL) {
+			bytebuf_putc(t->raw, c);
+		}
+	}
+
+	return c;
+}
+
+static enum json_token
+literal(struct jsontok *t, const char *rest, enum json_token tok)
+{
+
+	for (; *rest; rest++) {
+		if (get(t) != *rest) {
+			return JSON_ERROR;
+		}
+	}
+
+	return tok;
+}
+
+static enum json_token
+number(struct jsontok *t, int c)
+{
+	char num[64], *e;
+	size_t n;
+
+	n = 0;
+	num[n++] = c;
+	while ((c = peek(t)) > 0 && strchr("0123456789+-.eE", c) != NULL) {
+		if (n == sizeof num - 1) {
+			return JSON_ERROR;
+		}
+		num[n++] = get(t);
+	}
+	num[n] = '\0';
+
+	t->number = strtod(num, &e);
+
+	return (*e == '\0') ? JSON_NUMBER : JSON_ERROR;
+}
+
+static int
+skip_string(struct jsontok *t)
+{
+	unsigned char scratch[256];
+	ssize_t n;
+
+	while ((n = jsontok_string(t, scratch, sizeof scratch)) > 0) {
+		continue;
+	}
+	t->instring = 0;
+
+	return n;
+}
+
+enum json_token
+jsontok_next(struct jsontok *t)
+{
+	int c;
+
+	if (t->instring && skip_string(t) == -1) {
+		return JSON_ERROR;
+	}
+
+	for (;;) {
+		switch (c = get(t)) {
+		case -1:
+			return JSON_EOF;
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\n':
+		case ',':
+		case ':':
+			continue;
+		case '{':
+			return JSON_OBJECT;
+		case '}':
+			return JSON_OBJECT_END;
+		case '[':
+			return JSON_ARRAY;
+		case ']':
+			return JSON_ARRAY_END;
+		case '"':
+			t->instring = 1;
+			return JSON_STRING;
+		case 't':
+			return literal(t, "rue", JSON_TRUE);
+		case 'f':
+			return literal(t, "alse", JSON_FALSE);
+		case 'n':
+			return literal(t, "ull", JSON_NULL);
+		default:
+			if (c == '-' || (c >= '0' && c <= '9')) {
+				return number(t, c);
+			}
+			return JSON_ERROR;
+		}
+	}
+}
+
+static long
+hex4(struct jsontok *t)
+{
+	long v = 0;
+
+	for (int i = 0; i < 4; i++) {
+		int c = get(t);
+
+		if (c >= '0' && c <= '9') {
+			v = v << 4 | (c - '0');
+		} else if (c >= 'a' && c <= 'f') {
+			v = v << 4 | (c - 'a' + 10);
+		} else if (c >= 'A' && c <= 'F') {
+			v = v << 4 | (c - 'A' + 10);
+		} else {
+			return -1;
+		}
+	}
+
+	return v;
+}
+
+/* The code point of the escape after a backslash, or -1 */
+static long
+unescape(struct jsontok *t)
+{
+	int c;
+
+	switch (c = get(t)) {
+	case '"':
+	case '\\':
+	case '/':
+		return c;
+	case 'b':
+		return '\b';
+	case 'f':
+		return '\f';
+	case 'n':
+		return '\n';
+	case 'r':
+		return '\r';
+	case 't':
+		return '\t';
+	case 'u':
+		return hex4(t);
+	default:
+		return -1;
+	}
+}
+
+static size_t
+put_utf8(unsigned char *o, uint32_t c)
+{
+
+	if (c < 0x80) {
+		o[0] = c;
+		return 1;
+	} else if (c < 0x800) {
+		o[0] = 0xc0 | c >> 6;
+		o[1] = 0x80 | (c & 0x3f);
+		return 2;
+	} else if (c < 0x10000) {
+		o[0] = 0xe0 | c >> 12;
+		o[1] = 0x80 | ((c >> 6) & 0x3f);
+		o[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+
+	o[0] = 0xf0 | c >> 18;
+	o[1] = 0x80 | ((c >> 12) & 0x3f);
+	o[2] = 0x80 | ((c >> 6) & 0x3f);
+	o[3] = 0x80 | (c & 0x3f);
+	return 4;
+}
+
+/* Read the next piece of the current string, unescaped, into dst (at least
+ * JSONTOK_STRING_MIN bytes). Returns its length, 0 at the end of the string
+ * or -1 if it is malformed. Unpaired surrogates become U+FFFD.
+ */
+ssize_t
+jsontok_string(struct jsontok *t, unsigned char *dst, size_t size)
+{
+	size_t n;
+	long cp;
+	int c;
+
+	n = 0;
+	while (t->instring && n + JSONTOK_STRING_MIN <= size) {
+		/* Plain runs are copied straight out of the buffer */
+		if (t->raw == NULL && t->pos < t->len) {
+			size_t avail = MIN(t->len - t->pos, size - n);
+			size_t i;
+
+			for (i = 0; i < avail; i++) {
+				c = t->buf[t->pos + i];
+				if (c == '"' || c == '\\') {
+					break;
+				}
+			}
+
+			memcpy(&dst[n], &t->buf[t->pos], i);
+			t->pos += i;
+			n += i;
+			if (n + JSONTOK_STRING_MIN > size) {
+				break;
+			}
+		}
+
+		c = get(t);
+		if (c == -1) {
+			return -1;
+		} else if (c == '"') {
+			t->instring = 0;
+			break;
+		} else if (c != '\\') {
+			dst[n++] = c;
+			continue;
+		}
+
+		if ((cp = unescape(t)) == -1) {
+			return -1;
+		}
+
+		if (cp >= 0xd800 && cp < 0xdc00) {
+			long lo = -1;
+
+			if (peek(t) == '\\') {
+				get(t);
+				if ((lo = unescape(t)) == -1) {
+					return -1;
+				}
+			}
+
+			if (lo >= 0xdc00 && lo < 0xe000) {
+				cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+			} else {
+				n += put_utf8(&dst[n], 0xfffd);
+				if ((cp = lo) == -1) {
+					continue;
+				}
+			}
+		}
+
+		if (cp >= 0xd800 && cp < 0xe000) {
+			cp = 0xfffd;
+		}
+
+		n += put_utf8(&dst[n], cp);
+	}
+
+	return n;
+}
+
+/* Skip the rest of the value starting with tok. Returns -1 if it is
+ * malformed.
+ */
+int
+jsontok_skip(struct jsontok *t, enum json_token tok)
+{
+	int depth = 0;
+
+	for (;;) {
+		switch (tok) {
+		case JSON_OBJECT:
+		case JSON_ARRAY:
+			depth++;
+			break;
+		case JSON_OBJECT_END:
+		case JSON_ARRAY_END:
+			depth--;
+			break;
+		case JSON_STRING:
+			if (skip_string(t) == -1) {
+				return -1;
+			}
+			break;
+		case JSON_ERROR:
+		case JSON_EOF:
+			return -1;
+		default:
+			break;
+		}
+
+		if (depth <= 0) {
+			return (depth == 0) ? 0 : -1;
+		}
+
+		tok = jsontok_next(t);
+	}
+}
+
+/* Continue reading at offset in the file. */
+void
+jsontok_seek(struct jsontok *t, off_t offset)
+{
+
+	if (lseek(t->fd, offset, SEEK_SET) == -1) {
+		perror("lseek");
+		exit(EXIT_FAILURE);
+	}
+
+	t->offset = offset;
+	t->pos = t->len = 0;
+	t->instring = 0;
+}
@@ -0,0 +1,109 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "castty.h"
+#include "jsonesc.h"
+#include "keyframe.h"
+
+/* Keyframe index at path, one keyframe at most every interval us. */
+struct keyframes *
+keyframes_open(const char *path, int rows, int cols, uint64_t interval)
+{
+	struct keyframes *kf;
+
+	kf = calloc(1, sizeof *kf);
+	if (kf == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	kf->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (kf->fd == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	kf->interval = interval;
+	kf->vt = vt_create(rows, cols);
+
+	return kf;
+}
+
+void
+keyframes_close(struct keyframes *kf)
+{
+
+	xclose(kf->fd);
+	if (!kf->shared) {
+		vt_destroy(kf->vt);
+	}
+	bytebuf_free(&kf->screen);
+	bytebuf_free(&kf->line);
+	free(kf);
+}
+
+/* Take keyframes of vt, which the caller keeps in step with the events
+ * written, instead of a screen model of our own.
+ */
+void
+keyframes_share(struct keyframes *kf, struct vt *vt)
+{
+
+	vt_destroy(kf->vt);
+	kf->vt = vt;
+	kf->shared = 1;
+}
+
+/* Whether a keyframe should go in before the event at time at (us). */
+int
+keyframes_due(const struct keyframes *kf, uint64_t at)
+{
+
+	return kf->nevents > 0 && at - kf->last_kf >= kf->interval;
+}
+
+void
+keyframes_event(struct keyframes *kf, uint64_t at, const unsigned char *buf,
+    size_t len)
+{
+
+	if (!kf->shared) {
+		vt_write(kf->vt, buf, len);
+	}
+	kf->last_at = at;
+	kf->nevents++;
+}
+
+/* Write a keyframe of the screen as it is now; the next event starts at
+ * offset in the cast. Each keyframe goes out in a single write, so a crash
+ * leaves only whole lines behind.
+ */
+void
+keyframes_write(struct keyframes *kf, uint64_t offset)
+{
+	const struct vt *vt = kf->vt;
+	size_t used;
+
+	kf->screen.len = 0;
+	vt_repaint(vt, &kf->screen);
+
+	kf->line.len = 0;
+	bytebuf_printf(&kf->line, "{\"time\": %0.4f, \"event\": %llu, "
+	    "\"offset\": %llu, \"cursor\": [%d, %d], \"alt\": %d, "
+	    "\"repaint\": \"", kf->last_at / 1e6,
+	    (unsigned long long)kf->nevents, (unsigned long long)offset,
+	    vt->x, vt->y, vt->altscreen);
+
+	bytebuf_grow(&kf->line, JSON_ESCAPE_MAX(kf->screen.len));
+	kf->line.len += json_escape((char *)&kf->line.buf[kf->line.len],
+	    kf->screen.buf, kf->screen.len,
+	    JSON_ESCAPE_UTF8 | JSON_ESCAPE_FINAL, &used);
+
+	bytebuf_put(&kf->line, "\"}\n", 3);
+
+	xwrite_all(kf->fd, kf->line.buf, kf->line.len);
+	kf->last_kf = kf->last_at;
+}
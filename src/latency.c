@@ -0,0 +1,463 @@
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "castty.h"
+#include "latency.h"
+#include "record.h"
+
+/* Keystroke-to-echo latency. A pty stands in for the user's terminal: the
+ * harness types a key on its master side and times how long the echo takes
+ * to come back. The program being typed at echoes keys itself, as a shell's
+ * line editor does, either directly on that pty or recorded by castty
+ * record running on it. Recorded, a key crosses inputproc(), the recorded
+ * pty and outputproc() each way, or with record -s, the one process's
+ * event loop. The CPU time all of it takes per key is reported alongside.
+ */
+
+enum {
+	ROWS = 24,
+	COLS = 80,
+
+	/* Give up on an echo after this long */
+	ECHO_TIMEOUT_MS = 1000,
+
+	/* Output is drained until quiet this long before timing starts */
+	SETTLE_MS = 300,
+};
+
+/* Echoes each key as it arrives */
+#define ECHO_CMD	"stty raw -echo; exec cat"
+
+struct config {
+	const char *name;
+	int record;
+	int single;
+	int audio;
+	int mp3;
+};
+
+static const struct config configs[] = {
+	{ "direct", 0, 0, 0, 0 },
+	{ "record", 1, 0, 0, 0 },
+#ifdef __linux__
+	{ "single", 1, 1, 0, 0 },
+#endif
+	{ "audio", 1, 0, 1, 0 },
+#ifdef __linux__
+	{ "audio-s", 1, 1, 1, 0 },
+#endif
+#ifdef WITH_LAME
+	{ "mp3", 1, 0, 1, 1 },
+#endif
+};
+
+static void
+usage(int status)
+{
+
+	fprintf(stderr, "usage: castty latency [-h] [-b <ms>] [-d <device>] "
+	    "[-g <ms>] [-n <keys>]\n"
+	    " -b <ms>        Fail if the p99 latency of recording exceeds <ms>.\n"
+	    " -d <device>    Also measure while recording audio from <device>"
+#ifdef WITH_LAME
+	    ",\n"
+	    "                with and without mp3 encoding.\n"
+#else
+	    ".\n"
+#endif
+	    " -g <ms>        Wait <ms> between keys (default 2).\n"
+	    " -h             Show this help.\n"
+	    " -n <keys>      Type <keys> keys per measurement (default 2000).\n");
+	exit(status);
+}
+
+static double
+cpu_children(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_CHILDREN, &ru) == -1) {
+		perror("getrusage");
+		exit(EXIT_FAILURE);
+	}
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Read from fd until c shows up; returns 0 if it doesn't within ms. Any
+ * other output is discarded.
+ */
+static int
+await(int fd, int c, int ms)
+{
+	unsigned char buf[BUFSIZ];
+	uint64_t deadline;
+	struct pollfd pfd;
+
+	deadline = now_ns() + (uint64_t)ms * 1000000;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		uint64_t t = now_ns();
+		ssize_t n;
+		int r;
+
+		if (t >= deadline) {
+			return 0;
+		}
+
+		r = poll(&pfd, 1, (deadline - t + 999999) / 1000000);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		} else if (r == -1) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		} else if (r == 0) {
+			continue;
+		}
+
+		n = read(fd, buf, sizeof buf);
+		if (n <= 0) {
+			return 0;
+		}
+
+		if (c != -1 && memchr(buf, c, n) != NULL) {
+			return 1;
+		}
+	}
+}
+
+/* Start the program on a new pty standing in for the user's terminal;
+ * returns the master side.
+ */
+static int
+start(const struct config *c, const char *device, const char *castpath,
+    const char *audiopath, pid_t *pid)
+{
+	struct winsize ws;
+	int master, slave;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+		perror("posix_openpt");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&ws, 0, sizeof ws);
+	ws.ws_row = ROWS;
+	ws.ws_col = COLS;
+	if (ioctl(master, TIOCSWINSZ, &ws) == -1) {
+		perror("ioctl(TIOCSWINSZ)");
+		exit(EXIT_FAILURE);
+	}
+
+	*pid = fork();
+	if (*pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (*pid != 0) {
+		return master;
+	}
+
+	if (setsid() == -1) {
+		perror("setsid");
+		exit(EXIT_FAILURE);
+	}
+
+	slave = open(ptsname(master), O_RDWR);
+	if (slave == -1) {
+		perror("open(ptsname)");
+		exit(EXIT_FAILURE);
+	}
+
+	if (ioctl(slave, TIOCSCTTY, 0) == -1) {
+		perror("ioctl(TIOCSCTTY)");
+		exit(EXIT_FAILURE);
+	}
+
+	xclose(master);
+	xdup2(slave, STDIN_FILENO);
+	xdup2(slave, STDOUT_FILENO);
+	xdup2(slave, STDERR_FILENO);
+	xclose(slave);
+
+	setenv("SHELL", "/bin/sh", 1);
+
+	if (c->record) {
+		char *argv[13];
+		int argc = 0;
+
+		argv[argc++] = "record";
+		argv[argc++] = "-e";
+		argv[argc++] = ECHO_CMD;
+		if (c->single) {
+			argv[argc++] = "-s";
+		}
+		if (c->audio) {
+			argv[argc++] = "-a";
+			argv[argc++] = (char *)audiopath;
+			argv[argc++] = "-d";
+			argv[argc++] = (char *)device;
+		}
+		if (c->mp3) {
+			argv[argc++] = "-m";
+		}
+		argv[argc++] = (char *)castpath;
+		argv[argc] = NULL;
+
+		optind = 1;
+		exit(record_main(argc, argv));
+	}
+
+	execl("/bin/sh", "sh", "-c", ECHO_CMD, NULL);
+	perror("execl");
+	exit(EXIT_FAILURE);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted samples, in milliseconds */
+static double
+percentile(const uint64_t *s, size_t n, double p)
+{
+	size_t i = p * n;
+
+	if (i >= n) {
+		i = n - 1;
+	}
+
+	return s[i] / 1e6;
+}
+
+/* Type nkeys keys at the program, gap_ms apart. Returns the number of
+ * echoes timed into samples.
+ */
+static size_t
+measure(int master, uint64_t *samples, size_t nkeys, int gap_ms)
+{
+	struct timespec gap = { gap_ms / 1000, (gap_ms % 1000) * 1000000L };
+	unsigned char key;
+	size_t n;
+
+	/* Wait for the program to come up and echo, then for leftovers from
+	 * before it turned echoing over from the terminal to drain.
+	 */
+	key = '.';
+	for (int tries = 0; ; tries++) {
+		if (tries == 50) {
+			return 0;
+		}
+
+		xwrite_all(master, &key, 1);
+		if (await(master, key, 100)) {
+			break;
+		}
+	}
+	await(master, -1, SETTLE_MS);
+
+	n = 0;
+	for (size_t i = 0; i < nkeys; i++) {
+		uint64_t t;
+
+		key = 'a' + i % 26;
+
+		t = now_ns();
+		xwrite_all(master, &key, 1);
+		if (!await(master, key, ECHO_TIMEOUT_MS)) {
+			fprintf(stderr, "castty: No echo within %dms\n",
+			    ECHO_TIMEOUT_MS);
+			break;
+		}
+		samples[n++] = now_ns() - t;
+
+		nanosleep(&gap, NULL);
+	}
+
+	return n;
+}
+
+int
+latency_main(int argc, char **argv)
+{
+	char castpath[] = "/tmp/castty-latency.XXXXXX";
+	char audiopath[] = "/tmp/castty-latency-audio.XXXXXX";
+	const char *device;
+	uint64_t *samples;
+	double budget;
+	int ch, gap_ms, status, over, fd;
+	size_t nkeys;
+	char *e;
+
+	budget = 0;
+	device = NULL;
+	gap_ms = 2;
+	nkeys = 2000;
+
+	while ((ch = getopt(argc, argv, "?b:d:g:hn:")) != EOF) {
+		switch (ch) {
+		case 'b':
+			errno = 0;
+			budget = strtod(optarg, &e);
+			if (e == optarg || errno != 0 || !(budget > 0) ||
+			    (*e && strcmp(e, "ms"))) {
+				fprintf(stderr, "castty: Invalid budget: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 'g':
+			errno = 0;
+			gap_ms = strtol(optarg, &e, 10);
+			if (e == optarg || errno != 0 || gap_ms < 0 ||
+			    gap_ms > 1000 || (*e && strcmp(e, "ms"))) {
+				fprintf(stderr, "castty: Invalid gap: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'n':
+			errno = 0;
+			nkeys = strtoul(optarg, &e, 10);
+			if (e == optarg || errno != 0 || nkeys < 1 ||
+			    nkeys > 1000000 || *e) {
+				fprintf(stderr, "castty: Invalid key count: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'h':
+		case '?':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	samples = malloc(nkeys * sizeof *samples);
+	if (samples == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((fd = mkstemp(castpath)) == -1) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	xclose(fd);
+
+	if ((fd = mkstemp(audiopath)) == -1) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	xclose(fd);
+
+	/* Children are reaped here, not by the handler */
+	signal(SIGCHLD, SIG_DFL);
+
+#ifdef __linux__
+	/* So are the processes a recording leaves behind when it's hung up,
+	 * which makes their CPU time count.
+	 */
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+		perror("prctl(PR_SET_CHILD_SUBREAPER)");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	printf("%-8s %6s %10s %10s %10s %10s %10s\n", "config", "keys", "p50 ms",
+	    "p99 ms", "p99.9 ms", "max ms", "CPU us/key");
+
+	over = 0;
+	for (unsigned i = 0; i < sizeof configs / sizeof configs[0]; i++) {
+		const struct config *c = &configs[i];
+		double p99, cpu;
+		size_t n;
+		pid_t pid;
+		int master;
+
+		if (c->audio && device == NULL) {
+			continue;
+		}
+
+		cpu = cpu_children();
+		master = start(c, device, castpath, audiopath, &pid);
+		n = measure(master, samples, nkeys, gap_ms);
+
+		/* Hanging up the terminal ends the program or recording */
+		xclose(master);
+		kill(-pid, SIGHUP);
+		while (waitpid(-1, &status, 0) != -1 || errno == EINTR) {
+			continue;
+		}
+		cpu = cpu_children() - cpu;
+
+		if (n == 0) {
+			printf("%-8s %6s\n", c->name, "-");
+			over = 1;
+			continue;
+		}
+
+		qsort(samples, n, sizeof *samples, cmp_u64);
+		p99 = percentile(samples, n, 0.99);
+		printf("%-8s %6zu %10.3f %10.3f %10.3f %10.3f %10.1f\n", c->name,
+		    n, percentile(samples, n, 0.50), p99,
+		    percentile(samples, n, 0.999), samples[n - 1] / 1e6,
+		    cpu * 1e6 / n);
+
+		if (n < nkeys || (budget > 0 && c->record && p99 > budget)) {
+			over = 1;
+		}
+	}
+
+	fflush(stdout);
+	if (over && budget > 0) {
+		fprintf(stderr, "castty: Latency budget of %.3fms exceeded\n",
+		    budget);
+	}
+
+	unlink(castpath);
+	unlink(audiopath);
+	free(samples);
+
+	return over ? EXIT_FAILURE : EXIT_SUCCESS;
+}
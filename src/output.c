@@ -1,8 +1,11 @@
-#include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#endif
 
 #include <assert.h>
-#include <ctype.h>
-#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,21 +13,72 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 
+#include "asciicast.h"
 #include "audio.h"
+#include "bincast.h"
+#include "broadcast.h"
 #include "castty.h"
+#include "evwriter.h"
+#include "evwriter-zstd.h"
+#include "hist.h"
+#include "jsonesc.h"
+#include "keyframe.h"
+#include "rclock.h"
 #include "record.h"
-#include "utf8.h"
-
-static int audio_enabled, paused, start_paused;
-static struct timeval prevtv, nowtv;
-static double aprev, anow, dur;
-static FILE *evout;
+#include "serializer.h"
+#include "uring.h"
+#include "vt.h"
+
+static int audio_enabled, paused, start_paused, max_idle;
+/* Recording time of the last event, and the clock when it was stamped */
+static uint64_t dur, prev;
+static struct evwriter *evout;
 static int master;
 
-static void
-handle_command(enum control_command cmd)
+/* The pty read buffer, sized to how output arrives */
+static unsigned char *rbuf;
+static size_t rsize;
+static int nsmall;
+
+extern FILE *debug_out;
+
+enum {
+	/* Bounds for the adaptively sized pty read buffer */
+	RBUF_MIN = BUFSIZ,
+	RBUF_MAX = 256 * 1024,
+
+	/* Output held for a slow terminal before it skips ahead */
+	RELAY_MAX = 1024 * 1024,
+};
+
+/* Output on its way to the user's terminal. Writes to it don't block: when
+ * the terminal is slow to render, output waits here instead of stalling
+ * pty reads, so the shell keeps running and its output is stamped when it
+ * is read. Past RELAY_MAX, what is waiting is dropped and the terminal is
+ * repainted with the latest screen once it catches up.
+ */
+static struct {
+	int fd;
+	int flags;
+	struct bytebuf buf;
+	size_t off;
+
+	/* When the oldest waiting output was read */
+	uint64_t since;
+
+	/* The screen after all output so far, if the terminal is one */
+	struct vt *vt;
+	int skipping;
+	uint64_t skips;
+	uint64_t skipped;
+} term;
+
+void
+relay_command(enum control_command cmd)
 {
 	static unsigned char c_a = 0x01;
 	static unsigned char c_l = 0x0c;
@@ -51,165 +105,631 @@ handle_command(enum control_command cmd)
 			xwrite(master, &c_l, 1);
 			if (audio_enabled) {
 				audio_start();
-				anow = aprev = audio_clock_ms();
-			} else {
-				gettimeofday(&prevtv, NULL);
-				nowtv = prevtv;
 			}
+			prev = rclock_now();
 		} else {
+			serializer_flush();
 			if (audio_enabled) {
 				audio_stop();
 			}
 		}
 		break;
 
+	case CMD_STATS:
+		if (debug_out) {
+			hist_dump(debug_out, "on request");
+		}
+		break;
+
 	default:
 		abort();
 	}
 }
 
-static void
-handle_input(unsigned char *buf, size_t buflen, int format_version)
+/* Advance the recording clock to now; returns the recording time in
+ * microseconds. Only time spent recording counts, so the clock is picked up
+ * afresh after a pause.
+ */
+static uint64_t
+advance_clock(void)
 {
-	assert(format_version == 1 || format_version == 2);
 	static int first = 1;
-	double delta;
+	uint64_t now, delta;
 
 	if (first) {
-		if (audio_enabled) {
-			if (!start_paused) {
-				audio_start();
-			}
-			anow = aprev = audio_clock_ms();
-		} else {
-			gettimeofday(&prevtv, NULL);
-			nowtv = prevtv;
+		if (audio_enabled && !start_paused) {
+			audio_start();
 		}
-
+		prev = rclock_now();
 		first = 0;
+	}
+
+	now = rclock_now();
+	delta = now - prev;
+	prev = now;
+
+	/* Time spent away from the keyboard is cut short */
+	if (!audio_enabled && max_idle && delta > (uint64_t)max_idle * 1000) {
+		delta = (uint64_t)max_idle * 1000;
+	}
+
+	dur += delta;
+
+	return dur;
+}
+
+static void
+term_open(int rows, int cols)
+{
+	char *name;
+
+	term.fd = STDOUT_FILENO;
+	term.flags = fcntl(STDOUT_FILENO, F_GETFL);
+
+	if (!isatty(STDOUT_FILENO)) {
+		fcntl(STDOUT_FILENO, F_SETFL, term.flags | O_NONBLOCK);
+		return;
+	}
+
+	/* stdout usually shares its open file with inputproc()'s stdin,
+	 * which must keep blocking; open the terminal again for our own
+	 * flags. If that fails, writes block as they used to.
+	 */
+	if ((name = ttyname(STDOUT_FILENO)) != NULL &&
+	    (term.fd = open(name, O_WRONLY | O_NOCTTY | O_NONBLOCK)) != -1) {
+		term.vt = vt_create(rows, cols);
 	} else {
-		if (audio_enabled) {
-			anow = audio_clock_ms();
+		term.fd = STDOUT_FILENO;
+	}
+}
+
+/* Where output for the terminal is written, to wait on. */
+int
+term_fd(void)
+{
+
+	return term.fd;
+}
+
+/* Whether output is waiting for the terminal to take it. */
+int
+term_waiting(void)
+{
+
+	return term.skipping || term.off < term.buf.len;
+}
+
+/* Write out what's waiting for the terminal; returns -1 on error. */
+int
+term_flush(void)
+{
+	ssize_t n;
+
+	if (!term.skipping && term.off == term.buf.len) {
+		return 0;
+	}
+
+	if (term.skipping) {
+		term.buf.len = term.off = 0;
+		bytebuf_put(&term.buf, VT_RESET, sizeof VT_RESET - 1);
+		vt_repaint(term.vt, &term.buf);
+		term.skipping = 0;
+	}
+
+	while (term.off < term.buf.len) {
+		n = write(term.fd, term.buf.buf + term.off, term.buf.len - term.off);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && errno == EAGAIN) {
+			return 0;
+		} else if (n == -1) {
+			perror("write");
+			return -1;
+		}
+
+		term.off += n;
+	}
+
+	hist_record(&hist_relay, hist_now() - term.since);
+	term.buf.len = term.off = 0;
+
+	return 0;
+}
+
+/* Relay output read at t to the terminal; returns -1 on error. */
+int
+term_write(unsigned char *buf, size_t len, uint64_t t)
+{
+	size_t waiting;
+	ssize_t n;
+
+	n = 0;
+	if (!term.skipping && term.off == term.buf.len) {
+		do {
+			n = write(term.fd, buf, len);
+		} while (n == -1 && errno == EINTR);
+
+		if (n == -1 && errno == EAGAIN) {
+			n = 0;
+		} else if (n == -1) {
+			perror("write");
+			return -1;
+		}
+
+		if ((size_t)n == len) {
+			hist_record(&hist_relay, hist_now() - t);
 		} else {
-			gettimeofday(&nowtv, NULL);
+			term.since = t;
+		}
+	}
+
+	/* Kept up to date after the write, so it doesn't add to latency */
+	if (term.vt != NULL) {
+		vt_write(term.vt, buf, len);
+	}
+
+	if ((size_t)n == len) {
+		return 0;
+	}
+
+	waiting = term.buf.len - term.off;
+	if (term.skipping || waiting + len - n > RELAY_MAX) {
+		if (!term.skipping) {
+			term.skips++;
 		}
+		term.skipped += waiting + len - n;
+		term.buf.len = term.off = 0;
+
+		/* Without a screen to repaint, output is just dropped */
+		term.skipping = (term.vt != NULL);
+
+		return 0;
 	}
 
-	if (audio_enabled) {
-		delta = anow - aprev;
-		aprev = anow;
+	bytebuf_put(&term.buf, buf + n, len - n);
+
+	return 0;
+}
+
+/* Let the terminal catch up before exiting. */
+static void
+term_close(void)
+{
+
+	if (term.fd == -1) {
+		return;
+	}
+
+	fcntl(term.fd, F_SETFL, fcntl(term.fd, F_GETFL) & ~O_NONBLOCK);
+	term_flush();
+
+	if (term.fd != STDOUT_FILENO) {
+		xclose(term.fd);
 	} else {
-		double pms, nms;
+		fcntl(STDOUT_FILENO, F_SETFL, term.flags);
+	}
 
-		pms = (double)(prevtv.tv_sec * 1000) + ((double)prevtv.tv_usec / 1000.);
-		nms = (double)(nowtv.tv_sec * 1000) + ((double)nowtv.tv_usec / 1000.);
+	if (term.vt != NULL) {
+		vt_destroy(term.vt);
+	}
+	bytebuf_free(&term.buf);
 
-		delta = nms - pms;
-		prevtv = nowtv;
+	if (debug_out && term.skips) {
+		fprintf(debug_out, "terminal fell behind %llu times; %llu bytes "
+		    "of output were skipped\n", (unsigned long long)term.skips,
+		    (unsigned long long)term.skipped);
 	}
+}
 
-	dur += delta;
+/* Stamp a chunk of pty output and queue it for the serializer. */
+void
+relay_output(unsigned char *buf, size_t len)
+{
+
+	if (!paused) {
+		serializer_output(advance_clock(), buf, len);
+	}
+}
+
+/* Read a chunk of the shell's output and relay it; returns 0 once the
+ * shell has hung up, -1 on error.
+ */
+static int
+read_output(int fd)
+{
+	uint64_t t;
+	ssize_t nread;
+	size_t nsize;
+
+	nread = read(fd, rbuf, rsize);
+	if (nread == -1 && (errno == EINTR || errno == EAGAIN)) {
+		return 1;
+	} else if (nread == 0 || (nread == -1 && errno == EIO)) {
+		return 0;
+	} else if (nread == -1) {
+		perror("read");
+		return -1;
+	}
+
+	/* Stamped now, however long the terminal takes */
+	t = hist_now();
+	relay_output(rbuf, nread);
+	if (term_write(rbuf, nread, t) == -1) {
+		return -1;
+	}
+	hist_record(&hist_read, nread);
+
+	/* Grow the read buffer while output arrives in bursts that fill it;
+	 * shrink it back once reads have stayed small for a while.
+	 */
+	nsize = rsize;
+	if ((size_t)nread == rsize && rsize < RBUF_MAX) {
+		nsize = rsize * 2;
+		nsmall = 0;
+	} else if ((size_t)nread < rsize / 4 && rsize > RBUF_MIN) {
+		if (++nsmall == 64) {
+			nsize = rsize / 2;
+			nsmall = 0;
+		}
+	} else {
+		nsmall = 0;
+	}
+
+	if (nsize != rsize) {
+		unsigned char *p = realloc(rbuf, nsize);
+		if (p == NULL) {
+			perror("realloc");
+			return -1;
+		}
+
+		rbuf = p;
+		rsize = nsize;
+	}
+
+	return 1;
+}
+
+#ifdef __linux__
+/* Signals the single-process loop reads from its signalfd */
+static sigset_t loopsigs;
+
+/* Keyboard input on its way to the shell. The pty only takes so much
+ * before the shell reads it; the rest waits here instead of blocking the
+ * loop, which has to keep reading the shell's output meanwhile.
+ */
+static struct bytebuf keys;
+static size_t keysoff;
+
+static void
+flush_keys(void)
+{
+	ssize_t n;
+
+	while (keysoff < keys.len) {
+		n = write(master, keys.buf + keysoff, keys.len - keysoff);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && errno == EAGAIN) {
+			return;
+		} else if (n == -1) {
+			/* The shell is gone; its hangup ends the loop */
+			break;
+		}
+
+		keysoff += n;
+	}
+
+	keys.len = keysoff = 0;
+}
+
+/* Takes input_process()'s writes: keys are queued for the pty, and
+ * commands are run right away instead of going over a pipe.
+ */
+static void
+emit_input(int fd, void *buf, size_t len)
+{
+	static unsigned char c_a = 0x01;
+
+	if (fd == -1) {
+		enum control_command cmd = *(enum control_command *)buf;
+
+		if (cmd != CMD_CTRL_A) {
+			relay_command(cmd);
+			return;
+		}
+
+		/* Stays in order with the keys around it */
+		buf = &c_a;
+		len = 1;
+	}
+
+	bytebuf_put(&keys, buf, len);
+	flush_keys();
+}
+
+static int
+epoll_set(int ep, int op, int fd, uint32_t events, uint32_t tag)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = events;
+	ev.data.u32 = tag;
+
+	return epoll_ctl(ep, op, fd, &ev);
+}
+
+/* Record in this one process: keyboard input and runtime commands, the
+ * shell's output, the terminal and signals are all handled in a single
+ * epoll(7) loop, sparing every key and every chunk of output the trip
+ * between processes. Returns the exit status.
+ */
+static int
+single_loop(void)
+{
+	enum { EV_STDIN, EV_MASTER, EV_TERM, EV_SIGNAL };
+	unsigned char ibuf[BUFSIZ];
+	struct epoll_event evs[4];
+	struct signalfd_siginfo si;
+	uint32_t mwant, mhave, twant, thave;
+	int ep, sfd, status, tpoll, r;
+	ssize_t n;
+
+	status = EXIT_FAILURE;
+	ep = sfd = -1;
+
+	sfd = signalfd(-1, &loopsigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sfd == -1) {
+		perror("signalfd");
+		goto out;
+	}
+
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep == -1) {
+		perror("epoll_create1");
+		goto out;
+	}
+
+	mhave = EPOLLIN;
+	thave = 0;
+	if (epoll_set(ep, EPOLL_CTL_ADD, STDIN_FILENO, EPOLLIN, EV_STDIN) == -1 ||
+	    epoll_set(ep, EPOLL_CTL_ADD, master, mhave, EV_MASTER) == -1 ||
+	    epoll_set(ep, EPOLL_CTL_ADD, sfd, EPOLLIN, EV_SIGNAL) == -1) {
+		perror("epoll_ctl");
+		goto out;
+	}
+
+	/* Regular files can't be waited on, but never keep writes waiting */
+	tpoll = 1;
+	if (epoll_set(ep, EPOLL_CTL_ADD, term.fd, thave, EV_TERM) == -1) {
+		if (errno != EPERM) {
+			perror("epoll_ctl");
+			goto out;
+		}
+		tpoll = 0;
+	}
+
+	for (;;) {
+		int nready;
 
-	if (format_version == 2) {
-		fprintf(evout, "[%0.4f,\"o\",\"", dur / 1000);
-	} else if (format_version == 1) {	
-		fprintf(evout, ",[%0.4f,\"", delta / 1000);
-	}
-
-	uint32_t state, cp;
-	state = 0;
-	for (size_t j = 0; j < buflen; j++) {
-		if (!u8_decode(&state, &cp, buf[j])) {
-			if ((cp < 128 && !isprint(cp)) ||
-			    cp > 128) {
-				if (state == UTF8_ACCEPT) {
-					if (cp > 0xffff) {
-						uint32_t h, l;
-						h = ((cp - 0x10000) >> 10) + 0xd800;
-						l = ((cp - 0x10000) & 0x3ff) + 0xdc00;
-						fprintf(evout, "\\u%04" PRIx32 "\\u%04" PRIx32, h, l);
-					} else {
-						fprintf(evout, "\\u%04" PRIx32, cp);
+		/* Only wait to write while something is waiting to be written */
+		mwant = EPOLLIN | (keysoff < keys.len ? EPOLLOUT : 0);
+		if (mwant != mhave) {
+			epoll_set(ep, EPOLL_CTL_MOD, master, mwant, EV_MASTER);
+			mhave = mwant;
+		}
+
+		twant = term_waiting() ? EPOLLOUT : 0;
+		if (tpoll && twant != thave) {
+			epoll_set(ep, EPOLL_CTL_MOD, term.fd, twant, EV_TERM);
+			thave = twant;
+		}
+
+		nready = epoll_wait(ep, evs, sizeof evs / sizeof evs[0], -1);
+		if (nready == -1 && errno == EINTR) {
+			continue;
+		} else if (nready == -1) {
+			perror("epoll_wait");
+			goto out;
+		}
+
+		for (int i = 0; i < nready; i++) {
+			uint32_t e = evs[i].events;
+
+			switch (evs[i].data.u32) {
+			case EV_STDIN:
+				/* The user's terminal going away ends it all */
+				n = read(STDIN_FILENO, ibuf, sizeof ibuf);
+				if (n == -1 && errno == EINTR) {
+					break;
+				} else if (n <= 0) {
+					goto out;
+				}
+
+				input_process(ibuf, n, master, -1, emit_input);
+				break;
+
+			case EV_MASTER:
+				if (e & EPOLLOUT) {
+					flush_keys();
+				}
+
+				/* Drain whatever the shell left behind before
+				 * hanging up; its hangup is the normal end.
+				 */
+				if (e & EPOLLIN) {
+					if ((r = read_output(master)) <= 0) {
+						status = r == 0 ?
+						    EXIT_SUCCESS : EXIT_FAILURE;
+						goto out;
 					}
-				} else {
-					fputs("\\ud83d\\udca9", evout);
+				} else if (e & (EPOLLHUP | EPOLLERR)) {
+					status = EXIT_SUCCESS;
+					goto out;
 				}
-			} else {
-				switch (buf[j]) {
-				case '"':
-				case '\\':
-					fputc('\\', evout); // output backslash for escaping
-					fputc(buf[j], evout); // print the character itself
-					break;
-				default:
-					fputc(buf[j], evout);
-					break;
+				break;
+
+			case EV_TERM:
+				if (e & (EPOLLHUP | EPOLLERR)) {
+					goto out;
+				} else if (term_flush() == -1) {
+					goto out;
+				}
+				break;
+
+			case EV_SIGNAL:
+				while (read(sfd, &si, sizeof si) == sizeof si) {
+					switch (si.ssi_signo) {
+					case SIGWINCH:
+						resize_pty();
+						break;
+					case SIGCHLD:
+						while (waitpid(-1, NULL, WNOHANG) > 0);
+						break;
+					default:
+						/* Hung up or told to stop: the cast
+						 * is still finished properly.
+						 */
+						goto out;
+					}
 				}
+				break;
 			}
 		}
 	}
 
-	fputs("\"]\n", evout);
+out:
+	if (ep != -1) {
+		xclose(ep);
+	}
+	if (sfd != -1) {
+		xclose(sfd);
+	}
+	bytebuf_free(&keys);
+
+	return status;
 }
+#endif
 
-void
+int
 outputproc(struct outargs *oa)
 {
-	unsigned char obuf[BUFSIZ];
-	struct pollfd pollfds[2];
+	struct serializer_args sa;
+	struct cast_header hdr;
+	struct asciicast cast;
+	struct bincast bin;
+	struct pollfd pollfds[3];
 	int status;
 
 	status = EXIT_SUCCESS;
 	master = oa->masterfd;
+	term.fd = -1;
 
 	assert(oa->format_version == 1 || oa->format_version == 2);
 
+#ifdef __linux__
+	/* Blocked in every thread for the signalfd to get them, so before
+	 * any thread starts.
+	 */
+	if (oa->single) {
+		sigemptyset(&loopsigs);
+		sigaddset(&loopsigs, SIGWINCH);
+		sigaddset(&loopsigs, SIGCHLD);
+		sigaddset(&loopsigs, SIGHUP);
+		sigaddset(&loopsigs, SIGINT);
+		sigaddset(&loopsigs, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &loopsigs, NULL);
+	}
+#endif
+
 	if (oa->audioout || oa->devid) {
 		assert(oa->audioout && oa->devid);
 	}
 
 	if (oa->audioout) {
 		audio_enabled = 1;
-		audio_init(oa->devid, oa->audioout, oa->use_raw);
+		audio_init(oa->devid, oa->audioout, oa->use_raw, oa->sync_ms,
+		    oa->audio_buf_s, oa->spill_dir);
 	}
 
 	start_paused = paused = oa->start_paused;
+	max_idle = oa->max_idle_ms;
 
-	evout = xfopen(oa->outfn, "wb");
+	rsize = RBUF_MIN;
+	rbuf = malloc(rsize);
+	if (rbuf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	nsmall = 0;
+
+	evout = evwriter_open(oa->outfn, EVWRITER_BUFSIZE, oa->flush_ms);
+	evwriter_set_sync(evout, oa->sync_ms);
+	if (evout->stream) {
+		/* A reader going away fails the write instead */
+		signal(SIGPIPE, SIG_IGN);
+	}
+	if (oa->use_zstd) {
+		evwriter_set_sink(evout, evsink_zstd(evout->fd, oa->zstd_dict));
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.cols = oa->cols;
+	hdr.rows = oa->rows;
+	hdr.cmd = oa->cmd;
+	hdr.title = oa->title;
+	hdr.env = oa->env;
+
+	memset(&sa, 0, sizeof sa);
+	if (oa->binary) {
+		bincast_init(&bin, evout);
+		bincast_header(&bin, &hdr);
+		sa.bin = &bin;
+	} else {
+		/* v1 players predate raw UTF-8 in casts; v2 gets it unless asked not to */
+		asciicast_init(&cast, evout, oa->format_version,
+		    (oa->format_version == 2 && !oa->ascii_only) ?
+		    JSON_ESCAPE_UTF8 : 0);
+		asciicast_header(&cast, &hdr);
+		sa.cast = &cast;
+	}
+	evwriter_flush(evout);
+
+	if (oa->keyframe_s) {
+		size_t len = strlen(oa->outfn) + sizeof ".idx";
+		char *path;
+
+		path = malloc(len);
+		if (path == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		snprintf(path, len, "%s.idx", oa->outfn);
+
+		sa.keyframes = keyframes_open(path, oa->rows, oa->cols,
+		    (uint64_t)oa->keyframe_s * 1000000);
+		free(path);
+	}
+
+	sa.out = evout;
+	sa.coalesce_ms = oa->coalesce_ms;
+	sa.fps = oa->fps;
+	sa.rows = oa->rows;
+	sa.cols = oa->cols;
+	sa.queue_size = (size_t)oa->queue_mb << 20;
+
+	if (oa->broadcastfd != -1) {
+		broadcast_start(oa->broadcastfd, oa->rows, oa->cols);
+	}
+
+	serializer_start(&sa);
 
-	/* Write asciicast header and append events. Format defined at
-	 * v1 https://github.com/asciinema/asciinema/blob/master/doc/asciicast-v1.md
-	 * v2 https://github.com/asciinema/asciinema/blob/master/doc/asciicast-v2.md
-	 *
-	 * With v1, we insert an empty first record to avoid the hassle of dealing with
-	 * ES (still) not supporting trailing commas.
-	 */
-	fprintf(evout,
-	    "{                        " // have room to write duration later
-	    "\"version\": %d, "
-	    "\"width\": %d, "
-	    "\"height\": %d, "
-	    "\"command\": \"%s\", "
-	    "\"title\": \"%s\", "
-	    "\"env\": %s",
-	    oa->format_version,
-	    oa->cols, oa->rows,
-	    oa->cmd ? oa->cmd : "",
-	    oa->title ? oa->title : "",
-	    oa->env
-	);
-	if (oa->format_version == 2) {
-		// v2 header finished here, data will be appended in separate lines
-		fprintf(evout, "}\n");
-	} else if (oa->format_version == 1) {
-		// v1 header finished, console data is appended in structure
-		fprintf(evout, ",\"stdout\":[[0,\"\"]\n");
-	}
-
-	setbuf(evout, NULL);
 	setbuf(stdout, NULL);
 
-	xclose(STDIN_FILENO);
+	/* Keyboard input is read by inputproc() unless it's read here */
+	if (!oa->single) {
+		xclose(STDIN_FILENO);
+	}
 
 	/* Clear screen */
 	printf("\x1b[2J");
@@ -217,9 +737,25 @@ outputproc(struct outargs *oa)
 	/* Move cursor to top-left */
 	printf("\x1b[H");
 
+	term_open(oa->rows, oa->cols);
+
+#ifdef WITH_URING
+	if (oa->use_uring && (status = uring_outputloop(oa)) != -1) {
+		goto end;
+	}
+	status = EXIT_SUCCESS;
+#endif
+
 	int f = fcntl(oa->masterfd, F_GETFL);
 	fcntl(oa->masterfd, F_SETFL, f | O_NONBLOCK);
 
+#ifdef __linux__
+	if (oa->single) {
+		status = single_loop();
+		goto end;
+	}
+#endif
+
 	f = fcntl(oa->controlfd, F_GETFL);
 	fcntl(oa->controlfd, F_SETFL, f | O_NONBLOCK);
 
@@ -232,10 +768,17 @@ outputproc(struct outargs *oa)
 	pollfds[1].events = POLLIN;
 	pollfds[1].revents = 0;
 
+	pollfds[2].fd = term.fd;
+	pollfds[2].events = 0;
+	pollfds[2].revents = 0;
+
 	for (;;) {
 		int nready;
 
-		nready = poll(pollfds, 2, -1);
+		/* Only wait on the terminal while output is waiting for it */
+		pollfds[2].events = term_waiting() ? POLLOUT : 0;
+
+		nready = poll(pollfds, 3, -1);
 		if (nready == -1 && errno == EINTR) {
 			continue;
 		} else if (nready == -1) {
@@ -244,8 +787,20 @@ outputproc(struct outargs *oa)
 			goto end;
 		}
 
+		if (pollfds[2].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+			status = EXIT_FAILURE;
+			goto end;
+		} else if (pollfds[2].revents & POLLOUT) {
+			if (term_flush() == -1) {
+				status = EXIT_FAILURE;
+				goto end;
+			}
+		}
+
 		for (int i = 0; i < 2; i++) {
-			if ((pollfds[i].revents & (POLLHUP | POLLERR | POLLNVAL))) {
+			/* Drain whatever the shell left behind before hanging up */
+			if ((pollfds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) &&
+			    !(pollfds[i].revents & POLLIN)) {
 				status = EXIT_FAILURE;
 				goto end;
 			}
@@ -265,35 +820,36 @@ outputproc(struct outargs *oa)
 					goto end;
 				}
 
-				handle_command(cmd);
+				relay_command(cmd);
 			} else if (pollfds[i].fd == oa->masterfd) {
-				ssize_t nread;
-
-				nread = read(oa->masterfd, obuf, BUFSIZ);
-				if (nread <= 0) {
+				if (read_output(oa->masterfd) <= 0) {
 					status = EXIT_FAILURE;
 					goto end;
 				}
-
-				xwrite(STDOUT_FILENO, obuf, nread);
-
-				if (!paused) {
-					handle_input(obuf, nread, oa->format_version);
-				}
 			}
 		}
 	}
 
 end:
-	if (oa->format_version == 1) {
-		// closes stdout segment
-		fprintf(evout, "]}\n");
+	term_close();
+
+	serializer_stop();
+	broadcast_stop();
+
+	if (oa->binary) {
+		bincast_end(&bin, dur);
+	} else {
+		asciicast_end(&cast);
 	}
-	// seeks to header, overwriting spaces with duration
-	fseek(evout, 1L, SEEK_SET);
-	fprintf(evout, "\"duration\": %.9g, ", dur / 1000);
 
-	fflush(evout);
+	// compressed casts can't have the duration patched into the header,
+	// and record it in their index instead; streams end with a trailer
+	if (!oa->binary && (!oa->use_zstd || evout->stream)) {
+		asciicast_duration(&cast, dur);
+	}
+	if (oa->use_zstd) {
+		evwriter_mark(evout, dur);
+	}
 
 	if (oa->audioout && oa->devid) {
 		if (!paused) {
@@ -303,8 +859,16 @@ end:
 		audio_exit();
 	}
 
-	xfclose(evout);
+	if (debug_out) {
+		hist_dump(debug_out, "at exit");
+	}
+
+	evwriter_close(evout);
+	if (sa.keyframes != NULL) {
+		keyframes_close(sa.keyframes);
+	}
 	xclose(oa->masterfd);
+	free(rbuf);
 
-	exit(status);
+	return status;
 }
@@ -0,0 +1,149 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "rclock.h"
+
+/* Loop gains: the share of an error taken into the position, and into the
+ * rate (critically damped: KP^2 / 4). With callbacks every 10ms or so, an
+ * error is worked off within a few hundred milliseconds.
+ */
+#define KP		0.1
+#define KI		0.0025
+
+/* Sound cards are off by far less than this */
+#define MAX_SKEW	0.01
+
+/* An error this large is a stall or a restart, not drift */
+#define RESYNC_US	500000
+
+static struct {
+	/* Seqlock around the estimate, which the capture callback writes
+	 * and the relay reads: the position pos (us) at monotonic time at
+	 * (ns), moving at rate audio microseconds per real one.
+	 */
+	_Atomic unsigned seq;
+	_Atomic int audio;
+	_Atomic uint64_t pos;
+	_Atomic uint64_t at;
+	_Atomic double rate;
+
+	/* Capture callback only */
+	int locked;
+
+	/* Reader only: the last time handed out */
+	uint64_t last;
+} rc = { .rate = 1.0 };
+
+static uint64_t
+mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+publish(uint64_t pos, uint64_t at, double rate)
+{
+	unsigned seq = atomic_load_explicit(&rc.seq, memory_order_relaxed);
+
+	atomic_store_explicit(&rc.seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&rc.pos, pos, memory_order_relaxed);
+	atomic_store_explicit(&rc.at, at, memory_order_relaxed);
+	atomic_store_explicit(&rc.rate, rate, memory_order_relaxed);
+
+	atomic_store_explicit(&rc.seq, seq + 2, memory_order_release);
+}
+
+/* Where the estimate puts the audio at monotonic time now. */
+static double
+estimate(uint64_t now, uint64_t pos, uint64_t at, double rate)
+{
+
+	if (now <= at) {
+		return pos;
+	}
+
+	return pos + (now - at) / 1000. * rate;
+}
+
+uint64_t
+rclock_now(void)
+{
+	uint64_t now, pos, at, t;
+	unsigned seq;
+	double rate;
+
+	now = mono_ns();
+
+	if (!atomic_load_explicit(&rc.audio, memory_order_acquire)) {
+		return now / 1000;
+	}
+
+	do {
+		seq = atomic_load_explicit(&rc.seq, memory_order_acquire);
+		pos = atomic_load_explicit(&rc.pos, memory_order_relaxed);
+		at = atomic_load_explicit(&rc.at, memory_order_relaxed);
+		rate = atomic_load_explicit(&rc.rate, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) ||
+	    seq != atomic_load_explicit(&rc.seq, memory_order_relaxed));
+
+	/* Corrections never take the clock backwards */
+	t = estimate(now, pos, at, rate);
+	if (t < rc.last) {
+		t = rc.last;
+	}
+	rc.last = t;
+
+	return t;
+}
+
+void
+rclock_audio_start(uint64_t pos)
+{
+
+	/* The rate learned so far still holds for the device */
+	publish(pos, mono_ns(), atomic_load_explicit(&rc.rate,
+	    memory_order_relaxed));
+	rc.locked = 0;
+	atomic_store_explicit(&rc.audio, 1, memory_order_release);
+}
+
+void
+rclock_audio(uint64_t pos)
+{
+	uint64_t now, at;
+	double rate, predicted, err, dt;
+
+	now = mono_ns();
+	at = atomic_load_explicit(&rc.at, memory_order_relaxed);
+	rate = atomic_load_explicit(&rc.rate, memory_order_relaxed);
+	predicted = estimate(now, atomic_load_explicit(&rc.pos,
+	    memory_order_relaxed), at, rate);
+	err = (double)pos - predicted;
+
+	/* The first period after a start only sets the position */
+	if (!rc.locked || err > RESYNC_US || err < -RESYNC_US) {
+		publish(pos, now, rate);
+		rc.locked = 1;
+		return;
+	}
+
+	dt = (now - at) / 1000.;
+	if (dt > 0) {
+		rate += KI * err / dt;
+		if (rate < 1 - MAX_SKEW) {
+			rate = 1 - MAX_SKEW;
+		} else if (rate > 1 + MAX_SKEW) {
+			rate = 1 + MAX_SKEW;
+		}
+	}
+
+	publish(predicted + KP * err + 0.5, now, rate);
+}
@@ -1,4 +1,5 @@
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 #include <stdio.h>
@@ -14,8 +15,13 @@
 
 #include "audio/writer-lame.h"
 #include "audio.h"
+#include "broadcast.h"
 #include "castty.h"
+#include "evwriter.h"
+#include "evwriter-zstd.h"
 #include "record.h"
+#include "serializer.h"
+#include "uring.h"
 
 extern char **environ;
 
@@ -159,48 +165,140 @@ static void
 usage(int status)
 {
 
-	fprintf(stderr, "usage: castty record [-acDdehl" LAME_OPT "prt] [out.cast]\n"
+	fprintf(stderr, "usage: castty record [-AaBbCcDdeFfhiKl" LAME_OPT "PpQrSt" SINGLE_OPT URING_OPT "w" ZSTD_OPT "] [out.cast]\n"
+	    " -A             Escape non-ASCII output as \\uXXXX. This is the default for\n"
+	    "                v1; v2 casts otherwise carry validated UTF-8 as-is.\n"
 	    " -a <outfile>   Output audio to <outfile>. Must be specified with -d.\n"
+	    " -B <seconds>   Hold up to <seconds> of audio in memory while it waits to\n"
+	    "                be written (default 10).\n"
+	    " -b             Write a compact binary cast. castty convert turns it into\n"
+	    "                asciicast v1 or v2.\n"
+	    " -C <ms>        Merge output arriving within <ms> milliseconds of the start\n"
+	    "                of an event into that event (e.g. -C 8ms).\n"
 	    " -c <cols>      Use <cols> columns in the recorded shell session.\n"
-	    " -D <outfile>   Send debugging information into <outfile>.\n"
+	    " -D <outfile>   Send debugging information, including latency\n"
+	    "                histograms, into <outfile>.\n"
 	    " -d <device>    Use audio device <device> for input.\n"
 	    " -e <cmd>       Execute <cmd> from the recorded shell session.\n"
+	    " -F <ms>        Write buffered events out at least every <ms> milliseconds,\n"
+	    "                bounding what a crash can lose (default 1000; 0 writes\n"
+	    "                every event immediately).\n"
+	    " -f <fps>       Record the screen at most <fps> times a second, as the\n"
+	    "                changes since the last frame, instead of recording all\n"
+	    "                output. Keeps chatty programs from bloating the cast.\n"
 	    " -h             Show this help.\n"
+	    " -i <seconds>   Record pauses longer than <seconds> as <seconds>, so\n"
+	    "                time spent away doesn't end up in the cast. Can't be\n"
+	    "                used with audio; see castty convert -i instead.\n"
+	    " -K <seconds>   Write a keyframe of the screen to out.cast.idx at most\n"
+	    "                every <seconds>, so players can seek without replaying\n"
+	    "                the whole cast.\n"
 	    " -l             List available audio input devices and exit.\n"
 #ifdef WITH_LAME
+	    " -M             Like -m, but lower the mp3 quality while the encoder\n"
+	    "                can't keep up, and raise it again once it can.\n"
 	    " -m             Encode audio to mp3 before writing.\n"
 #endif
+	    " -P <dir>       Once audio waiting to be written fills half of -B, move it\n"
+	    "                to a temporary file in <dir> instead of losing what\n"
+	    "                doesn't fit.\n"
 	    " -p             Begin the recording in paused mode.\n"
+	    " -Q <MiB>       Queue up to <MiB> of output for writing (default 16). Output\n"
+	    "                beyond that while the disk is slow is counted and dropped.\n"
 	    " -r <rows>      Use <rows> rows in the recorded shell session.\n"
 	    " -R             Use a raw sound device.\n"
+	    " -S <ms>        Sync the cast and audio to disk at least every <ms>\n"
+	    "                milliseconds after they are written out, so that a\n"
+	    "                system crash loses no more than -F plus <ms>.\n"
+	    "                castty recover repairs what is left.\n"
+#ifdef __linux__
+	    " -s             Record in a single process, with one epoll(7) loop for\n"
+	    "                input, output and signals, instead of forking input and\n"
+	    "                output into processes of their own.\n"
+#endif
 	    " -t <title>     Title of the cast.\n"
+#ifdef WITH_URING
+	    " -u             Relay with poll(2) and read(2)/write(2) instead of io_uring.\n"
+#endif
+	    " -w [host:]port Broadcast the session live over HTTP and WebSocket, on\n"
+	    "                loopback unless <host> is given.\n"
+#ifdef WITH_ZSTD
+	    " -z             Write a seekable zstd-compressed cast. Requires -2 or -b.\n"
+	    " -Z <dict>      Compress with the zstd dictionary <dict>. Implies -z.\n"
+#endif
 	    "\n"
 	    " [out.cast]     Optional output filename of recorded events. If not specified,\n"
-	    "                a file \"events.cast\" will be created.\n"
+	    "                a file \"events.cast\" will be created. May be a pipe, FIFO\n"
+	    "                or UNIX socket.\n"
 	    " -2             Output asciicast v2 instead of asciicast v1 format.\n");
 	exit(status);
 }
 
+/* Defaults for everything the output process is told, so that fields
+ * whose "off" isn't zero are never left at it.
+ */
+void
+outargs_init(struct outargs *oa)
+{
+
+	memset(oa, 0, sizeof *oa);
+	oa->flush_ms = EVWRITER_FLUSH_MS;
+	oa->queue_mb = SERIALIZER_QUEUE_MB;
+	oa->broadcastfd = -1;
+#ifdef WITH_URING
+	oa->use_uring = 1;
+#endif
+}
+
 int
 record_main(int argc, char **argv)
 {
-	int ch, controlfd[2];
+	int ch, controlfd[2], status;
 	extern char *optarg;
 	extern int optind;
 	struct outargs oa;
-	char *exec_cmd;
+	const char *broadcast;
+	struct stat st;
+	char *exec_cmd, *shell;
 
-	memset(&oa, 0, sizeof oa);
+	outargs_init(&oa);
 	oa.env = serialize_env();
+	broadcast = NULL;
 	exec_cmd = NULL;
 
-	while ((ch = getopt(argc, argv, "?a:c:D:d:e:hlpr:Rt:2" LAME_OPT)) != EOF) {
+	while ((ch = getopt(argc, argv, "?Aa:B:bC:c:D:d:e:F:f:hi:K:lP:pQ:r:RS:t:w:2" LAME_OPT SINGLE_OPT URING_OPT ZSTD_OPT)) != EOF) {
 		char *e;
 
 		switch (ch) {
+		case 'A':
+			oa.ascii_only = 1;
+			break;
 		case 'a':
 			oa.audioout = strdup(optarg);
 			break;
+		case 'B':
+			errno = 0;
+			oa.audio_buf_s = strtol(optarg, &e, 10);
+			if (e == optarg || errno != 0 || oa.audio_buf_s < 1 ||
+			    oa.audio_buf_s > 600 || (*e && strcmp(e, "s"))) {
+				fprintf(stderr, "castty: Invalid audio buffer: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			oa.binary = 1;
+			break;
+		case 'C':
+			errno = 0;
+			oa.coalesce_ms = strtol(optarg, &e, 10);
+			if (e == optarg || errno != 0 || oa.coalesce_ms < 0 ||
+			    oa.coalesce_ms > 1000 || (*e && strcmp(e, "ms"))) {
+				fprintf(stderr, "castty: Invalid coalescing window: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'c':
 			errno = 0;
 			oa.cols = strtol(optarg, &e, 10);
@@ -220,19 +318,78 @@ record_main(int argc, char **argv)
 			exec_cmd = strdup(optarg);
 			oa.cmd = escape(exec_cmd);
 			break;
+		case 'F':
+			errno = 0;
+			oa.flush_ms = strtol(optarg, &e, 10);
+			if (e == optarg || errno != 0 || oa.flush_ms < 0) {
+				fprintf(stderr, "castty: Invalid flush interval: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'f':
+			errno = 0;
+			oa.fps = strtol(optarg, &e, 10);
+			if (e == optarg || errno != 0 || oa.fps < 0 ||
+			    oa.fps > 1000 || (*e && strcmp(e, "fps"))) {
+				fprintf(stderr, "castty: Invalid frame rate: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'i': {
+			double secs;
+
+			errno = 0;
+			secs = strtod(optarg, &e);
+			if (e == optarg || errno != 0 || !(secs >= 0.001) ||
+			    secs > 86400 || (*e && strcmp(e, "s"))) {
+				fprintf(stderr, "castty: Invalid idle limit: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			oa.max_idle_ms = secs * 1000;
+			break;
+		}
+		case 'K':
+			errno = 0;
+			oa.keyframe_s = strtol(optarg, &e, 10);
+			if (e == optarg || errno != 0 || oa.keyframe_s < 0 ||
+			    oa.keyframe_s > 86400 || (*e && strcmp(e, "s"))) {
+				fprintf(stderr, "castty: Invalid keyframe interval: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'l':
 			audio_list_inputs();
 			exit(EXIT_SUCCESS);
 			break;
+		case 'M':
+			audio_adaptive_mp3();
+			break;
 		case 'm':
 			audio_toggle_mp3();
 			break;
+		case 'P':
+			oa.spill_dir = optarg;
+			break;
 		case 'p':
 			oa.start_paused = 1;
 			break;
 		case '2':
 			oa.format_version = 2;
 			break;
+		case 'Q':
+			errno = 0;
+			oa.queue_mb = strtol(optarg, &e, 10);
+			if (e == optarg || errno != 0 || oa.queue_mb < 1 ||
+			    oa.queue_mb > 1024) {
+				fprintf(stderr, "castty: Invalid queue size: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'r':
 			errno = 0;
 			oa.rows = strtol(optarg, &e, 10);
@@ -245,9 +402,35 @@ record_main(int argc, char **argv)
 		case 'R':
 			oa.use_raw = 1;
 			break;
+		case 'S':
+			errno = 0;
+			oa.sync_ms = strtol(optarg, &e, 10);
+			if (e == optarg || errno != 0 || oa.sync_ms <= 0 ||
+			    (*e && strcmp(e, "ms"))) {
+				fprintf(stderr, "castty: Invalid sync interval: %s\n",
+				    optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			oa.single = 1;
+			break;
 		case 't':
 			oa.title = escape(optarg);
 			break;
+		case 'u':
+			oa.use_uring = 0;
+			break;
+		case 'w':
+			broadcast = optarg;
+			break;
+		case 'z':
+			oa.use_zstd = 1;
+			break;
+		case 'Z':
+			oa.use_zstd = 1;
+			oa.zstd_dict = optarg;
+			break;
 		case 'h':
 		case '?':
 			usage(EXIT_SUCCESS);
@@ -262,12 +445,36 @@ record_main(int argc, char **argv)
 		oa.format_version = 1;
 	}
 
+	if (oa.use_zstd && oa.format_version != 2 && !oa.binary) {
+		fprintf(stderr, "Compressed output (-z) requires asciicast v2 (-2) "
+		    "or binary (-b) output.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (oa.fps && oa.coalesce_ms) {
+		fprintf(stderr, "Frames (-f) already merge output; -C can't be "
+		    "used with them.\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if ((oa.audioout == NULL && oa.devid != NULL) ||
 	    (oa.devid == NULL && oa.audioout != NULL)) {
 		fprintf(stderr, "If -d or -a are specified, both must appear.\n");
 		exit(EXIT_FAILURE);
 	}
 
+	if ((oa.audio_buf_s || oa.spill_dir) && oa.audioout == NULL) {
+		fprintf(stderr, "Audio buffering (-B, -P) needs audio to be "
+		    "recorded (-a, -d).\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (oa.max_idle_ms && oa.audioout != NULL) {
+		fprintf(stderr, "Audio sets the timing of the cast; -i can't be "
+		    "used with it. Use castty convert -i -a afterwards.\n");
+		exit(EXIT_FAILURE);
+	}
+
 	argc -= optind;
 	argv += optind;
 
@@ -277,7 +484,21 @@ record_main(int argc, char **argv)
 		oa.outfn = "events.cast";
 	}
 
-	if (pipe(controlfd) != 0) {
+	if (oa.keyframe_s && stat(oa.outfn, &st) == 0 && !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Keyframes (-K) index a cast file; they can't be "
+		    "used when streaming to a pipe or socket.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (broadcast != NULL) {
+		oa.broadcastfd = broadcast_listen(broadcast);
+	}
+
+	if (oa.single) {
+		/* Commands are run where they're read; epoll does the I/O */
+		controlfd[0] = controlfd[1] = -1;
+		oa.use_uring = 0;
+	} else if (pipe(controlfd) != 0) {
 		perror("pipe");
 		exit(EXIT_FAILURE);
 	}
@@ -311,13 +532,22 @@ record_main(int argc, char **argv)
 
 	set_raw_input();
 
+	shell = getenv("SHELL");
+	if (shell == NULL) {
+		shell = "/bin/sh";
+	}
+
 	child = fork();
 	if (child < 0) {
 		perror("fork");
 		exit(EXIT_FAILURE);
 	}
 
-	if (child == 0) {
+	if (child == 0 && oa.single) {
+		/* Only the shell runs apart */
+		shellproc(shell, exec_cmd, &win, masterfd);
+		exit(EXIT_FAILURE);
+	} else if (child == 0) {
 		pid_t subchild = fork();
 		if (subchild < 0) {
 			perror("fork");
@@ -333,13 +563,8 @@ record_main(int argc, char **argv)
 		if (subchild) {
 			/* Handle output to file in parent */
 			xclose(controlfd[1]);
-			outputproc(&oa);
+			exit(outputproc(&oa));
 		} else {
-			char *shell = getenv("SHELL");
-			if (shell == NULL) {
-				shell = "/bin/sh";
-			}
-
 			/* Shell process doesn't need these */
 			xclose(controlfd[0]);
 			xclose(controlfd[1]);
@@ -349,8 +574,13 @@ record_main(int argc, char **argv)
 		}
 	}
 
-	xclose(controlfd[0]);
-	inputproc(masterfd, controlfd[1]);
+	status = EXIT_SUCCESS;
+	if (oa.single) {
+		status = outputproc(&oa);
+	} else {
+		xclose(controlfd[0]);
+		inputproc(masterfd, controlfd[1], oa.use_uring);
+	}
 
 	signal(SIGWINCH, NULL);
 
@@ -360,5 +590,5 @@ record_main(int argc, char **argv)
 
 	xtcsetattr(STDIN_FILENO, TCSAFLUSH, &tt);
 
-	return 0;
+	return status;
 }
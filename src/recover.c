@@ -0,0 +1,242 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "asciicast.h"
+#include "bincast.h"
+#include "castty.h"
+#include "recover.h"
+
+/* Repair, in place, a cast that castty record never got to finish because
+ * it or the machine went down. What was written out lasts, up to a line
+ * cut off midway or blocks that never made it to disk (which read back as
+ * zeros); the header still has blank space where the duration goes, and a
+ * v1 cast is missing its closing brackets. Everything from the first line
+ * that isn't a whole event is cut off, the cast is closed, and the time of
+ * its last event is filled in as the duration.
+ */
+
+static void
+usage(int status)
+{
+
+	fprintf(stderr, "usage: castty recover [-hn] <cast>\n"
+	    " -h             Show this help.\n"
+	    " -n             Only say what would be done.\n"
+	    "\n"
+	    " <cast>         asciicast v1 or v2 cast written to a file by castty\n"
+	    "                record.\n");
+	exit(status);
+}
+
+/* Time of the event on the line from p to end (its newline), or -1 if the
+ * line isn't a whole event.
+ */
+static double
+event_time(const char *p, const char *end, int version)
+{
+	double t;
+	char *e;
+
+	if (memchr(p, '\0', end - p) != NULL) {
+		return -1;
+	}
+
+	if (version == 1 && p < end && *p == ',') {
+		p++;
+	}
+
+	if (end - p < 4 || p[0] != '[' || !isdigit((unsigned char)p[1]) ||
+	    end[-2] != '"' || end[-1] != ']') {
+		return -1;
+	}
+
+	/* Stops at the newline, if not before */
+	t = strtod(p + 1, &e);
+	if (e >= end || *e != ',') {
+		return -1;
+	}
+
+	return t;
+}
+
+static void
+put(int fd, const void *buf, size_t len, off_t off)
+{
+
+	if (pwrite(fd, buf, len, off) != (ssize_t)len) {
+		perror("pwrite");
+		exit(EXIT_FAILURE);
+	}
+}
+
+int
+recover_main(int argc, char **argv)
+{
+	char durbuf[ASCIICAST_HEADER_PAD + 1];
+	const char *path, *line, *end, *nl;
+	int ch, dry_run, fd, version, closed;
+	unsigned long long events;
+	double duration;
+	struct stat st;
+	size_t len, pad;
+	char *map, *hdr;
+	off_t keep;
+
+	dry_run = 0;
+
+	while ((ch = getopt(argc, argv, "?hn")) != EOF) {
+		switch (ch) {
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'h':
+		case '?':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		usage(EXIT_FAILURE);
+	}
+	path = argv[0];
+
+	fd = open(path, dry_run ? O_RDONLY : O_RDWR);
+	if (fd == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		fprintf(stderr, "castty: %s: Not a cast\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	len = st.st_size;
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	end = map + len;
+
+	if (len >= sizeof BINCAST_MAGIC - 1 &&
+	    memcmp(map, BINCAST_MAGIC, sizeof BINCAST_MAGIC - 1) == 0) {
+		fprintf(stderr, "castty: %s: Binary casts need no repair; castty "
+		    "convert reads them up to where they were cut off\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	nl = memchr(map, '\n', len);
+	if (map[0] != '{' || nl == NULL) {
+		fprintf(stderr, "castty: %s: Not a cast, or cut off in the "
+		    "header\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	hdr = malloc(nl - map + 1);
+	if (hdr == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(hdr, map, nl - map);
+	hdr[nl - map] = '\0';
+
+	/* castty record leaves room after the brace for the duration */
+	pad = strspn(hdr + 1, " ");
+	if (strncmp(hdr + 1 + pad, "\"duration\":", 11) == 0) {
+		printf("%s: Cast is complete\n", path);
+		exit(EXIT_SUCCESS);
+	} else if (pad < ASCIICAST_HEADER_PAD) {
+		fprintf(stderr, "castty: %s: Has no room for a duration; castty "
+		    "convert reads casts that were streamed\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (sscanf(hdr + 1 + pad, "\"version\": %d", &version) != 1 ||
+	    (version != 1 && version != 2)) {
+		fprintf(stderr, "castty: %s: Not an asciicast v1 or v2 cast\n",
+		    path);
+		exit(EXIT_FAILURE);
+	}
+	free(hdr);
+
+	/* v1 times are deltas, v2 times are from the start */
+	duration = 0;
+	events = 0;
+	closed = 0;
+	for (line = nl + 1; line < end; ) {
+		const char *eol = memchr(line, '\n', end - line);
+		double t;
+
+		if (eol == NULL) {
+			break;
+		}
+
+		if (version == 1 && eol - line == 2 &&
+		    memcmp(line, "]}", 2) == 0) {
+			closed = 1;
+			line = eol + 1;
+			break;
+		}
+
+		t = event_time(line, eol, version);
+		if (!(t >= 0)) {
+			break;
+		}
+
+		duration = (version == 1) ? duration + t : t;
+		events++;
+		line = eol + 1;
+	}
+	keep = line - map;
+
+	printf("%s: %llu events, %.4f seconds", path, events, duration);
+	if ((size_t)keep < len) {
+		printf("; %zu bytes cut off the end", len - keep);
+	}
+	printf("\n");
+
+	munmap(map, len);
+
+	if (dry_run) {
+		xclose(fd);
+		return EXIT_SUCCESS;
+	}
+
+	if (ftruncate(fd, keep) == -1) {
+		perror("ftruncate");
+		exit(EXIT_FAILURE);
+	}
+
+	if (version == 1 && !closed) {
+		put(fd, "]}\n", 3, keep);
+	}
+
+	snprintf(durbuf, sizeof durbuf, "\"duration\": %.9g,", duration);
+	put(fd, durbuf, strlen(durbuf), 1);
+
+	xfdatasync(fd);
+	xclose(fd);
+
+	return EXIT_SUCCESS;
+}
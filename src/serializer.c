@@ -0,0 +1,446 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "broadcast.h"
+#include "castty.h"
+#include "evwriter.h"
+#include "hist.h"
+#include "serializer.h"
+#include "spsc.h"
+
+/* The serializer turns timestamped pty output into cast events on its own
+ * thread, so that escaping and disk writes never hold up relaying output to
+ * the terminal. The relay only stamps and enqueues.
+ */
+
+enum {
+	/* A coalesced event is cut at this size even within its window */
+	PENDING_MAX = 1024 * 1024,
+};
+
+extern FILE *debug_out;
+
+static struct serializer_args args;
+static struct spsc *queue;
+static pthread_t sthread;
+static atomic_int done;
+
+/* Events the queue had no room for in the last recording, and their bytes */
+static uint64_t dropped, dropped_bytes;
+
+/* Output read within the coalescing window, not yet written as an event */
+static struct {
+	int active;
+	uint64_t at;
+	uint64_t deadline;
+
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+} pending;
+
+/* Screen-diff mode: the screen as recorded so far, and as it is now */
+static struct {
+	struct vt *shown;
+	struct vt *vt;
+	struct bytebuf diff;
+
+	int dirty;
+	uint64_t at;
+	uint64_t deadline;
+	uint64_t last;
+} frame;
+
+static uint64_t
+mono_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Put a keyframe in ahead of an event at time at, if one is due. */
+static void
+keyframe(uint64_t at)
+{
+	struct keyframes *kf = args.keyframes;
+
+	if (kf != NULL && keyframes_due(kf, at)) {
+		/* A keyframe's event starts a block, so it can be read
+		 * without what came before
+		 */
+		if (args.bin != NULL) {
+			bincast_flush(args.bin);
+		}
+		keyframes_write(kf, evwriter_offset(args.out));
+	}
+}
+
+static void
+write_event(const unsigned char *buf, size_t buflen, uint64_t at)
+{
+	struct keyframes *kf = args.keyframes;
+	uint64_t t;
+
+	t = hist_now();
+
+	if (args.bin != NULL) {
+		bincast_event(args.bin, at, buf, buflen);
+	} else {
+		asciicast_event(args.cast, at, buf, buflen);
+	}
+
+	if (kf != NULL) {
+		keyframes_event(kf, at, buf, buflen);
+	}
+
+	hist_record(&hist_serialize, hist_now() - t);
+}
+
+/* Write out the pending (coalesced) event, if any. */
+static void
+flush_pending(void)
+{
+
+	if (!pending.active) {
+		return;
+	}
+
+	keyframe(pending.at);
+	write_event(pending.buf, pending.len, pending.at);
+	pending.active = 0;
+	pending.len = 0;
+}
+
+/* Write out how the screen changed since the last frame, if it did. */
+static void
+flush_frame(void)
+{
+
+	if (!frame.dirty) {
+		return;
+	}
+
+	/* Keyframes share the screen as shown, so one goes in before the
+	 * diff moves it on
+	 */
+	keyframe(frame.at);
+
+	frame.diff.len = 0;
+	vt_diff(frame.shown, frame.vt, &frame.diff);
+	if (frame.diff.len > 0) {
+		write_event(frame.diff.buf, frame.diff.len, frame.at);
+	}
+
+	frame.dirty = 0;
+	frame.last = mono_us();
+}
+
+/* Output only changes the screen model; the first change after a quiet
+ * spell is recorded right away, later ones once a frame interval has
+ * passed since the last frame. Each frame carries the time of the latest
+ * output it shows.
+ */
+static void
+frame_output(const unsigned char *buf, size_t buflen, uint64_t at)
+{
+
+	vt_write(frame.vt, buf, buflen);
+	frame.at = at;
+
+	if (!frame.dirty) {
+		frame.dirty = 1;
+		frame.deadline = MAX(mono_us(), frame.last + 1000000 / args.fps);
+	}
+}
+
+/* Without a coalescing window every read is its own event; with one, reads
+ * stamped within the window of the first are merged into a single event
+ * carrying the time of the first.
+ */
+static void
+handle_output(const unsigned char *buf, size_t buflen, uint64_t at)
+{
+	uint64_t window = (uint64_t)args.coalesce_ms * 1000;
+
+	/* Live viewers get output as it comes, whatever is recorded */
+	broadcast_output(buf, buflen);
+
+	if (args.fps) {
+		frame_output(buf, buflen, at);
+		return;
+	}
+
+	if (window == 0) {
+		keyframe(at);
+		write_event(buf, buflen, at);
+		return;
+	}
+
+	if (pending.active && at >= pending.at + window) {
+		flush_pending();
+	}
+
+	if (!pending.active) {
+		pending.at = at;
+		pending.deadline = mono_us() + window;
+		pending.active = 1;
+	}
+
+	if (pending.len + buflen > pending.size) {
+		size_t ns = pending.size ? pending.size : BUFSIZ;
+		unsigned char *p;
+
+		while (ns < pending.len + buflen) {
+			ns *= 2;
+		}
+
+		p = realloc(pending.buf, ns);
+		if (p == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+
+		pending.buf = p;
+		pending.size = ns;
+	}
+
+	memcpy(&pending.buf[pending.len], buf, buflen);
+	pending.len += buflen;
+
+	if (pending.len >= PENDING_MAX) {
+		flush_pending();
+	}
+}
+
+/* Milliseconds until something is due, for poll(2). */
+static int
+next_timeout(void)
+{
+	int timeout;
+
+	timeout = evwriter_timeout(args.out);
+
+	if (pending.active || frame.dirty) {
+		uint64_t now = mono_us();
+		uint64_t deadline;
+		int t = 0;
+
+		deadline = pending.active ? pending.deadline : frame.deadline;
+		if (now < deadline) {
+			t = (deadline - now + 999) / 1000;
+		}
+
+		if (timeout == -1 || t < timeout) {
+			timeout = t;
+		}
+	}
+
+	return timeout;
+}
+
+/* The flush interval is up. A binary block being built counts as buffered
+ * output, so it is cut short and written too.
+ */
+static void
+handle_timer(void)
+{
+
+	if (args.bin != NULL) {
+		bincast_flush(args.bin);
+	}
+	evwriter_timer(args.out);
+}
+
+static void *
+serializer(void *priv)
+{
+	struct pollfd pollfds[2];
+	int nfds;
+
+	(void)priv;
+
+	pollfds[0].fd = queue->wakefd[0];
+	pollfds[0].events = POLLIN;
+
+	nfds = 1;
+	if (args.out->timerfd != -1) {
+		pollfds[1].fd = args.out->timerfd;
+		pollfds[1].events = POLLIN;
+		nfds++;
+	}
+
+	for (;;) {
+		struct spsc_rec *rec;
+
+		while ((rec = spsc_peek(queue)) != NULL) {
+			switch (rec->type) {
+			case SPSC_OUTPUT:
+				handle_output(spsc_data(rec), rec->len, rec->at);
+				break;
+			case SPSC_FLUSH:
+				flush_pending();
+				flush_frame();
+				if (args.bin != NULL) {
+					bincast_flush(args.bin);
+				}
+				evwriter_flush(args.out);
+				break;
+			default:
+				abort();
+			}
+
+			spsc_pop(queue, rec);
+		}
+
+		if (pending.active && mono_us() >= pending.deadline) {
+			flush_pending();
+		}
+
+		if (frame.dirty && mono_us() >= frame.deadline) {
+			flush_frame();
+		}
+
+		if (args.out->timerfd == -1 && evwriter_timeout(args.out) == 0) {
+			handle_timer();
+		}
+
+		if (atomic_load(&done)) {
+			if (spsc_peek(queue) == NULL) {
+				break;
+			}
+			continue;
+		}
+
+		if (!spsc_sleep(queue)) {
+			continue;
+		}
+
+		pollfds[0].revents = 0;
+		pollfds[1].revents = 0;
+		if (poll(pollfds, nfds, next_timeout()) == -1 && errno != EINTR) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+
+		spsc_woken(queue);
+
+		if (nfds > 1 && (pollfds[1].revents & POLLIN)) {
+			handle_timer();
+		}
+	}
+
+	flush_pending();
+	flush_frame();
+	if (args.bin != NULL) {
+		bincast_flush(args.bin);
+	}
+
+	return NULL;
+}
+
+void
+serializer_start(const struct serializer_args *sa)
+{
+	sigset_t all, old;
+	size_t size;
+
+	assert(sa->cast != NULL || sa->bin != NULL);
+
+	args = *sa;
+
+	if (args.fps) {
+		assert(args.coalesce_ms == 0);
+		frame.shown = vt_create(args.rows, args.cols);
+		frame.vt = vt_create(args.rows, args.cols);
+
+		/* The events are diffs of the screen as shown, so keyframes
+		 * can take it from there rather than model it again
+		 */
+		if (args.keyframes != NULL) {
+			keyframes_share(args.keyframes, frame.shown);
+		}
+	}
+
+	for (size = 4096; size < sa->queue_size; size *= 2)
+		;
+	queue = spsc_create(size);
+
+	/* Signals are for the relay thread to handle */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&sthread, NULL, serializer, NULL) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Relay side: queue output read from the pty at recording time at (us). */
+void
+serializer_output(uint64_t at, const void *buf, size_t len)
+{
+
+	spsc_push(queue, SPSC_OUTPUT, at, buf, len);
+}
+
+/* Relay side: write out everything queued so far, e.g. before pausing. */
+void
+serializer_flush(void)
+{
+
+	spsc_push(queue, SPSC_FLUSH, 0, NULL, 0);
+}
+
+/* What the last recording lost to a full queue, once it is stopped. */
+void
+serializer_dropped(uint64_t *events, uint64_t *bytes)
+{
+
+	*events = dropped;
+	*bytes = dropped_bytes;
+}
+
+void
+serializer_stop(void)
+{
+
+	atomic_store(&done, 1);
+	spsc_interrupt(queue);
+	pthread_join(sthread, NULL);
+
+	dropped = atomic_load(&queue->dropped);
+	dropped_bytes = atomic_load(&queue->dropped_bytes);
+	if (dropped) {
+		fprintf(stderr, "\r\ncastty: event queue overflowed; %llu events "
+		    "(%llu bytes) were not recorded\r\n",
+		    (unsigned long long)dropped,
+		    (unsigned long long)dropped_bytes);
+		if (debug_out) {
+			fprintf(debug_out, "event queue overflowed; %llu events "
+			    "(%llu bytes) were not recorded\n",
+			    (unsigned long long)dropped,
+			    (unsigned long long)dropped_bytes);
+		}
+	}
+
+	spsc_destroy(queue);
+	free(pending.buf);
+
+	if (args.fps) {
+		vt_destroy(frame.shown);
+		vt_destroy(frame.vt);
+		bytebuf_free(&frame.diff);
+	}
+}
@@ -81,16 +81,14 @@ handle_sigchld(int sig)
 	while ((pid = waitpid(-1, &status, WNOHANG)) > 0);
 }
 
-static void
-handle_sigwinch(int sig)
+/* Allow resizes, but only if they are smaller than our original window
+ * size. In any case, restore to the current window size.
+ */
+void
+resize_pty(void)
 {
 	unsigned short minrow, mincol;
 
-	(void)sig;
-
-	/* Allow resizes, but only if they are smaller than our original window
-	 * size. In any case, restore to the current window size.
-	 */
 	if (ioctl(STDIN_FILENO, TIOCGWINSZ, &rwin) == -1) {
 		perror("ioctl(TIOCGWINSZ)");
 		exit(EXIT_FAILURE);
@@ -110,8 +108,18 @@ handle_sigwinch(int sig)
 	}
 }
 
+static void
+handle_sigwinch(int sig)
+{
+
+	(void)sig;
+
+	resize_pty();
+}
+
+/* An alternate stack for the crash handler, which every thread needs. */
 void
-setup_sighandlers(void)
+altstack(void)
 {
 	stack_t ss;
 
@@ -123,6 +131,13 @@ setup_sighandlers(void)
 		exit(EXIT_FAILURE);
 	}
 	sigaltstack(&ss, 0);
+}
+
+void
+setup_sighandlers(void)
+{
+
+	altstack();
 
 	struct sigaction chld;
 	chld.sa_flags = 0;
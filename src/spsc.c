@@ -0,0 +1,199 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "castty.h"
+#include "spsc.h"
+
+#define REC_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct spsc *
+spsc_create(size_t size)
+{
+	struct spsc *q;
+
+	/* Power of two, so free-running counters can be masked */
+	assert(size >= 4096 && (size & (size - 1)) == 0);
+
+	q = calloc(1, sizeof *q);
+	if (q == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	q->buf = malloc(size);
+	if (q->buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	q->size = size;
+
+	if (pipe(q->wakefd) != 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		int f = fcntl(q->wakefd[i], F_GETFL);
+		fcntl(q->wakefd[i], F_SETFL, f | O_NONBLOCK);
+	}
+
+	return q;
+}
+
+void
+spsc_destroy(struct spsc *q)
+{
+
+	xclose(q->wakefd[0]);
+	xclose(q->wakefd[1]);
+	free(q->buf);
+	free(q);
+}
+
+/* Producer side. Returns 0 on success, -1 if the record was dropped. */
+int
+spsc_push(struct spsc *q, enum spsc_type type, uint64_t at, const void *data,
+    size_t len)
+{
+	struct spsc_rec *rec;
+	size_t head, tail, off, toend, need, pad;
+
+	head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	need = REC_ALIGN(sizeof *rec + len);
+	off = head & (q->size - 1);
+	toend = q->size - off;
+	pad = (toend < need) ? toend : 0;
+
+	if (need > q->size || pad + need > q->size - (head - tail)) {
+		atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&q->dropped_bytes, len,
+		    memory_order_relaxed);
+		return -1;
+	}
+
+	if (pad) {
+		/* Too little room for a header means an implicit skip */
+		if (toend >= sizeof *rec) {
+			rec = (struct spsc_rec *)&q->buf[off];
+			rec->type = SPSC_PAD;
+			rec->len = 0;
+		}
+		off = 0;
+	}
+
+	rec = (struct spsc_rec *)&q->buf[off];
+	rec->type = type;
+	rec->len = len;
+	rec->at = at;
+	if (len) {
+		memcpy(spsc_data(rec), data, len);
+	}
+
+	atomic_store_explicit(&q->head, head + pad + need, memory_order_seq_cst);
+	spsc_wakeup(q);
+
+	return 0;
+}
+
+/* Consumer side: the oldest record, or NULL if the ring is empty. */
+struct spsc_rec *
+spsc_peek(struct spsc *q)
+{
+	size_t head, tail;
+
+	tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	for (;;) {
+		struct spsc_rec *rec;
+		size_t off, toend;
+
+		head = atomic_load_explicit(&q->head, memory_order_acquire);
+		if (tail == head) {
+			return NULL;
+		}
+
+		off = tail & (q->size - 1);
+		toend = q->size - off;
+
+		rec = (struct spsc_rec *)&q->buf[off];
+		if (toend < sizeof *rec || rec->type == SPSC_PAD) {
+			tail += toend;
+			atomic_store_explicit(&q->tail, tail, memory_order_release);
+			continue;
+		}
+
+		return rec;
+	}
+}
+
+void
+spsc_pop(struct spsc *q, struct spsc_rec *rec)
+{
+	size_t tail;
+
+	tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	tail += REC_ALIGN(sizeof *rec + rec->len);
+	atomic_store_explicit(&q->tail, tail, memory_order_release);
+}
+
+/* Announce that the consumer is about to block on wakefd[0]. Returns 0 if
+ * records arrived in the meantime and it should not.
+ */
+int
+spsc_sleep(struct spsc *q)
+{
+
+	atomic_store_explicit(&q->waiting, 1, memory_order_seq_cst);
+
+	if (atomic_load_explicit(&q->head, memory_order_seq_cst) !=
+	    atomic_load_explicit(&q->tail, memory_order_relaxed)) {
+		atomic_store_explicit(&q->waiting, 0, memory_order_relaxed);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Wake the consumer, but only pay for the write if it is asleep. */
+void
+spsc_wakeup(struct spsc *q)
+{
+	static const char c = 0;
+
+	if (atomic_exchange_explicit(&q->waiting, 0, memory_order_seq_cst)) {
+		if (write(q->wakefd[1], &c, 1) == -1 && errno != EAGAIN) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* Wake the consumer unconditionally, e.g. to have it notice shutdown. */
+void
+spsc_interrupt(struct spsc *q)
+{
+	static const char c = 0;
+
+	if (write(q->wakefd[1], &c, 1) == -1 && errno != EAGAIN) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Consumer woke up; drain the wakeup descriptor. */
+void
+spsc_woken(struct spsc *q)
+{
+	char buf[64];
+
+	atomic_store_explicit(&q->waiting, 0, memory_order_relaxed);
+	while (read(q->wakefd[0], buf, sizeof buf) > 0)
+		;
+}
@@ -0,0 +1,394 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <liburing.h>
+
+#include "castty.h"
+#include "hist.h"
+#include "record.h"
+#include "uring.h"
+
+/* io_uring backend for the input and output processes. Reads, the writes
+ * they cause, and the read that follows are all pushed to the kernel in a
+ * single io_uring_submit_and_wait() call, instead of a poll, read and one
+ * or more writes per chunk. Output for the terminal is the exception: it
+ * goes through the same non-blocking relay as the poll(2) loop, so a slow
+ * or stopped terminal never holds up pty reads, and the ring only waits for
+ * the terminal to take more. If the kernel refuses to set up a ring (too
+ * old, or disabled by policy) the loops return -1 and the caller falls back
+ * to the poll(2) loop.
+ */
+
+enum {
+	URING_ENTRIES = 64,
+
+	/* pty output is read this much at a time */
+	URING_BUFSIZE = 64 * 1024,
+};
+
+enum op_kind {
+	OP_READ,
+	OP_WRITE,
+	OP_POLL,
+};
+
+struct op {
+	enum op_kind kind;
+	int fd;
+	int bufidx;
+	unsigned char *buf;
+	size_t len;
+	size_t off;
+	/* When the output being written was read, for hist_relay */
+	uint64_t at;
+	struct op *next;
+};
+
+/* Writes to a descriptor are issued one at a time so that the kernel
+ * can't reorder them.
+ */
+struct wqueue {
+	int fd;
+	struct op *head;
+	struct op *tail;
+};
+
+static struct io_uring ring;
+
+static int
+ring_init(void)
+{
+
+	if (io_uring_queue_init(URING_ENTRIES, &ring, 0) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+set_blocking(int fd)
+{
+	int f;
+
+	/* The ring does its own readiness handling; O_NONBLOCK would only
+	 * turn reads into -EAGAIN completions.
+	 */
+	f = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, f & ~O_NONBLOCK);
+}
+
+static struct io_uring_sqe *
+get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (sqe == NULL) {
+		/* Submission queue full; hand it to the kernel and retry */
+		io_uring_submit(&ring);
+		sqe = io_uring_get_sqe(&ring);
+		if (sqe == NULL) {
+			fprintf(stderr, "io_uring: out of submission entries\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return sqe;
+}
+
+static void
+submit_read(struct op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	io_uring_prep_read(sqe, op->fd, op->buf, op->len, -1);
+	io_uring_sqe_set_data(sqe, op);
+}
+
+static void
+submit_write(struct op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	io_uring_prep_write(sqe, op->fd, op->buf + op->off, op->len - op->off, -1);
+	io_uring_sqe_set_data(sqe, op);
+}
+
+static void
+submit_poll(struct op *op, unsigned mask)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	io_uring_prep_poll_add(sqe, op->fd, mask);
+	io_uring_sqe_set_data(sqe, op);
+}
+
+static void
+wqueue_push(struct wqueue *q, struct op *op)
+{
+
+	op->next = NULL;
+	op->off = 0;
+
+	if (q->tail) {
+		q->tail->next = op;
+		q->tail = op;
+		return;
+	}
+
+	q->head = q->tail = op;
+	submit_write(op);
+}
+
+/* Completion for the write at the head of q. Returns the op once all of it
+ * has been written, or NULL if the rest was resubmitted.
+ */
+static struct op *
+wqueue_done(struct wqueue *q, struct op *op, int res)
+{
+
+	if (res == -EINTR || res == -EAGAIN) {
+		submit_write(op);
+		return NULL;
+	} else if (res < 0) {
+		errno = -res;
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+
+	op->off += res;
+	if (op->off < op->len) {
+		submit_write(op);
+		return NULL;
+	}
+
+	q->head = op->next;
+	if (q->head == NULL) {
+		q->tail = NULL;
+	} else {
+		submit_write(q->head);
+	}
+
+	return op;
+}
+
+static int
+wait_cqes(void)
+{
+	int err;
+
+	while ((err = io_uring_submit_and_wait(&ring, 1)) < 0) {
+		if (err != -EINTR) {
+			errno = -err;
+			perror("io_uring_submit_and_wait");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static struct wqueue masterq, controlq;
+
+static void
+queue_write(int fd, void *buf, size_t len)
+{
+	struct op *op;
+
+	op = malloc(sizeof *op + len);
+	if (op == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	op->kind = OP_WRITE;
+	op->fd = fd;
+	op->bufidx = -1;
+	op->buf = (unsigned char *)(op + 1);
+	op->len = len;
+	memcpy(op->buf, buf, len);
+
+	wqueue_push(fd == masterq.fd ? &masterq : &controlq, op);
+}
+
+int
+uring_inputloop(int masterfd, int controlfd)
+{
+	static unsigned char ibuf[BUFSIZ];
+	struct io_uring_cqe *cqe;
+	struct op rd;
+	int eof;
+
+	if (ring_init() != 0) {
+		return -1;
+	}
+
+	memset(&masterq, 0, sizeof masterq);
+	memset(&controlq, 0, sizeof controlq);
+	masterq.fd = masterfd;
+	controlq.fd = controlfd;
+
+	memset(&rd, 0, sizeof rd);
+	rd.kind = OP_READ;
+	rd.fd = STDIN_FILENO;
+	rd.buf = ibuf;
+	rd.len = sizeof ibuf;
+	submit_read(&rd);
+
+	/* After EOF on stdin, keep going until queued writes are done */
+	eof = 0;
+	while (!eof || masterq.head || controlq.head) {
+		if (wait_cqes() != 0) {
+			break;
+		}
+
+		while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+			struct op *op = io_uring_cqe_get_data(cqe);
+			int res = cqe->res;
+
+			io_uring_cqe_seen(&ring, cqe);
+
+			if (op == &rd) {
+				if (res == -EINTR || res == -EAGAIN) {
+					submit_read(&rd);
+				} else if (res <= 0) {
+					eof = 1;
+				} else {
+					input_process(ibuf, res, masterfd, controlfd,
+					    queue_write);
+					submit_read(&rd);
+				}
+			} else {
+				struct wqueue *q;
+
+				q = (op->fd == masterfd) ? &masterq : &controlq;
+				if ((op = wqueue_done(q, op, res)) != NULL) {
+					free(op);
+				}
+			}
+		}
+	}
+
+	io_uring_queue_exit(&ring);
+
+	return 0;
+}
+
+int
+uring_outputloop(struct outargs *oa)
+{
+	static unsigned char buf[URING_BUFSIZE];
+	struct op rd, ctl, tpoll;
+	enum control_command cmd;
+	struct io_uring_cqe *cqe;
+	int polling, status;
+
+	if (ring_init() != 0) {
+		return -1;
+	}
+
+	set_blocking(oa->masterfd);
+	set_blocking(oa->controlfd);
+
+	memset(&rd, 0, sizeof rd);
+	rd.kind = OP_READ;
+	rd.fd = oa->masterfd;
+	rd.buf = buf;
+	rd.len = sizeof buf;
+	submit_read(&rd);
+
+	memset(&ctl, 0, sizeof ctl);
+	ctl.kind = OP_READ;
+	ctl.fd = oa->controlfd;
+	ctl.bufidx = -1;
+	ctl.buf = (unsigned char *)&cmd;
+	ctl.len = sizeof cmd;
+	submit_read(&ctl);
+
+	memset(&tpoll, 0, sizeof tpoll);
+	tpoll.kind = OP_POLL;
+	tpoll.fd = term_fd();
+	polling = 0;
+
+	status = EXIT_SUCCESS;
+	for (;;) {
+		if (wait_cqes() != 0) {
+			status = EXIT_FAILURE;
+			break;
+		}
+
+		while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+			struct op *op = io_uring_cqe_get_data(cqe);
+			int res = cqe->res;
+			uint64_t t;
+
+			io_uring_cqe_seen(&ring, cqe);
+
+			if (op == &ctl) {
+				if (res != sizeof cmd) {
+					fprintf(stderr, "read: control pipe closed\n");
+					status = EXIT_FAILURE;
+					goto end;
+				}
+
+				relay_command(cmd);
+				submit_read(&ctl);
+			} else if (op == &tpoll) {
+				polling = 0;
+				if (res < 0 && res != -EINTR) {
+					errno = -res;
+					perror("poll");
+					status = EXIT_FAILURE;
+					goto end;
+				} else if (res > 0 &&
+				    (res & (POLLHUP | POLLERR | POLLNVAL))) {
+					status = EXIT_FAILURE;
+					goto end;
+				} else if (term_flush() == -1) {
+					status = EXIT_FAILURE;
+					goto end;
+				}
+			} else {
+				if (res == -EINTR || res == -EAGAIN) {
+					submit_read(&rd);
+					continue;
+				} else if (res <= 0) {
+					/* Shell went away */
+					status = EXIT_FAILURE;
+					goto end;
+				}
+
+				/* Stamped now, however long the terminal takes */
+				t = hist_now();
+				relay_output(buf, res);
+				if (term_write(buf, res, t) == -1) {
+					status = EXIT_FAILURE;
+					goto end;
+				}
+				hist_record(&hist_read, res);
+				submit_read(&rd);
+			}
+		}
+
+		/* Only wait on the terminal while output is waiting for it */
+		if (!polling && term_waiting()) {
+			submit_poll(&tpoll, POLLOUT);
+			polling = 1;
+		}
+	}
+
+end:
+	/* What is still waiting for the terminal is written on the way out */
+	io_uring_queue_exit(&ring);
+
+	return status;
+}
@@ -0,0 +1,1694 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "castty.h"
+#include "utf8.h"
+#include "vt.h"
+
+enum {
+	ST_GROUND,
+	ST_ESC,
+	ST_ESC_INTER,
+	ST_CSI,
+	ST_CSI_IGNORE,
+	ST_OSC,
+	ST_STRING,
+	ST_STRING_ESC,
+};
+
+struct range {
+	uint32_t lo;
+	uint32_t hi;
+};
+
+/* Zero-width: combining marks and format characters */
+static const struct range zero_width[] = {
+	{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd },
+	{ 0x05bf, 0x05bf }, { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 },
+	{ 0x05c7, 0x05c7 }, { 0x0610, 0x061a }, { 0x064b, 0x065f },
+	{ 0x0670, 0x0670 }, { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+	{ 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0900, 0x0902 },
+	{ 0x093a, 0x093a }, { 0x093c, 0x093c }, { 0x0941, 0x0948 },
+	{ 0x094d, 0x094d }, { 0x0951, 0x0957 }, { 0x0e31, 0x0e31 },
+	{ 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e }, { 0x1ab0, 0x1aff },
+	{ 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x202a, 0x202e },
+	{ 0x2060, 0x2064 }, { 0x20d0, 0x20ff }, { 0xfe00, 0xfe0f },
+	{ 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }, { 0xe0100, 0xe01ef },
+};
+
+/* Double-width: East Asian Wide/Fullwidth and emoji presentation */
+static const struct range double_width[] = {
+	{ 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a },
+	{ 0x23e9, 0x23ec }, { 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 },
+	{ 0x25fd, 0x25fe }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 },
+	{ 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+	{ 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 },
+	{ 0x26ce, 0x26ce }, { 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea },
+	{ 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 }, { 0x26fa, 0x26fa },
+	{ 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+	{ 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e },
+	{ 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+	{ 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf }, { 0x2b1b, 0x2b1c },
+	{ 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }, { 0x2e80, 0x303e },
+	{ 0x3041, 0x33ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff },
+	{ 0xa000, 0xa4cf }, { 0xa960, 0xa97f }, { 0xac00, 0xd7a3 },
+	{ 0xf900, 0xfaff }, { 0xfe10, 0xfe19 }, { 0xfe30, 0xfe6f },
+	{ 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x16fe0, 0x16fe4 },
+	{ 0x17000, 0x18cff }, { 0x1b000, 0x1b2ff }, { 0x1f004, 0x1f004 },
+	{ 0x1f0cf, 0x1f0cf }, { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a },
+	{ 0x1f200, 0x1f251 }, { 0x1f300, 0x1f320 }, { 0x1f32d, 0x1f335 },
+	{ 0x1f337, 0x1f37c }, { 0x1f37e, 0x1f393 }, { 0x1f3a0, 0x1f3ca },
+	{ 0x1f3cf, 0x1f3d3 }, { 0x1f3e0, 0x1f3f0 }, { 0x1f3f4, 0x1f3f4 },
+	{ 0x1f3f8, 0x1f43e }, { 0x1f440, 0x1f440 }, { 0x1f442, 0x1f4fc },
+	{ 0x1f4ff, 0x1f53d }, { 0x1f54b, 0x1f54e }, { 0x1f550, 0x1f567 },
+	{ 0x1f57a, 0x1f57a }, { 0x1f595, 0x1f596 }, { 0x1f5a4, 0x1f5a4 },
+	{ 0x1f5fb, 0x1f64f }, { 0x1f680, 0x1f6c5 }, { 0x1f6cc, 0x1f6cc },
+	{ 0x1f6d0, 0x1f6d2 }, { 0x1f6d5, 0x1f6d7 }, { 0x1f6eb, 0x1f6ec },
+	{ 0x1f6f4, 0x1f6fc }, { 0x1f7e0, 0x1f7eb }, { 0x1f90c, 0x1f93a },
+	{ 0x1f93c, 0x1f945 }, { 0x1f947, 0x1f9ff }, { 0x1fa70, 0x1faff },
+	{ 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+
+/* DEC special graphics for 0x5f..0x7e */
+static const uint32_t dec_graphics[] = {
+	0x00a0, 0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0,
+	0x00b1, 0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c,
+	0x23ba, 0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534,
+	0x252c, 0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7,
+};
+
+static int
+in_ranges(uint32_t c, const struct range *r, size_t n)
+{
+	size_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (c < r[mid].lo) {
+			hi = mid;
+		} else if (c > r[mid].hi) {
+			lo = mid + 1;
+		} else {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+char_width(uint32_t c)
+{
+
+	if (c < 0x300) {
+		return 1;
+	}
+
+	if (in_ranges(c, zero_width, sizeof zero_width / sizeof *zero_width)) {
+		return 0;
+	}
+
+	if (in_ranges(c, double_width,
+	    sizeof double_width / sizeof *double_width)) {
+		return 2;
+	}
+
+	return 1;
+}
+
+static struct vt_cell *
+row(struct vt *vt, int y)
+{
+
+	return vt->screen[y];
+}
+
+/* What erasing leaves behind: a blank in the current background */
+static struct vt_cell
+blank(const struct vt *vt)
+{
+	struct vt_cell c;
+
+	c.ch = ' ';
+	c.fg = VT_COLOR_DEFAULT;
+	c.bg = vt->pen.bg;
+	c.attr = 0;
+
+	return c;
+}
+
+static void
+clear_cells(struct vt *vt, struct vt_cell *c, int n)
+{
+	struct vt_cell b = blank(vt);
+
+	for (int i = 0; i < n; i++) {
+		c[i] = b;
+	}
+}
+
+static void
+clear_lines(struct vt *vt, struct vt_cell **l, int n)
+{
+
+	for (int y = 0; y < n; y++) {
+		clear_cells(vt, l[y], vt->cols);
+	}
+}
+
+/* Rotate n lines up by k, the top k coming round to the bottom */
+static void
+rotate(struct vt_cell **l, int n, int k)
+{
+	struct vt_cell *t;
+
+	for (int a = 0, b = k - 1; a < b; a++, b--) {
+		t = l[a], l[a] = l[b], l[b] = t;
+	}
+	for (int a = k, b = n - 1; a < b; a++, b--) {
+		t = l[a], l[a] = l[b], l[b] = t;
+	}
+	for (int a = 0, b = n - 1; a < b; a++, b--) {
+		t = l[a], l[a] = l[b], l[b] = t;
+	}
+}
+
+/* Erase [x0, x1) of line y */
+static void
+erase(struct vt *vt, int y, int x0, int x1)
+{
+	struct vt_cell *r = row(vt, y);
+
+	if (x0 >= x1) {
+		return;
+	}
+
+	/* Don't leave half of a wide character behind */
+	if (x0 > 0 && (r[x0].attr & VT_WIDE_CONT)) {
+		x0--;
+	}
+	if (x1 < vt->cols && (r[x1].attr & VT_WIDE_CONT)) {
+		x1++;
+	}
+
+	clear_cells(vt, &r[x0], x1 - x0);
+}
+
+/* Blank halves of wide characters that shifting a line split off */
+static void
+fix_wide(struct vt *vt, int y)
+{
+	struct vt_cell *r = row(vt, y);
+
+	for (int x = 0; x < vt->cols; x++) {
+		if ((r[x].attr & VT_WIDE_CONT) &&
+		    (x == 0 || !(r[x - 1].attr & VT_WIDE))) {
+			r[x] = blank(vt);
+		} else if ((r[x].attr & VT_WIDE) &&
+		    (x == vt->cols - 1 || !(r[x + 1].attr & VT_WIDE_CONT))) {
+			r[x] = blank(vt);
+		}
+	}
+}
+
+static void
+scroll_up(struct vt *vt, int top, int bottom, int n)
+{
+	int lines = bottom - top + 1;
+
+	if (n > lines) {
+		n = lines;
+	}
+
+	rotate(&vt->screen[top], lines, n);
+	clear_lines(vt, &vt->screen[bottom - n + 1], n);
+}
+
+static void
+scroll_down(struct vt *vt, int top, int bottom, int n)
+{
+	int lines = bottom - top + 1;
+
+	if (n > lines) {
+		n = lines;
+	}
+
+	rotate(&vt->screen[top], lines, lines - n);
+	clear_lines(vt, &vt->screen[top], n);
+}
+
+static void
+linefeed(struct vt *vt)
+{
+
+	if (vt->y == vt->bottom) {
+		scroll_up(vt, vt->top, vt->bottom, 1);
+	} else if (vt->y < vt->rows - 1) {
+		vt->y++;
+	}
+}
+
+static void
+reverse_index(struct vt *vt)
+{
+
+	if (vt->y == vt->top) {
+		scroll_down(vt, vt->top, vt->bottom, 1);
+	} else if (vt->y > 0) {
+		vt->y--;
+	}
+}
+
+static void
+move_to(struct vt *vt, int x, int y)
+{
+	int miny = 0, maxy = vt->rows - 1;
+
+	if (vt->modes & VT_MODE_ORIGIN) {
+		miny = vt->top;
+		maxy = vt->bottom;
+	}
+
+	vt->x = MAX(0, MIN(x, vt->cols - 1));
+	vt->y = MAX(miny, MIN(y, maxy));
+	vt->wrapnext = 0;
+}
+
+/* CUP and friends, which count from the top of the scroll region in
+ * origin mode
+ */
+static void
+move_abs(struct vt *vt, int x, int y)
+{
+
+	if (vt->modes & VT_MODE_ORIGIN) {
+		y += vt->top;
+	}
+
+	move_to(vt, x, y);
+}
+
+static void
+tab(struct vt *vt, int n)
+{
+
+	while (n-- > 0 && vt->x < vt->cols - 1) {
+		do {
+			vt->x++;
+		} while (vt->x < vt->cols - 1 && !vt->tabs[vt->x]);
+	}
+}
+
+static void
+backtab(struct vt *vt, int n)
+{
+
+	while (n-- > 0 && vt->x > 0) {
+		do {
+			vt->x--;
+		} while (vt->x > 0 && !vt->tabs[vt->x]);
+	}
+}
+
+static void
+reset_tabs(struct vt *vt)
+{
+
+	for (int i = 0; i < vt->cols; i++) {
+		vt->tabs[i] = (i % 8 == 0);
+	}
+}
+
+static void
+save_cursor(struct vt *vt)
+{
+	struct vt_cursor *s = &vt->saved[vt->altscreen];
+
+	s->x = vt->x;
+	s->y = vt->y;
+	s->pen = vt->pen;
+	s->origin = !!(vt->modes & VT_MODE_ORIGIN);
+	s->graphics[0] = vt->graphics[0];
+	s->graphics[1] = vt->graphics[1];
+	s->shift = vt->shift;
+}
+
+static void
+restore_cursor(struct vt *vt)
+{
+	struct vt_cursor *s = &vt->saved[vt->altscreen];
+
+	vt->pen = s->pen;
+	vt->graphics[0] = s->graphics[0];
+	vt->graphics[1] = s->graphics[1];
+	vt->shift = s->shift;
+	if (s->origin) {
+		vt->modes |= VT_MODE_ORIGIN;
+	} else {
+		vt->modes &= ~VT_MODE_ORIGIN;
+	}
+
+	move_to(vt, s->x, s->y);
+}
+
+static void
+reset(struct vt *vt)
+{
+
+	memset(&vt->pen, 0, sizeof vt->pen);
+	vt->pen.ch = ' ';
+
+	vt->screen = vt->main;
+	vt->altscreen = 0;
+	clear_lines(vt, vt->main, vt->rows);
+	clear_lines(vt, vt->alt, vt->rows);
+
+	vt->x = vt->y = 0;
+	vt->wrapnext = 0;
+	vt->top = 0;
+	vt->bottom = vt->rows - 1;
+	vt->modes = VT_MODE_AUTOWRAP;
+	vt->graphics[0] = vt->graphics[1] = 0;
+	vt->shift = 0;
+	reset_tabs(vt);
+
+	memset(vt->saved, 0, sizeof vt->saved);
+	vt->saved[0].pen = vt->saved[1].pen = vt->pen;
+}
+
+struct vt *
+vt_create(int rows, int cols)
+{
+	struct vt *vt;
+
+	vt = calloc(1, sizeof *vt);
+	if (vt == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	vt->rows = MAX(rows, 1);
+	vt->cols = MAX(cols, 1);
+
+	vt->main = calloc(2 * (size_t)vt->rows, sizeof *vt->main);
+	vt->cells = calloc(2 * (size_t)vt->rows * vt->cols, sizeof *vt->cells);
+	vt->tabs = calloc(vt->cols, 1);
+	if (vt->main == NULL || vt->cells == NULL || vt->tabs == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	vt->alt = &vt->main[vt->rows];
+	for (int y = 0; y < 2 * vt->rows; y++) {
+		vt->main[y] = &vt->cells[y * vt->cols];
+	}
+
+	reset(vt);
+
+	return vt;
+}
+
+void
+vt_destroy(struct vt *vt)
+{
+
+	free(vt->main);
+	free(vt->cells);
+	free(vt->tabs);
+	free(vt);
+}
+
+static void
+put_char(struct vt *vt, uint32_t ch)
+{
+	struct vt_cell *r, *c;
+	int w;
+
+	if (ch >= 0x5f && ch <= 0x7e && vt->graphics[vt->shift]) {
+		ch = dec_graphics[ch - 0x5f];
+	}
+
+	w = char_width(ch);
+	if (w == 0) {
+		return;
+	}
+
+	/* A wide character can't fit a one-column screen at all. Narrowed,
+	 * it keeps x + w <= cols below, which bounds every access to the row.
+	 */
+	if (w > vt->cols) {
+		w = 1;
+	}
+
+	if (vt->wrapnext) {
+		vt->x = 0;
+		linefeed(vt);
+		vt->wrapnext = 0;
+	}
+
+	if (w == 2 && vt->x == vt->cols - 1) {
+		if (!(vt->modes & VT_MODE_AUTOWRAP)) {
+			return;
+		}
+		erase(vt, vt->y, vt->x, vt->cols);
+		vt->x = 0;
+		linefeed(vt);
+	}
+
+	r = row(vt, vt->y);
+	if (vt->modes & VT_MODE_INSERT) {
+		memmove(&r[vt->x + w], &r[vt->x],
+		    (size_t)(vt->cols - vt->x - w) * sizeof *r);
+		clear_cells(vt, &r[vt->x], w);
+		fix_wide(vt, vt->y);
+	}
+
+	/* Overwriting either half of a wide character blanks the other */
+	c = &r[vt->x];
+	if ((c->attr & VT_WIDE_CONT) && vt->x > 0) {
+		c[-1] = blank(vt);
+	}
+	if ((c[w - 1].attr & VT_WIDE) && vt->x + w < vt->cols) {
+		c[w] = blank(vt);
+	}
+
+	*c = vt->pen;
+	c->ch = ch;
+	c->attr &= ~(VT_WIDE | VT_WIDE_CONT);
+	if (w == 2) {
+		c->attr |= VT_WIDE;
+		c[1] = *c;
+		c[1].ch = 0;
+		c[1].attr = (c->attr & ~VT_WIDE) | VT_WIDE_CONT;
+	}
+	vt->lastch = ch;
+
+	if (vt->x + w >= vt->cols) {
+		vt->x = vt->cols - 1;
+		vt->wrapnext = !!(vt->modes & VT_MODE_AUTOWRAP);
+	} else {
+		vt->x += w;
+	}
+}
+
+static int
+printable(unsigned char c)
+{
+
+	return c >= 0x20 && c < 0x7f;
+}
+
+/* Print the run of printable ASCII at the start of buf as put_char() would,
+ * a line at a time, and return its length. Only for G0/G1 as plain ASCII
+ * and replace mode.
+ */
+static size_t
+put_ascii(struct vt *vt, const unsigned char *buf, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len && printable(buf[i])) {
+		struct vt_cell *r, cell;
+		int x, n;
+
+		if (vt->wrapnext) {
+			vt->x = 0;
+			linefeed(vt);
+			vt->wrapnext = 0;
+		}
+
+		x = vt->x;
+		n = 0;
+		while (x + n < vt->cols && i + n < len && printable(buf[i + n])) {
+			n++;
+		}
+
+		/* Only the wide characters at either end can be split */
+		r = row(vt, vt->y);
+		if ((r[x].attr & VT_WIDE_CONT) && x > 0) {
+			r[x - 1] = blank(vt);
+		}
+		if ((r[x + n - 1].attr & VT_WIDE) && x + n < vt->cols) {
+			r[x + n] = blank(vt);
+		}
+
+		cell = vt->pen;
+		cell.attr &= ~(VT_WIDE | VT_WIDE_CONT);
+		for (int k = 0; k < n; k++) {
+			r[x + k] = cell;
+			r[x + k].ch = buf[i + k];
+		}
+		vt->lastch = buf[i + n - 1];
+		i += n;
+
+		if (x + n >= vt->cols) {
+			vt->x = vt->cols - 1;
+			vt->wrapnext = !!(vt->modes & VT_MODE_AUTOWRAP);
+		} else {
+			vt->x = x + n;
+		}
+	}
+
+	return i;
+}
+
+static int
+param(const struct vt *vt, int i, int def)
+{
+
+	if (i >= vt->nparams || vt->params[i] == 0) {
+		return def;
+	}
+
+	return vt->params[i];
+}
+
+/* Extended color after 38/48/58; returns how many parameters it used */
+static int
+sgr_color(const struct vt *vt, int i, uint32_t *color)
+{
+
+	if (i + 1 < vt->nparams && vt->params[i + 1] == 5 && i + 2 < vt->nparams) {
+		*color = VT_COLOR_INDEX | (vt->params[i + 2] & 0xff);
+		return 2;
+	}
+
+	if (i + 1 < vt->nparams && vt->params[i + 1] == 2 && i + 4 < vt->nparams) {
+		*color = VT_COLOR_RGB | (vt->params[i + 2] & 0xff) << 16 |
+		    (vt->params[i + 3] & 0xff) << 8 | (vt->params[i + 4] & 0xff);
+		return 4;
+	}
+
+	return vt->nparams - i - 1;
+}
+
+static void
+sgr(struct vt *vt)
+{
+	struct vt_cell *p = &vt->pen;
+	uint32_t unused;
+
+	if (vt->nparams == 0) {
+		vt->nparams = 1;
+		vt->params[0] = 0;
+	}
+
+	for (int i = 0; i < vt->nparams; i++) {
+		int n = vt->params[i];
+
+		switch (n) {
+		case 0:
+			p->fg = p->bg = VT_COLOR_DEFAULT;
+			p->attr = 0;
+			break;
+		case 1: p->attr |= VT_BOLD; break;
+		case 2: p->attr |= VT_DIM; break;
+		case 3: p->attr |= VT_ITALIC; break;
+		case 4: p->attr |= VT_UNDERLINE; break;
+		case 5: case 6: p->attr |= VT_BLINK; break;
+		case 7: p->attr |= VT_REVERSE; break;
+		case 8: p->attr |= VT_INVISIBLE; break;
+		case 9: p->attr |= VT_STRIKE; break;
+		case 21: p->attr |= VT_UNDERLINE; break;
+		case 22: p->attr &= ~(VT_BOLD | VT_DIM); break;
+		case 23: p->attr &= ~VT_ITALIC; break;
+		case 24: p->attr &= ~VT_UNDERLINE; break;
+		case 25: p->attr &= ~VT_BLINK; break;
+		case 27: p->attr &= ~VT_REVERSE; break;
+		case 28: p->attr &= ~VT_INVISIBLE; break;
+		case 29: p->attr &= ~VT_STRIKE; break;
+		case 38: i += sgr_color(vt, i, &p->fg); break;
+		case 39: p->fg = VT_COLOR_DEFAULT; break;
+		case 48: i += sgr_color(vt, i, &p->bg); break;
+		case 49: p->bg = VT_COLOR_DEFAULT; break;
+		case 58: i += sgr_color(vt, i, &unused); break;
+		default:
+			if (n >= 30 && n <= 37) {
+				p->fg = VT_COLOR_INDEX | (n - 30);
+			} else if (n >= 40 && n <= 47) {
+				p->bg = VT_COLOR_INDEX | (n - 40);
+			} else if (n >= 90 && n <= 97) {
+				p->fg = VT_COLOR_INDEX | (n - 90 + 8);
+			} else if (n >= 100 && n <= 107) {
+				p->bg = VT_COLOR_INDEX | (n - 100 + 8);
+			}
+			break;
+		}
+	}
+}
+
+static void
+set_altscreen(struct vt *vt, int on, int clear)
+{
+
+	if (on == vt->altscreen) {
+		return;
+	}
+
+	vt->altscreen = on;
+	vt->screen = on ? vt->alt : vt->main;
+	if (on && clear) {
+		clear_lines(vt, vt->alt, vt->rows);
+	}
+	vt->wrapnext = 0;
+}
+
+static void
+set_flag(struct vt *vt, unsigned flag, int on)
+{
+
+	if (on) {
+		vt->modes |= flag;
+	} else {
+		vt->modes &= ~flag;
+	}
+}
+
+static void
+set_mode(struct vt *vt, int on)
+{
+
+	if (vt->private != 0 && vt->private != '?') {
+		return;
+	}
+
+	for (int i = 0; i < vt->nparams; i++) {
+		if (vt->private == 0) {
+			if (vt->params[i] == 4) {
+				set_flag(vt, VT_MODE_INSERT, on);
+			}
+			continue;
+		}
+
+		switch (vt->params[i]) {
+		case 1:
+			set_flag(vt, VT_MODE_APPCURSOR, on);
+			break;
+		case 5:
+			set_flag(vt, VT_MODE_REVERSE, on);
+			break;
+		case 6:
+			set_flag(vt, VT_MODE_ORIGIN, on);
+			move_abs(vt, 0, 0);
+			break;
+		case 7:
+			set_flag(vt, VT_MODE_AUTOWRAP, on);
+			break;
+		case 25:
+			set_flag(vt, VT_MODE_HIDECURSOR, !on);
+			break;
+		case 47:
+		case 1047:
+			set_altscreen(vt, on, vt->params[i] == 1047);
+			break;
+		case 1048:
+			if (on) {
+				save_cursor(vt);
+			} else {
+				restore_cursor(vt);
+			}
+			break;
+		case 1049:
+			if (on) {
+				save_cursor(vt);
+				set_altscreen(vt, 1, 1);
+			} else {
+				set_altscreen(vt, 0, 0);
+				restore_cursor(vt);
+			}
+			break;
+		case 2004:
+			set_flag(vt, VT_MODE_BRACKETPASTE, on);
+			break;
+		}
+	}
+}
+
+static void
+csi(struct vt *vt, unsigned char final)
+{
+	struct vt_cell *r;
+	int n = param(vt, 0, 1);
+
+	if (vt->private && final != 'h' && final != 'l') {
+		/* DA, DSR and such ask the terminal, not the screen */
+		return;
+	}
+
+	if (vt->intermediate) {
+		return;
+	}
+
+	switch (final) {
+	case '@':
+		r = row(vt, vt->y);
+		n = MIN(n, vt->cols - vt->x);
+		memmove(&r[vt->x + n], &r[vt->x],
+		    (size_t)(vt->cols - vt->x - n) * sizeof *r);
+		clear_cells(vt, &r[vt->x], n);
+		fix_wide(vt, vt->y);
+		vt->wrapnext = 0;
+		break;
+	case 'A':
+		move_to(vt, vt->x, MAX(vt->y - n, vt->y >= vt->top ? vt->top : 0));
+		break;
+	case 'B':
+	case 'e':
+		move_to(vt, vt->x,
+		    MIN(vt->y + n, vt->y <= vt->bottom ? vt->bottom : vt->rows - 1));
+		break;
+	case 'C':
+	case 'a':
+		move_to(vt, vt->x + n, vt->y);
+		break;
+	case 'D':
+		move_to(vt, vt->x - n, vt->y);
+		break;
+	case 'E':
+		move_to(vt, 0,
+		    MIN(vt->y + n, vt->y <= vt->bottom ? vt->bottom : vt->rows - 1));
+		break;
+	case 'F':
+		move_to(vt, 0, MAX(vt->y - n, vt->y >= vt->top ? vt->top : 0));
+		break;
+	case 'G':
+	case '`':
+		move_to(vt, n - 1, vt->y);
+		break;
+	case 'H':
+	case 'f':
+		move_abs(vt, param(vt, 1, 1) - 1, n - 1);
+		break;
+	case 'I':
+		tab(vt, n);
+		vt->wrapnext = 0;
+		break;
+	case 'J':
+		switch (param(vt, 0, 0)) {
+		case 0:
+			erase(vt, vt->y, vt->x, vt->cols);
+			for (int y = vt->y + 1; y < vt->rows; y++) {
+				erase(vt, y, 0, vt->cols);
+			}
+			break;
+		case 1:
+			for (int y = 0; y < vt->y; y++) {
+				erase(vt, y, 0, vt->cols);
+			}
+			erase(vt, vt->y, 0, vt->x + 1);
+			break;
+		case 2:
+			clear_lines(vt, vt->screen, vt->rows);
+			break;
+		}
+		vt->wrapnext = 0;
+		break;
+	case 'K':
+		switch (param(vt, 0, 0)) {
+		case 0: erase(vt, vt->y, vt->x, vt->cols); break;
+		case 1: erase(vt, vt->y, 0, vt->x + 1); break;
+		case 2: erase(vt, vt->y, 0, vt->cols); break;
+		}
+		vt->wrapnext = 0;
+		break;
+	case 'L':
+		if (vt->y >= vt->top && vt->y <= vt->bottom) {
+			scroll_down(vt, vt->y, vt->bottom, n);
+			vt->x = 0;
+			vt->wrapnext = 0;
+		}
+		break;
+	case 'M':
+		if (vt->y >= vt->top && vt->y <= vt->bottom) {
+			scroll_up(vt, vt->y, vt->bottom, n);
+			vt->x = 0;
+			vt->wrapnext = 0;
+		}
+		break;
+	case 'P':
+		r = row(vt, vt->y);
+		n = MIN(n, vt->cols - vt->x);
+		memmove(&r[vt->x], &r[vt->x + n],
+		    (size_t)(vt->cols - vt->x - n) * sizeof *r);
+		clear_cells(vt, &r[vt->cols - n], n);
+		fix_wide(vt, vt->y);
+		vt->wrapnext = 0;
+		break;
+	case 'S':
+		scroll_up(vt, vt->top, vt->bottom, n);
+		break;
+	case 'T':
+		if (vt->nparams <= 1) {
+			scroll_down(vt, vt->top, vt->bottom, n);
+		}
+		break;
+	case 'X':
+		erase(vt, vt->y, vt->x, MIN(vt->x + n, vt->cols));
+		vt->wrapnext = 0;
+		break;
+	case 'Z':
+		backtab(vt, n);
+		vt->wrapnext = 0;
+		break;
+	case 'b':
+		if (vt->lastch) {
+			for (int i = 0; i < MIN(n, vt->rows * vt->cols); i++) {
+				put_char(vt, vt->lastch);
+			}
+		}
+		break;
+	case 'd':
+		move_abs(vt, vt->x, n - 1);
+		break;
+	case 'g':
+		if (param(vt, 0, 0) == 0) {
+			vt->tabs[vt->x] = 0;
+		} else if (param(vt, 0, 0) == 3) {
+			memset(vt->tabs, 0, vt->cols);
+		}
+		break;
+	case 'h':
+		set_mode(vt, 1);
+		break;
+	case 'l':
+		set_mode(vt, 0);
+		break;
+	case 'm':
+		sgr(vt);
+		break;
+	case 'r': {
+		int top = param(vt, 0, 1) - 1;
+		int bottom = param(vt, 1, vt->rows) - 1;
+
+		bottom = MIN(bottom, vt->rows - 1);
+		if (top < bottom) {
+			vt->top = top;
+			vt->bottom = bottom;
+			move_abs(vt, 0, 0);
+		}
+		break;
+	}
+	case 's':
+		save_cursor(vt);
+		break;
+	case 'u':
+		restore_cursor(vt);
+		break;
+	}
+}
+
+static void
+esc(struct vt *vt, unsigned char final)
+{
+
+	if (vt->intermediate == '(' || vt->intermediate == ')') {
+		vt->graphics[vt->intermediate == ')'] = (final == '0');
+		return;
+	}
+
+	if (vt->intermediate == '#') {
+		if (final == '8') {
+			/* DECALN */
+			for (int y = 0; y < vt->rows; y++) {
+				struct vt_cell *r = row(vt, y);
+
+				for (int x = 0; x < vt->cols; x++) {
+					r[x] = blank(vt);
+					r[x].ch = 'E';
+				}
+			}
+			move_to(vt, 0, 0);
+		}
+		return;
+	}
+
+	if (vt->intermediate) {
+		return;
+	}
+
+	switch (final) {
+	case '7':
+		save_cursor(vt);
+		break;
+	case '8':
+		restore_cursor(vt);
+		break;
+	case 'D':
+		linefeed(vt);
+		vt->wrapnext = 0;
+		break;
+	case 'E':
+		vt->x = 0;
+		linefeed(vt);
+		vt->wrapnext = 0;
+		break;
+	case 'H':
+		vt->tabs[vt->x] = 1;
+		break;
+	case 'M':
+		reverse_index(vt);
+		vt->wrapnext = 0;
+		break;
+	case 'c':
+		reset(vt);
+		break;
+	case '=':
+		vt->modes |= VT_MODE_APPKEYPAD;
+		break;
+	case '>':
+		vt->modes &= ~VT_MODE_APPKEYPAD;
+		break;
+	}
+}
+
+static void
+control(struct vt *vt, unsigned char c)
+{
+
+	switch (c) {
+	case '\b':
+		if (vt->x > 0) {
+			vt->x--;
+		}
+		vt->wrapnext = 0;
+		break;
+	case '\t':
+		tab(vt, 1);
+		vt->wrapnext = 0;
+		break;
+	case '\n':
+	case '\v':
+	case '\f':
+		linefeed(vt);
+		vt->wrapnext = 0;
+		break;
+	case '\r':
+		vt->x = 0;
+		vt->wrapnext = 0;
+		break;
+	case 0x0e:
+		vt->shift = 1;
+		break;
+	case 0x0f:
+		vt->shift = 0;
+		break;
+	}
+}
+
+static void
+start_sequence(struct vt *vt, int state)
+{
+
+	vt->state = state;
+	vt->nparams = 0;
+	vt->private = 0;
+	vt->intermediate = 0;
+	memset(vt->params, 0, sizeof vt->params);
+}
+
+static void
+feed(struct vt *vt, unsigned char c)
+{
+
+	/* These interrupt any sequence */
+	if (c == 0x18 || c == 0x1a) {
+		vt->state = ST_GROUND;
+		return;
+	} else if (c == 0x1b) {
+		if (vt->state == ST_STRING || vt->state == ST_OSC) {
+			vt->state = ST_STRING_ESC;
+		} else {
+			start_sequence(vt, ST_ESC);
+		}
+		return;
+	}
+
+	switch (vt->state) {
+	case ST_GROUND:
+		if (c < 0x20 || c == 0x7f) {
+			control(vt, c);
+		} else {
+			put_char(vt, c);
+		}
+		break;
+
+	case ST_ESC:
+		if (c < 0x20) {
+			control(vt, c);
+		} else if (c >= 0x20 && c <= 0x2f) {
+			vt->intermediate = c;
+			vt->state = ST_ESC_INTER;
+		} else if (c == '[') {
+			start_sequence(vt, ST_CSI);
+		} else if (c == ']') {
+			vt->state = ST_OSC;
+		} else if (c == 'P' || c == 'X' || c == '^' || c == '_') {
+			vt->state = ST_STRING;
+		} else {
+			esc(vt, c);
+			vt->state = ST_GROUND;
+		}
+		break;
+
+	case ST_ESC_INTER:
+		if (c < 0x20) {
+			control(vt, c);
+		} else if (c >= 0x30) {
+			esc(vt, c);
+			vt->state = ST_GROUND;
+		}
+		break;
+
+	case ST_CSI:
+	case ST_CSI_IGNORE:
+		if (c < 0x20) {
+			control(vt, c);
+		} else if (c >= 0x40 && c <= 0x7e) {
+			if (vt->state == ST_CSI) {
+				if (vt->nparams < VT_MAXPARAMS) {
+					vt->nparams++;
+				}
+				csi(vt, c);
+			}
+			vt->state = ST_GROUND;
+		} else if (c >= '0' && c <= '9') {
+			int *p = &vt->params[MIN(vt->nparams, VT_MAXPARAMS - 1)];
+
+			if (*p < 100000) {
+				*p = *p * 10 + (c - '0');
+			}
+		} else if (c == ';' || c == ':') {
+			if (vt->nparams < VT_MAXPARAMS - 1) {
+				vt->nparams++;
+			}
+		} else if (c >= '<' && c <= '?') {
+			vt->private = c;
+		} else if (c >= 0x20 && c <= 0x2f) {
+			vt->intermediate = c;
+		} else {
+			vt->state = ST_CSI_IGNORE;
+		}
+		break;
+
+	case ST_OSC:
+		if (c == 0x07) {
+			vt->state = ST_GROUND;
+		}
+		break;
+
+	case ST_STRING:
+		break;
+
+	case ST_STRING_ESC:
+		/* ESC \ ends the string; anything else starts a new sequence */
+		if (c == '\\') {
+			vt->state = ST_GROUND;
+		} else {
+			start_sequence(vt, ST_ESC);
+			feed(vt, c);
+		}
+		break;
+	}
+}
+
+void
+vt_write(struct vt *vt, const unsigned char *buf, size_t len)
+{
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+		uint32_t prev = vt->utf8state;
+
+		if (vt->state == ST_GROUND && prev == UTF8_ACCEPT &&
+		    printable(c) && !vt->graphics[vt->shift] &&
+		    !(vt->modes & VT_MODE_INSERT)) {
+			i += put_ascii(vt, &buf[i], len - i) - 1;
+			continue;
+		}
+
+		if (vt->state != ST_GROUND || c < 0x80) {
+			if (vt->utf8state != UTF8_ACCEPT) {
+				/* Sequence cut short */
+				vt->utf8state = UTF8_ACCEPT;
+				put_char(vt, 0xfffd);
+			}
+			feed(vt, c);
+			continue;
+		}
+
+		switch (u8_decode(&vt->utf8state, &vt->codep, c)) {
+		case UTF8_ACCEPT:
+			/* C1 controls aren't printable */
+			if (vt->codep >= 0xa0) {
+				put_char(vt, vt->codep);
+			}
+			break;
+		case UTF8_REJECT:
+			vt->utf8state = UTF8_ACCEPT;
+			put_char(vt, 0xfffd);
+
+			/* A lead byte cutting a sequence short starts its own */
+			if (prev != UTF8_ACCEPT && (c & 0xc0) != 0x80) {
+				i--;
+			}
+			break;
+		}
+	}
+}
+
+static void
+put_utf8(struct bytebuf *out, uint32_t c)
+{
+
+	if (c < 0x80) {
+		bytebuf_putc(out, c);
+	} else if (c < 0x800) {
+		bytebuf_putc(out, 0xc0 | c >> 6);
+		bytebuf_putc(out, 0x80 | (c & 0x3f));
+	} else if (c < 0x10000) {
+		bytebuf_putc(out, 0xe0 | c >> 12);
+		bytebuf_putc(out, 0x80 | (c >> 6 & 0x3f));
+		bytebuf_putc(out, 0x80 | (c & 0x3f));
+	} else {
+		bytebuf_putc(out, 0xf0 | c >> 18);
+		bytebuf_putc(out, 0x80 | (c >> 12 & 0x3f));
+		bytebuf_putc(out, 0x80 | (c >> 6 & 0x3f));
+		bytebuf_putc(out, 0x80 | (c & 0x3f));
+	}
+}
+
+static void
+put_color(struct bytebuf *out, uint32_t color, int base)
+{
+
+	switch (VT_COLOR_TYPE(color)) {
+	case VT_COLOR_DEFAULT:
+		bytebuf_printf(out, ";%d", base + 9);
+		break;
+	case VT_COLOR_INDEX:
+		color &= 0xff;
+		if (color < 8) {
+			bytebuf_printf(out, ";%d", base + color);
+		} else if (color < 16) {
+			bytebuf_printf(out, ";%d", base + 60 + color - 8);
+		} else {
+			bytebuf_printf(out, ";%d;5;%d", base + 8, color);
+		}
+		break;
+	case VT_COLOR_RGB:
+		bytebuf_printf(out, ";%d;2;%d;%d;%d", base + 8, color >> 16 & 0xff,
+		    color >> 8 & 0xff, color & 0xff);
+		break;
+	}
+}
+
+/* SGR that sets exactly the attributes and colors of c */
+static void
+put_sgr(struct bytebuf *out, const struct vt_cell *c)
+{
+	static const struct {
+		uint32_t attr;
+		int sgr;
+	} attrs[] = {
+		{ VT_BOLD, 1 }, { VT_DIM, 2 }, { VT_ITALIC, 3 },
+		{ VT_UNDERLINE, 4 }, { VT_BLINK, 5 }, { VT_REVERSE, 7 },
+		{ VT_INVISIBLE, 8 }, { VT_STRIKE, 9 },
+	};
+
+	bytebuf_printf(out, "\x1b[0");
+	for (size_t i = 0; i < sizeof attrs / sizeof *attrs; i++) {
+		if (c->attr & attrs[i].attr) {
+			bytebuf_printf(out, ";%d", attrs[i].sgr);
+		}
+	}
+	if (c->fg != VT_COLOR_DEFAULT) {
+		put_color(out, c->fg, 30);
+	}
+	if (c->bg != VT_COLOR_DEFAULT) {
+		put_color(out, c->bg, 40);
+	}
+	bytebuf_putc(out, 'm');
+}
+
+static int
+same_sgr(const struct vt_cell *a, const struct vt_cell *b)
+{
+	uint32_t mask = ~(uint32_t)(VT_WIDE | VT_WIDE_CONT);
+
+	return a->fg == b->fg && a->bg == b->bg &&
+	    (a->attr & mask) == (b->attr & mask);
+}
+
+static int
+is_blank(const struct vt_cell *c)
+{
+
+	return c->ch == ' ' && c->fg == VT_COLOR_DEFAULT &&
+	    c->bg == VT_COLOR_DEFAULT && c->attr == 0;
+}
+
+/* Paint a whole screen, skipping blank runs at the end of each line. pen
+ * is the SGR state of the terminal, updated as it changes.
+ */
+static void
+paint(const struct vt *vt, struct vt_cell *const *lines, struct bytebuf *out,
+    struct vt_cell *pen)
+{
+
+	for (int y = 0; y < vt->rows; y++) {
+		const struct vt_cell *r = lines[y];
+		int end = vt->cols;
+
+		while (end > 0 && is_blank(&r[end - 1])) {
+			end--;
+		}
+		if (end == 0) {
+			continue;
+		}
+
+		bytebuf_printf(out, "\x1b[%d;1H", y + 1);
+		for (int x = 0; x < end; x++) {
+			if (r[x].attr & VT_WIDE_CONT) {
+				continue;
+			}
+
+			if (!same_sgr(&r[x], pen)) {
+				put_sgr(out, &r[x]);
+				*pen = r[x];
+			}
+			put_utf8(out, r[x].ch ? r[x].ch : ' ');
+		}
+	}
+}
+
+static int
+same_cursor(const struct vt_cursor *a, const struct vt_cursor *b)
+{
+
+	return a->x == b->x && a->y == b->y && same_sgr(&a->pen, &b->pen) &&
+	    a->origin == b->origin && a->graphics[0] == b->graphics[0] &&
+	    a->graphics[1] == b->graphics[1] && a->shift == b->shift;
+}
+
+/* Set up what DECSC saves as s, with no scroll region set */
+static void
+put_saved(struct bytebuf *out, const struct vt_cursor *s)
+{
+
+	put_sgr(out, &s->pen);
+	bytebuf_printf(out, "%s\x1b[%d;%dH%s%s%s",
+	    s->origin ? "\x1b[?6h" : "", s->y + 1, s->x + 1,
+	    s->graphics[0] ? "\x1b(0" : "",
+	    s->graphics[1] ? "\x1b)0" : "",
+	    s->shift ? "\x0e" : "");
+}
+
+/* Bring a terminal whose contents already match vt up to vt's DECSC state,
+ * scroll region, cursor, modes and pen. The terminal is known to have the
+ * saved cursor saved (NULL if unknown), the given modes and region, pen as
+ * its SGR state, G0 and G1 as ASCII shifted in, and origin mode off. moved
+ * says whether its cursor may be anywhere.
+ */
+static void
+restore(const struct vt *vt, struct bytebuf *out, struct vt_cell *pen,
+    const struct vt_cursor *saved, unsigned modes, int top, int bottom,
+    int moved)
+{
+	static const struct {
+		unsigned mode;
+		const char *set;
+		const char *reset;
+	} modetab[] = {
+		{ VT_MODE_INSERT, "\x1b[4h", "\x1b[4l" },
+		{ VT_MODE_APPCURSOR, "\x1b[?1h", "\x1b[?1l" },
+		{ VT_MODE_REVERSE, "\x1b[?5h", "\x1b[?5l" },
+		{ VT_MODE_AUTOWRAP, "\x1b[?7h", "\x1b[?7l" },
+		{ VT_MODE_APPKEYPAD, "\x1b=", "\x1b>" },
+		{ VT_MODE_BRACKETPASTE, "\x1b[?2004h", "\x1b[?2004l" },
+		{ VT_MODE_HIDECURSOR, "\x1b[?25l", "\x1b[?25h" },
+	};
+	const struct vt_cursor *s;
+	int y;
+
+	/* DECSC state for the active screen. The saved position may lie
+	 * outside the region in origin mode, so it's set up without one.
+	 */
+	s = &vt->saved[vt->altscreen];
+	if (saved == NULL || !same_cursor(saved, s)) {
+		if (top != 0 || bottom != vt->rows - 1) {
+			bytebuf_printf(out, "\x1b[r");
+			top = 0;
+			bottom = vt->rows - 1;
+		}
+		put_saved(out, s);
+		bytebuf_printf(out, "\x1b" "7");
+		bytebuf_printf(out, "\x1b[?6l\x1b(B\x1b)B\x0f");
+		*pen = s->pen;
+		moved = 1;
+	}
+
+	/* Setting the region homes the cursor */
+	if (vt->top != top || vt->bottom != bottom) {
+		if (vt->top == 0 && vt->bottom == vt->rows - 1) {
+			bytebuf_printf(out, "\x1b[r");
+		} else {
+			bytebuf_printf(out, "\x1b[%d;%dr", vt->top + 1,
+			    vt->bottom + 1);
+		}
+		moved = 1;
+	}
+
+	/* Cursor next: a pending wrap is recreated by rewriting the last
+	 * character of the line
+	 */
+	y = vt->y;
+	if (vt->modes & VT_MODE_ORIGIN) {
+		bytebuf_printf(out, "\x1b[?6h");
+		y -= vt->top;
+		moved = 1;
+	}
+
+	if (vt->wrapnext) {
+		const struct vt_cell *c = &vt->screen[vt->y][vt->x];
+		int x = vt->x;
+
+		if ((c->attr & VT_WIDE_CONT) && x > 0) {
+			c--;
+			x--;
+		}
+		if (!same_sgr(pen, c)) {
+			put_sgr(out, c);
+			*pen = *c;
+		}
+		bytebuf_printf(out, "\x1b[%d;%dH", y + 1, x + 1);
+		put_utf8(out, c->ch ? c->ch : ' ');
+	} else if (moved) {
+		bytebuf_printf(out, "\x1b[%d;%dH", y + 1, vt->x + 1);
+	}
+
+	/* Then modes, which would get in the way of the above (insert) */
+	for (size_t i = 0; i < sizeof modetab / sizeof *modetab; i++) {
+		unsigned m = modetab[i].mode;
+
+		if ((vt->modes & m) != (modes & m)) {
+			bytebuf_printf(out, "%s",
+			    (vt->modes & m) ? modetab[i].set : modetab[i].reset);
+		}
+	}
+
+	if (!same_sgr(pen, &vt->pen)) {
+		put_sgr(out, &vt->pen);
+		*pen = vt->pen;
+	}
+	bytebuf_printf(out, "%s%s%s",
+	    vt->graphics[0] ? "\x1b(0" : "",
+	    vt->graphics[1] ? "\x1b)0" : "",
+	    vt->shift ? "\x0e" : "");
+}
+
+/* Escape sequences that reproduce the state of vt on a terminal of the
+ * same size that was just reset.
+ */
+void
+vt_repaint(const struct vt *vt, struct bytebuf *out)
+{
+	struct vt_cell pen;
+
+	memset(&pen, 0, sizeof pen);
+	bytebuf_printf(out, "\x1b[0m\x1b[H\x1b[2J");
+
+	paint(vt, vt->main, out, &pen);
+	if (vt->altscreen) {
+		/* Saves the main screen's cursor; set it up first */
+		put_saved(out, &vt->saved[0]);
+		bytebuf_printf(out, "\x1b[?1049h\x1b[?6l\x1b(B\x1b)B\x0f");
+
+		/* which cleared it in the saved colors */
+		memset(&pen, 0, sizeof pen);
+		bytebuf_printf(out, "\x1b[0m\x1b[2J");
+		paint(vt, vt->alt, out, &pen);
+	}
+
+	restore(vt, out, &pen, NULL, VT_MODE_AUTOWRAP, 0, vt->rows - 1, 1);
+}
+
+/* Make dst a copy of src, which must be the same size. */
+static void
+copy(struct vt *dst, const struct vt *src)
+{
+	struct vt_cell **main = dst->main, **alt = dst->alt;
+	struct vt_cell *cells = dst->cells;
+	unsigned char *tabs = dst->tabs;
+	size_t n = 2 * (size_t)src->rows * src->cols;
+
+	*dst = *src;
+	dst->main = main;
+	dst->alt = alt;
+	dst->cells = cells;
+	dst->tabs = tabs;
+	dst->screen = src->altscreen ? alt : main;
+
+	/* The same cells, lined up the same way */
+	memcpy(cells, src->cells, n * sizeof *cells);
+	for (int y = 0; y < 2 * src->rows; y++) {
+		main[y] = &cells[src->main[y] - src->cells];
+	}
+	memcpy(tabs, src->tabs, src->cols);
+}
+
+static uint64_t
+row_hash(const struct vt_cell *r, int cols)
+{
+	const unsigned char *p = (const unsigned char *)r;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	/* FNV-1a */
+	for (size_t i = 0; i < (size_t)cols * sizeof *r; i++) {
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/* How far the active screen of vt looks scrolled up from that of shown:
+ * the shift that lines up the most rows, if that's more than already line
+ * up as they are.
+ */
+static int
+find_scroll(const struct vt *shown, const struct vt *vt)
+{
+	uint64_t *oh, *nh;
+	int best, bestn;
+
+	oh = malloc(2 * (size_t)vt->rows * sizeof *oh);
+	if (oh == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	nh = &oh[vt->rows];
+
+	for (int y = 0; y < vt->rows; y++) {
+		oh[y] = row_hash(shown->screen[y], vt->cols);
+		nh[y] = row_hash(vt->screen[y], vt->cols);
+	}
+
+	best = 0;
+	bestn = 0;
+	for (int y = 0; y < vt->rows; y++) {
+		bestn += (oh[y] == nh[y]);
+	}
+
+	for (int k = 1; k < vt->rows - bestn; k++) {
+		int n = 0;
+
+		/* Only shifts that carry the new top line are candidates */
+		if (oh[k] != nh[0]) {
+			continue;
+		}
+
+		for (int y = 0; y + k < vt->rows; y++) {
+			n += (oh[y + k] == nh[y]);
+		}
+
+		if (n > bestn + 1) {
+			best = k;
+			bestn = n;
+		}
+	}
+
+	free(oh);
+
+	return best;
+}
+
+/* Move the cursor from (*cx, *cy) to (x, y). Either is -1 if unknown, and
+ * *cx is also -1 past the last column. A line feed is cheaper for the start
+ * of the next line, as long as it won't scroll.
+ */
+static void
+move_cursor(struct bytebuf *out, int *cx, int *cy, int x, int y, int bottom)
+{
+
+	if (*cx == x && *cy == y) {
+		return;
+	}
+
+	if (x == 0 && *cy >= 0 && *cy == y - 1 && *cy != bottom) {
+		bytebuf_printf(out, "\r\n");
+	} else if (x == 0) {
+		bytebuf_printf(out, "\x1b[%dH", y + 1);
+	} else {
+		bytebuf_printf(out, "\x1b[%d;%dH", y + 1, x + 1);
+	}
+
+	*cx = x;
+	*cy = y;
+}
+
+/* Escape sequences that take a terminal showing shown to showing vt (of
+ * the same size), leaving shown a copy of vt. Only changed cells are
+ * written, using scrolling and line erasure where it helps. Switching
+ * between the main and alternate screens resets and repaints.
+ */
+void
+vt_diff(struct vt *shown, const struct vt *vt, struct bytebuf *out)
+{
+	struct vt_cell pen, plain;
+	unsigned modes;
+	int top, bottom, moved, k, cx, cy;
+
+	assert(shown->rows == vt->rows && shown->cols == vt->cols);
+
+	memset(&plain, 0, sizeof plain);
+	plain.ch = ' ';
+
+	if (shown->altscreen != vt->altscreen) {
+		bytebuf_printf(out, "\x1b" "c");
+		vt_repaint(vt, out);
+		copy(shown, vt);
+		return;
+	}
+
+	pen = shown->pen;
+	modes = shown->modes;
+	top = shown->top;
+	bottom = shown->bottom;
+	moved = 0;
+
+	/* Cells are drawn by absolute position, overwriting, in ASCII */
+	if (modes & VT_MODE_INSERT) {
+		bytebuf_printf(out, "\x1b[4l");
+	}
+	if (modes & VT_MODE_ORIGIN) {
+		bytebuf_printf(out, "\x1b[?6l");
+		moved = 1;
+	}
+	if (!(modes & VT_MODE_AUTOWRAP)) {
+		bytebuf_printf(out, "\x1b[?7h");
+	}
+	if (shown->graphics[0] || shown->graphics[1] || shown->shift) {
+		bytebuf_printf(out, "\x1b(B\x1b)B\x0f");
+	}
+	modes = (modes & ~(VT_MODE_INSERT | VT_MODE_ORIGIN)) | VT_MODE_AUTOWRAP;
+	cx = cy = -1;
+
+	k = find_scroll(shown, vt);
+	if (k > 0) {
+		if (top != 0 || bottom != vt->rows - 1) {
+			bytebuf_printf(out, "\x1b[r");
+			top = 0;
+			bottom = vt->rows - 1;
+		}
+
+		/* New lines come in blank, in the default colors */
+		if (!same_sgr(&pen, &plain)) {
+			bytebuf_printf(out, "\x1b[0m");
+			pen = plain;
+		}
+		shown->pen = plain;
+
+		bytebuf_printf(out, "\x1b[%dS", k);
+		scroll_up(shown, 0, vt->rows - 1, k);
+		moved = 1;
+	}
+
+	for (int y = 0; y < vt->rows; y++) {
+		const struct vt_cell *o = shown->screen[y];
+		const struct vt_cell *n = vt->screen[y];
+		int end, x;
+
+		if (memcmp(o, n, vt->cols * sizeof *n) == 0) {
+			continue;
+		}
+
+		/* Blanks at the end of the line are erased, not drawn */
+		end = vt->cols;
+		while (end > 0 && is_blank(&n[end - 1])) {
+			end--;
+		}
+
+		x = 0;
+		while (x < end) {
+			int start, gap;
+
+			if (memcmp(&o[x], &n[x], sizeof *n) == 0) {
+				x++;
+				continue;
+			}
+
+			start = x;
+			if ((n[start].attr & VT_WIDE_CONT) && start > 0) {
+				start--;
+			}
+			move_cursor(out, &cx, &cy, start, y, bottom);
+			moved = 1;
+
+			/* Draw through short runs of unchanged cells rather
+			 * than moving past them
+			 */
+			for (x = start, gap = 0; x < end && gap < 8; x++) {
+				gap = (memcmp(&o[x], &n[x], sizeof *n) == 0) ?
+				    gap + 1 : 0;
+
+				if (n[x].attr & VT_WIDE_CONT) {
+					continue;
+				}
+				if (!same_sgr(&pen, &n[x])) {
+					put_sgr(out, &n[x]);
+					pen = n[x];
+				}
+				put_utf8(out, n[x].ch ? n[x].ch : ' ');
+			}
+
+			/* Past the last column, a wrap is pending */
+			cx = (x < vt->cols) ? x : -1;
+		}
+
+		for (x = end; x < vt->cols; x++) {
+			if (memcmp(&o[x], &n[x], sizeof *n) != 0) {
+				break;
+			}
+		}
+		if (x < vt->cols) {
+			if (!same_sgr(&pen, &plain)) {
+				bytebuf_printf(out, "\x1b[0m");
+				pen = plain;
+			}
+			move_cursor(out, &cx, &cy, end, y, bottom);
+			bytebuf_printf(out, "\x1b[K");
+			moved = 1;
+		}
+	}
+
+	if (vt->x != shown->x || vt->y != shown->y ||
+	    vt->wrapnext != shown->wrapnext) {
+		moved = 1;
+	}
+
+	restore(vt, out, &pen, &shown->saved[vt->altscreen], modes, top, bottom,
+	    moved);
+	copy(shown, vt);
+}
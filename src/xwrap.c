@@ -1,5 +1,6 @@
 #include <sys/ioctl.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -41,6 +42,28 @@ xfclose(FILE *f)
 	}
 }
 
+/* Get data written to fd onto disk. macOS has no fdatasync(2), and fsync(2)
+ * does the job there.
+ */
+void
+xfdatasync(int fd)
+{
+	int r;
+
+	do {
+#ifdef __APPLE__
+		r = fsync(fd);
+#else
+		r = fdatasync(fd);
+#endif
+	} while (r == -1 && errno == EINTR);
+
+	if (r == -1) {
+		perror("fdatasync");
+		exit(EXIT_FAILURE);
+	}
+}
+
 FILE *
 xfopen(const char *f, const char *m)
 {
@@ -97,3 +120,24 @@ xwrite(int fd, void *buf, size_t size)
 
 	return s;
 }
+
+/* Like xwrite, but retries until all of buf is written. */
+void
+xwrite_all(int fd, const void *buf, size_t size)
+{
+	const unsigned char *p = buf;
+
+	while (size > 0) {
+		ssize_t s = write(fd, p, size);
+		if (s == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+
+		p += s;
+		size -= s;
+	}
+}
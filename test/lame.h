@@ -0,0 +1,21 @@
+#ifndef TEST_LAME_H
+#define TEST_LAME_H
+
+/* Frames of silence the stand-in for LAME starts each stream with */
+#define FAKE_DELAY	576
+
+#define FAKE_MAX_STREAMS	64
+
+/* Each stream, as it was closed: the quality it was encoded at, the frames
+ * it took in and the frames it gave out
+ */
+struct fake_stream {
+	int quality;
+	long frames;
+	long out;
+};
+
+extern struct fake_stream fake_streams[FAKE_MAX_STREAMS];
+extern int fake_nstreams;
+
+#endif /* TEST_LAME_H */
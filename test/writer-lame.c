@@ -0,0 +1,197 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "castty.h"
+#include "audio/writer-lame.h"
+
+#include "lame.h"
+
+/* Records through the adaptive mp3 writer against the stand-in for LAME,
+ * with a backlog that has it step down and then back up, and checks that
+ * every frame handed over comes out in order, that what the encoders added
+ * is what the recorder was told of, and that each change falls in a quiet
+ * moment.
+ */
+
+enum {
+	RATE = 44100,
+	FRAMESIZE = 1152,
+
+	/* Frames the writer encodes at a time */
+	BLOCK = 8 * FRAMESIZE,
+
+	/* Seconds recorded with the ring looking full, then empty */
+	BUSY_S = 6,
+	IDLE_S = 70,
+
+	/* Every PERIOD frames starts with QUIET_FRAMES of near silence */
+	PERIOD = RATE / 2,
+	QUIET_FRAMES = 4000,
+	QUIET = 512,
+};
+
+FILE *debug_out;
+
+static atomic_int ring_pct;
+static _Atomic uint64_t added_frames;
+
+void
+altstack(void)
+{
+
+}
+
+static int
+backlog(void)
+{
+
+	return atomic_load(&ring_pct);
+}
+
+static void
+added(int nframes)
+{
+
+	atomic_fetch_add(&added_frames, nframes);
+}
+
+static const struct lame_adapt adapt = { backlog, added };
+
+/* The left channel of frame i; the right is its negative. Each is told
+ * apart from its neighbours, and from the silence the encoder adds.
+ */
+static short
+sample(long i)
+{
+
+	if (i % PERIOD < QUIET_FRAMES) {
+		return i * 37 % 1001 - 500;
+	}
+	return 600 + i * 7919 % 30000;
+}
+
+static int
+quiet_at(long from, long to)
+{
+
+	for (long i = from; i < to; i++) {
+		if (sample(i) > QUIET || sample(i) < -QUIET) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void
+fail(const char *what, long at)
+{
+
+	fprintf(stderr, "writer-lame: %s at %ld\n", what, at);
+	exit(EXIT_FAILURE);
+}
+
+/* Hand over seconds of audio in chunks of varying size, waiting for every
+ * two blocks of it to be encoded, as a recorder keeping up would.
+ */
+static void
+record(struct audio_writer *w, long *fed, int seconds)
+{
+	static short pcm[2 * 5000];
+	long end = *fed + (long)seconds * RATE;
+
+	while (*fed < end) {
+		long wait = (*fed / (2 * BLOCK) + 1) * 2 * BLOCK;
+		int n = MIN(MIN(end, wait) - *fed, 1000 + *fed * 13 % 4000);
+
+		for (int i = 0; i < n; i++) {
+			pcm[2 * i] = sample(*fed + i);
+			pcm[2 * i + 1] = -pcm[2 * i];
+		}
+		w->write(w, pcm, n);
+		*fed += n;
+		if (*fed == wait) {
+			w->flush(w);
+		}
+	}
+}
+
+int
+main(void)
+{
+	int downs = 0, ups = 0;
+	long fed = 0, in = 0;
+	uint64_t extra = 0;
+	struct audio_writer *w;
+	FILE *out;
+
+	out = tmpfile();
+	if (out == NULL) {
+		perror("tmpfile");
+		exit(EXIT_FAILURE);
+	}
+
+	w = audio_writer_lame(out, RATE, 0, &adapt);
+	atomic_store(&ring_pct, 100);
+	record(w, &fed, BUSY_S);
+	atomic_store(&ring_pct, 0);
+	record(w, &fed, IDLE_S);
+	w->destroy(w);
+
+	if (fake_nstreams > FAKE_MAX_STREAMS) {
+		fail("too many streams", fake_nstreams);
+	}
+
+	rewind(out);
+	for (int s = 0; s < fake_nstreams; s++) {
+		struct fake_stream *fs = &fake_streams[s];
+
+		for (long i = 0; i < fs->out; i++) {
+			short v;
+
+			if (fread(&v, sizeof v, 1, out) != 1) {
+				fail("output ends early", in);
+			}
+			if (i >= FAKE_DELAY && i < FAKE_DELAY + fs->frames) {
+				if (v != sample(in++)) {
+					fail("frame lost or out of order", in - 1);
+				}
+			} else if (v != 0) {
+				fail("noise around a stream", in);
+			}
+		}
+
+		if (s + 1 == fake_nstreams) {
+			break;
+		}
+		extra += fs->out - fs->frames;
+
+		if (!quiet_at(in - FRAMESIZE, in + FRAMESIZE)) {
+			fail("change outside a quiet moment", in);
+		}
+		if (fake_streams[s + 1].quality > fs->quality) {
+			downs++;
+		} else {
+			ups++;
+		}
+	}
+
+	if (in != fed || fgetc(out) != EOF) {
+		fail("frames in and out differ", in);
+	}
+	if (extra != atomic_load(&added_frames)) {
+		fail("added frames misreported", (long)extra);
+	}
+	if (downs == 0 || ups == 0) {
+		fail("quality didn't go down and back up", downs);
+	}
+
+	printf("writer-lame: %ld frames through %d streams, %d down and %d up, "
+	    "%llu frames added\n", fed, fake_nstreams, downs, ups,
+	    (unsigned long long)extra);
+
+	return EXIT_SUCCESS;
+}
@@ -22,10 +22,15 @@ var getTimeout = (function() {
 	}
 })();
 
-var player = function(audioFile, containerElem, events) {
+/*
+ * keyframes is optional: the parsed lines of the cast's keyframe index
+ * (castty record -K), in order. Seeking then starts from the nearest one
+ * instead of replaying the whole cast.
+ */
+var player = function(audioFile, containerElem, events, keyframes) {
 	var Player = {};
 	
-	var init = function(audioFile, containerElem, events) {
+	var init = function(audioFile, containerElem, events, keyframes) {
 		Player.container = containerElem;
 
 		Player.termContainer = $('<div id="term"></div>')
@@ -59,23 +64,47 @@ var player = function(audioFile, containerElem, events) {
 		});
 
 		Player.termEvents = events.stdout;
+		Player.keyframes = keyframes || [];
 		Player.eventOff = 0;
 		Player.rem = 0;
 		Player.timerHandle = undefined;
 
 		Player.playTime = 0;
 
+		/* Last keyframe at or before t seconds */
+		Player.keyframeAt = function(t) {
+			var lo = 0, hi = Player.keyframes.length;
+
+			while (lo < hi) {
+				var mid = (lo + hi) >> 1;
+				if (Player.keyframes[mid].time <= t) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+
+			return lo ? Player.keyframes[lo - 1] : undefined;
+		};
+
 		Player.seekTo = function(t) {
 			var back = Player.eventOff &&
 			    Player.pos + Player.termEvents[Player.eventOff - 1][0] > (t / 1000);
+			var kf = Player.keyframeAt(t / 1000);
+			var i = back ? 0 : Player.eventOff;
 
-			if (back) {
+			/* Keyframes count events from after the empty first one */
+			if (kf && kf.event + 1 > i) {
+				Player.term.reset();
+				Player.term.write(kf.repaint);
+				Player.pos = kf.time;
+				i = kf.event + 1;
+			} else if (back) {
 				Player.term.clear();
 				Player.term.reset();
 				Player.pos = 0;
 			}
 
-			var i = back ? 0 : Player.eventOff;
 			var str = "";
 			while (i < Player.termEvents.length &&
 			    Player.pos + Player.termEvents[i][0] <= (t / 1000)) {
@@ -295,5 +324,5 @@ var player = function(audioFile, containerElem, events) {
 		}
 	});
 
-	return init(audioFile, containerElem, events);
+	return init(audioFile, containerElem, events, keyframes);
 }